@@ -32,6 +32,9 @@
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
 static const int qtest_latency_ns = NANOSECONDS_PER_SECOND / 1000;
 
+static unsigned block_acct_next_shard;
+static __thread unsigned block_acct_thread_shard; /* 1-based, 0 if unset */
+
 void block_acct_init(BlockAcctStats *stats)
 {
     qemu_mutex_init(&stats->lock);
@@ -47,12 +50,26 @@ void block_acct_setup(BlockAcctStats *stats, bool account_invalid,
     stats->account_failed = account_failed;
 }
 
+static void block_latency_histogram_free(BlockLatencyHistogram *hist)
+{
+    g_free(hist->boundaries);
+    qemu_vfree(hist->bins);
+    g_free(hist);
+}
+
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    int i;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        if (stats->latency_histogram[i]) {
+            block_latency_histogram_free(stats->latency_histogram[i]);
+        }
+    }
     qemu_mutex_destroy(&stats->lock);
 }
 
@@ -64,13 +81,13 @@ void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
     s = g_new0(BlockAcctTimedStats, 1);
     s->interval_length = interval_length;
     s->stats = stats;
-    qemu_mutex_lock(&stats->lock);
-    QSLIST_INSERT_HEAD(&stats->intervals, s, entries);
-
     for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
         timed_average_init(&s->latency[i], clock_type,
                            (uint64_t) interval_length * NANOSECONDS_PER_SECOND);
     }
+
+    qemu_mutex_lock(&stats->lock);
+    QSLIST_INSERT_HEAD(&stats->intervals, s, entries);
     qemu_mutex_unlock(&stats->lock);
 }
 
@@ -94,10 +111,49 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
     cookie->type = type;
 }
 
+/* Returns the index of the shard that the current thread updates */
+static unsigned block_acct_shard_index(void)
+{
+    if (!block_acct_thread_shard) {
+        block_acct_thread_shard =
+            atomic_fetch_inc(&block_acct_next_shard) % BLOCK_ACCT_SHARDS + 1;
+    }
+    return block_acct_thread_shard - 1;
+}
+
+static void block_latency_histogram_account(BlockAcctStats *stats,
+                                            enum BlockAcctType type,
+                                            unsigned shard,
+                                            int64_t latency_ns)
+{
+    BlockLatencyHistogram *hist;
+    int lo, hi;
+
+    rcu_read_lock();
+    hist = atomic_rcu_read(&stats->latency_histogram[type]);
+    if (hist) {
+        /* Find the first boundary that is greater than the latency */
+        lo = 0;
+        hi = hist->nbins - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if ((uint64_t)latency_ns < hist->boundaries[mid]) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        stat64_add(&hist->bins[shard * hist->stride + lo], 1);
+    }
+    rcu_read_unlock();
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
     BlockAcctTimedStats *s;
+    BlockAcctShard *shard;
+    unsigned shard_index;
     int64_t time_ns = qemu_clock_get_ns(clock_type);
     int64_t latency_ns = time_ns - cookie->start_time_ns;
 
@@ -107,25 +163,33 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
-    qemu_mutex_lock(&stats->lock);
+    shard_index = block_acct_shard_index();
+    shard = &stats->shards[shard_index];
 
     if (failed) {
-        stats->failed_ops[cookie->type]++;
+        stat64_add(&shard->failed_ops[cookie->type], 1);
     } else {
-        stats->nr_bytes[cookie->type] += cookie->bytes;
-        stats->nr_ops[cookie->type]++;
+        stat64_add(&shard->nr_bytes[cookie->type], cookie->bytes);
+        stat64_add(&shard->nr_ops[cookie->type], 1);
     }
 
     if (!failed || stats->account_failed) {
-        stats->total_time_ns[cookie->type] += latency_ns;
-        stats->last_access_time_ns = time_ns;
+        stat64_add(&shard->total_time_ns[cookie->type], latency_ns);
+        stat64_max(&shard->last_access_time_ns, time_ns);
+
+        block_latency_histogram_account(stats, cookie->type, shard_index,
+                                        latency_ns);
 
-        QSLIST_FOREACH(s, &stats->intervals, entries) {
-            timed_average_account(&s->latency[cookie->type], latency_ns);
+        /* Intervals are only added while the device is set up, so only
+         * take the lock if there are any */
+        if (atomic_read(&QSLIST_FIRST(&stats->intervals))) {
+            qemu_mutex_lock(&stats->lock);
+            QSLIST_FOREACH(s, &stats->intervals, entries) {
+                timed_average_account(&s->latency[cookie->type], latency_ns);
+            }
+            qemu_mutex_unlock(&stats->lock);
         }
     }
-
-    qemu_mutex_unlock(&stats->lock);
 }
 
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -140,34 +204,64 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
 
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type)
 {
+    BlockAcctShard *shard = &stats->shards[block_acct_shard_index()];
+
     assert(type < BLOCK_MAX_IOTYPE);
 
     /* block_account_one_io() updates total_time_ns[], but this one does
      * not.  The reason is that invalid requests are accounted during their
      * submission, therefore there's no actual I/O involved.
      */
-    qemu_mutex_lock(&stats->lock);
-    stats->invalid_ops[type]++;
+    stat64_add(&shard->invalid_ops[type], 1);
 
     if (stats->account_invalid) {
-        stats->last_access_time_ns = qemu_clock_get_ns(clock_type);
+        stat64_max(&shard->last_access_time_ns,
+                   qemu_clock_get_ns(clock_type));
     }
-    qemu_mutex_unlock(&stats->lock);
 }
 
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                       int num_requests)
 {
+    BlockAcctShard *shard = &stats->shards[block_acct_shard_index()];
+
     assert(type < BLOCK_MAX_IOTYPE);
 
-    qemu_mutex_lock(&stats->lock);
-    stats->merged[type] += num_requests;
-    qemu_mutex_unlock(&stats->lock);
+    stat64_add(&shard->merged[type], num_requests);
+}
+
+void block_acct_get_counters(BlockAcctStats *stats,
+                             BlockAcctCounters *counters)
+{
+    int i, type;
+
+    memset(counters, 0, sizeof(*counters));
+    for (i = 0; i < BLOCK_ACCT_SHARDS; i++) {
+        BlockAcctShard *shard = &stats->shards[i];
+        int64_t last_access = stat64_get(&shard->last_access_time_ns);
+
+        for (type = 0; type < BLOCK_MAX_IOTYPE; type++) {
+            counters->nr_bytes[type] += stat64_get(&shard->nr_bytes[type]);
+            counters->nr_ops[type] += stat64_get(&shard->nr_ops[type]);
+            counters->invalid_ops[type] +=
+                stat64_get(&shard->invalid_ops[type]);
+            counters->failed_ops[type] +=
+                stat64_get(&shard->failed_ops[type]);
+            counters->total_time_ns[type] +=
+                stat64_get(&shard->total_time_ns[type]);
+            counters->merged[type] += stat64_get(&shard->merged[type]);
+        }
+        counters->last_access_time_ns = MAX(counters->last_access_time_ns,
+                                            last_access);
+    }
 }
 
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
-    return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
+    BlockAcctCounters counters;
+
+    block_acct_get_counters(stats, &counters);
+    return qemu_clock_get_ns(clock_type) - counters.last_access_time_ns;
 }
 
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
@@ -183,3 +277,95 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 
     return (double) sum / elapsed;
 }
+
+/*
+ * Replaces the latency histogram for @type by an empty one with the given
+ * bin boundaries, or removes it if @boundaries is NULL.
+ *
+ * Returns -EINVAL if the boundaries are not strictly increasing.
+ */
+int block_latency_histogram_set(BlockAcctStats *stats,
+                                enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist = NULL, *old;
+    uint64List *entry;
+    uint64_t prev = 0;
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    if (boundaries) {
+        hist = g_new0(BlockLatencyHistogram, 1);
+        hist->nbins = 1;
+        for (entry = boundaries; entry; entry = entry->next) {
+            if (entry != boundaries && entry->value <= prev) {
+                g_free(hist);
+                return -EINVAL;
+            }
+            prev = entry->value;
+            hist->nbins++;
+        }
+
+        hist->boundaries = g_new(uint64_t, hist->nbins - 1);
+        for (entry = boundaries, i = 0; entry; entry = entry->next, i++) {
+            hist->boundaries[i] = entry->value;
+        }
+
+        /* Keep the bins of different shards in different cache lines */
+        hist->stride = QEMU_ALIGN_UP(hist->nbins, 64 / sizeof(Stat64));
+        hist->bins = qemu_memalign(64, BLOCK_ACCT_SHARDS * hist->stride *
+                                       sizeof(Stat64));
+        memset(hist->bins, 0,
+               BLOCK_ACCT_SHARDS * hist->stride * sizeof(Stat64));
+    }
+
+    old = stats->latency_histogram[type];
+    atomic_rcu_set(&stats->latency_histogram[type], hist);
+    if (old) {
+        call_rcu(old, block_latency_histogram_free, rcu);
+    }
+    return 0;
+}
+
+/*
+ * Returns the current state of the latency histogram for @type, or NULL if
+ * there is none.
+ */
+BlockLatencyHistogramInfo *
+block_latency_histogram_get(BlockAcctStats *stats, enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hist;
+    BlockLatencyHistogramInfo *info = NULL;
+    uint64List **p_boundary, **p_bin;
+    int i, j;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    rcu_read_lock();
+    hist = atomic_rcu_read(&stats->latency_histogram[type]);
+    if (!hist) {
+        goto out;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    p_boundary = &info->boundaries;
+    for (i = 0; i < hist->nbins - 1; i++) {
+        *p_boundary = g_new0(uint64List, 1);
+        (*p_boundary)->value = hist->boundaries[i];
+        p_boundary = &(*p_boundary)->next;
+    }
+
+    p_bin = &info->bins;
+    for (i = 0; i < hist->nbins; i++) {
+        *p_bin = g_new0(uint64List, 1);
+        for (j = 0; j < BLOCK_ACCT_SHARDS; j++) {
+            (*p_bin)->value += stat64_get(&hist->bins[j * hist->stride + i]);
+        }
+        p_bin = &(*p_bin)->next;
+    }
+
+out:
+    rcu_read_unlock();
+    return info;
+}
@@ -43,6 +43,8 @@ typedef struct BackupBlockJob {
     unsigned long *done_bitmap;
     int64_t cluster_size;
     bool compress;
+    /* Cleared when the source and target cannot offload copies */
+    bool use_copy_range;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
 } BackupBlockJob;
@@ -84,15 +86,82 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Copy one cluster through @bounce_buffer, which is allocated on first use */
+static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
+                                                      int64_t start, int n,
+                                                      bool *error_is_read,
+                                                      bool is_write_notifier,
+                                                      void **bounce_buffer)
+{
+    BlockBackend *blk = job->common.blk;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int ret;
+
+    if (!*bounce_buffer) {
+        *bounce_buffer = blk_blockalign(blk, job->cluster_size);
+    }
+    iov.iov_base = *bounce_buffer;
+    iov.iov_len = n;
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = blk_co_preadv(blk, start, bounce_qiov.size, &bounce_qiov,
+                        is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        return ret;
+    }
+
+    if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+        ret = blk_co_pwrite_zeroes(job->target, start,
+                                   bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
+    } else {
+        ret = blk_co_pwritev(job->target, start,
+                             bounce_qiov.size, &bounce_qiov,
+                             job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
+    }
+    if (ret < 0) {
+        trace_backup_do_cow_write_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = false;
+        }
+        return ret;
+    }
+
+    return 0;
+}
+
+/* Copy one cluster without a bounce buffer.  Returns -ENOTSUP if the
+ * source and target cannot offload the copy. */
+static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
+                                                int64_t start, int n,
+                                                bool *error_is_read,
+                                                bool is_write_notifier)
+{
+    int ret;
+
+    ret = blk_co_copy_range(job->common.blk, start, job->target, start, n,
+                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0,
+                            BDRV_REQ_NO_FALLBACK);
+    if (ret < 0 && ret != -ENOTSUP) {
+        trace_backup_do_cow_copy_range_fail(job, start, ret);
+        if (error_is_read) {
+            /* The copy does not tell which side failed */
+            *error_is_read = false;
+        }
+    }
+    return ret;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t offset, uint64_t bytes,
                                       bool *error_is_read,
                                       bool is_write_notifier)
 {
-    BlockBackend *blk = job->common.blk;
     CowRequest cow_request;
-    struct iovec iov;
-    QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t start, end; /* bytes */
@@ -118,36 +187,20 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
 
         n = MIN(job->cluster_size, job->common.len - start);
 
-        if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
-
-        ret = blk_co_preadv(blk, start, bounce_qiov.size, &bounce_qiov,
-                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        ret = -ENOTSUP;
+        if (job->use_copy_range) {
+            ret = backup_cow_with_offload(job, start, n, error_is_read,
+                                          is_write_notifier);
+            if (ret == -ENOTSUP) {
+                job->use_copy_range = false;
             }
-            goto out;
         }
-
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = blk_co_pwrite_zeroes(job->target, start,
-                                       bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = blk_co_pwritev(job->target, start,
-                                 bounce_qiov.size, &bounce_qiov,
-                                 job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
+        if (ret == -ENOTSUP) {
+            ret = backup_cow_with_bounce_buffer(job, start, n, error_is_read,
+                                                is_write_notifier,
+                                                &bounce_buffer);
         }
         if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
-            }
             goto out;
         }
 
@@ -362,21 +415,21 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
 {
     bool error_is_read;
     int ret = 0;
-    int clusters_per_iter;
-    uint32_t granularity;
-    int64_t offset;
+    uint64_t offset;
+    uint64_t bytes;
     int64_t cluster;
     int64_t end;
     int64_t last_cluster = -1;
     BdrvDirtyBitmapIter *dbi;
 
-    granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
-    clusters_per_iter = MAX((granularity / job->cluster_size), 1);
     dbi = bdrv_dirty_iter_new(job->sync_bitmap);
 
-    /* Find the next dirty sector(s) */
-    while ((offset = bdrv_dirty_iter_next(dbi)) >= 0) {
-        cluster = offset / job->cluster_size;
+    /* Find the next dirty area and copy all clusters it touches.  If the
+     * bitmap granularity is smaller than the cluster size, an area can
+     * start in the cluster where the previous one ended. */
+    while (bdrv_dirty_iter_next_area(dbi, job->common.len, &offset, &bytes)) {
+        cluster = MAX(offset / job->cluster_size, last_cluster + 1);
+        end = DIV_ROUND_UP(offset + bytes, job->cluster_size);
 
         /* Fake progress updates for any clusters we skipped */
         if (cluster != last_cluster + 1) {
@@ -384,7 +437,7 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
                                    job->cluster_size);
         }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
+        for (; cluster < end; cluster++) {
             do {
                 if (yield_and_check(job)) {
                     goto out;
@@ -400,12 +453,6 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
             } while (ret < 0);
         }
 
-        /* If the bitmap granularity is smaller than the backup granularity,
-         * we need to advance the iterator pointer to the next cluster. */
-        if (granularity < job->cluster_size) {
-            bdrv_set_dirty_iter(dbi, cluster * job->cluster_size);
-        }
-
         last_cluster = cluster - 1;
     }
 
@@ -631,6 +678,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
     job->compress = compress;
+    job->use_copy_range = !compress;
 
     /* If there is no backing file on the target, we cannot rely on COW if our
      * backup cluster size is smaller than the target cluster size. Even for
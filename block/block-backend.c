@@ -1497,6 +1497,74 @@ int blk_co_pdiscard(BlockBackend *blk, int64_t offset, int bytes)
     return bdrv_co_pdiscard(blk_bs(blk), offset, bytes);
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags read_flags,
+                                   BdrvRequestFlags write_flags)
+{
+    BlockDriverState *bs_in = blk_bs(blk_in);
+    BlockDriverState *bs_out = blk_bs(blk_out);
+    int ret;
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(bs_in);
+    bdrv_inc_in_flight(bs_out);
+
+    /* throttling disk I/O */
+    if (blk_in->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(
+                &blk_in->public.throttle_group_member, bytes, false);
+    }
+    if (blk_out->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(
+                &blk_out->public.throttle_group_member, bytes, true);
+    }
+
+    if (!blk_out->enable_write_cache) {
+        write_flags |= BDRV_REQ_FUA;
+    }
+
+    ret = bdrv_co_copy_range(blk_in->root, off_in, blk_out->root, off_out,
+                             bytes, read_flags, write_flags);
+    bdrv_dec_in_flight(bs_out);
+    bdrv_dec_in_flight(bs_in);
+    return ret;
+}
+
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int bytes, int out_fd)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    int ret;
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(bs);
+
+    ret = bdrv_co_sendfile(blk->root, offset, bytes, out_fd);
+
+    /* throttling disk I/O: a full socket makes the caller try again with
+     * whatever was not sent, so only the bytes sent count */
+    if (ret > 0 && blk->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(
+                &blk->public.throttle_group_member, ret, false);
+    }
+
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
 int blk_co_flush(BlockBackend *blk)
 {
     if (!blk_is_available(blk)) {
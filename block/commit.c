@@ -42,9 +42,11 @@ typedef struct CommitBlockJob {
     BlockdevOnError on_error;
     int base_flags;
     char *backing_file_str;
+    /* Cleared when top and base cannot offload copies */
+    bool use_copy_range;
 } CommitBlockJob;
 
-static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
+static int coroutine_fn commit_populate(CommitBlockJob *s,
                                         int64_t offset, uint64_t bytes,
                                         void *buf)
 {
@@ -56,14 +58,24 @@ static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
     };
 
     assert(bytes < SIZE_MAX);
+
+    if (s->use_copy_range) {
+        ret = blk_co_copy_range(s->top, offset, s->base, offset, bytes,
+                                0, BDRV_REQ_NO_FALLBACK);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+        s->use_copy_range = false;
+    }
+
     qemu_iovec_init_external(&qiov, &iov, 1);
 
-    ret = blk_co_preadv(bs, offset, qiov.size, &qiov, 0);
+    ret = blk_co_preadv(s->top, offset, qiov.size, &qiov, 0);
     if (ret < 0) {
         return ret;
     }
 
-    ret = blk_co_pwritev(base, offset, qiov.size, &qiov, 0);
+    ret = blk_co_pwritev(s->base, offset, qiov.size, &qiov, 0);
     if (ret < 0) {
         return ret;
     }
@@ -184,7 +196,7 @@ static void coroutine_fn commit_run(void *opaque)
         copy = (ret == 1);
         trace_commit_one_iteration(s, offset, n, ret);
         if (copy) {
-            ret = commit_populate(s->top, s->base, offset, n, buf);
+            ret = commit_populate(s, offset, n, buf);
             bytes_written += n;
         }
         if (ret < 0) {
@@ -384,6 +396,7 @@ void commit_start(const char *job_id, BlockDriverState *bs,
     s->base_flags = orig_base_flags;
     s->backing_file_str = g_strdup(backing_file_str);
     s->on_error = on_error;
+    s->use_copy_range = true;
 
     trace_commit_start(bs, base, top, s);
     block_job_start(&s->common);
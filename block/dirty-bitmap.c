@@ -55,6 +55,9 @@ struct BdrvDirtyBitmap {
     bool autoload;              /* For persistent bitmaps: bitmap must be
                                    autoloaded on image opening */
     bool persistent;            /* bitmap must be saved to owner disk image */
+    bool qmp_locked;            /* Bitmap is in use by an export or similar
+                                   user; it cannot be removed, cleared or
+                                   used by a block job until unlocked */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -186,6 +189,18 @@ bool bdrv_dirty_bitmap_frozen(BdrvDirtyBitmap *bitmap)
     return bitmap->successor;
 }
 
+/* Called with BQL taken.  */
+void bdrv_dirty_bitmap_set_qmp_locked(BdrvDirtyBitmap *bitmap, bool qmp_locked)
+{
+    bitmap->qmp_locked = qmp_locked;
+}
+
+/* Called with BQL taken.  */
+bool bdrv_dirty_bitmap_qmp_locked(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->qmp_locked;
+}
+
 /* Called with BQL taken.  */
 bool bdrv_dirty_bitmap_enabled(BdrvDirtyBitmap *bitmap)
 {
@@ -197,6 +212,8 @@ DirtyBitmapStatus bdrv_dirty_bitmap_status(BdrvDirtyBitmap *bitmap)
 {
     if (bdrv_dirty_bitmap_frozen(bitmap)) {
         return DIRTY_BITMAP_STATUS_FROZEN;
+    } else if (bdrv_dirty_bitmap_qmp_locked(bitmap)) {
+        return DIRTY_BITMAP_STATUS_LOCKED;
     } else if (!bdrv_dirty_bitmap_enabled(bitmap)) {
         return DIRTY_BITMAP_STATUS_DISABLED;
     } else {
@@ -220,6 +237,11 @@ int bdrv_dirty_bitmap_create_successor(BlockDriverState *bs,
                    "currently frozen");
         return -1;
     }
+    if (bdrv_dirty_bitmap_qmp_locked(bitmap)) {
+        error_setg(errp, "Cannot create a successor for a bitmap that is "
+                   "currently locked");
+        return -1;
+    }
     assert(!bitmap->successor);
 
     /* Create an anonymous successor */
@@ -501,6 +523,27 @@ int64_t bdrv_dirty_iter_next(BdrvDirtyBitmapIter *iter)
     return hbitmap_iter_next(&iter->hbi);
 }
 
+/* Called within bdrv_dirty_bitmap_lock..unlock */
+bool bdrv_dirty_iter_next_area(BdrvDirtyBitmapIter *iter, uint64_t max_offset,
+                               uint64_t *offset, uint64_t *bytes)
+{
+    return hbitmap_iter_next_area(&iter->hbi, max_offset, offset, bytes);
+}
+
+/* Called within bdrv_dirty_bitmap_lock..unlock */
+int64_t bdrv_dirty_bitmap_next_zero(BdrvDirtyBitmap *bitmap, uint64_t offset,
+                                    uint64_t bytes)
+{
+    return hbitmap_next_zero(bitmap->bitmap, offset, bytes);
+}
+
+/* Called within bdrv_dirty_bitmap_lock..unlock */
+bool bdrv_dirty_bitmap_next_dirty_area(BdrvDirtyBitmap *bitmap,
+                                       uint64_t *offset, uint64_t *bytes)
+{
+    return hbitmap_next_dirty_area(bitmap->bitmap, offset, bytes);
+}
+
 /* Called within bdrv_dirty_bitmap_lock..unlock */
 void bdrv_set_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap,
                                   int64_t offset, int64_t bytes)
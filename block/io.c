@@ -1047,6 +1047,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BdrvChild *child,
             }
 
             bdrv_debug_event(bs, BLKDBG_COR_WRITE);
+            bdrv_unalloc_cache_drop(bs, cluster_offset, pnum);
             if (drv->bdrv_co_pwrite_zeroes &&
                 buffer_is_zero(bounce_buffer, pnum)) {
                 /* FIXME: Should we (perhaps conditionally) be setting
@@ -1060,6 +1061,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BdrvChild *child,
                 ret = bdrv_driver_pwritev(bs, cluster_offset, pnum,
                                           &local_qiov, 0);
             }
+            bdrv_unalloc_cache_drop(bs, cluster_offset, pnum);
 
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
@@ -1442,6 +1444,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BdrvChild *child,
     assert(end_sector <= bs->total_sectors || child->perm & BLK_PERM_RESIZE);
 
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, req);
+    bdrv_unalloc_cache_drop(bs, offset, bytes);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
         !(flags & BDRV_REQ_ZERO_WRITE) && drv->bdrv_co_pwrite_zeroes &&
@@ -1492,6 +1495,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BdrvChild *child,
 
     atomic_inc(&bs->write_gen);
     bdrv_set_dirty(bs, offset, bytes);
+    bdrv_unalloc_cache_drop(bs, offset, bytes);
 
     stat64_max(&bs->wr_highest_offset, offset + bytes);
 
@@ -1785,6 +1789,58 @@ int bdrv_flush_all(void)
 }
 
 
+/* Upper limit for the size of a node's unallocated range cache; if a very
+ * fragmented image exceeds it, the cache simply starts over */
+#define BDRV_UNALLOC_CACHE_MAX_EXTENTS 65536
+
+/*
+ * Only format drivers get the cache: their allocation status is changed by
+ * nobody but QEMU itself, while a protocol driver like iscsi may be accessed
+ * by others.  Shared images and inactive nodes may be written by another
+ * process, too.
+ */
+static bool bdrv_unalloc_cache_usable(BlockDriverState *bs)
+{
+    return !bs->drv->protocol_name && !bs->force_share &&
+           !(bs->open_flags & BDRV_O_INACTIVE);
+}
+
+static void bdrv_unalloc_cache_add(BlockDriverState *bs, int64_t offset,
+                                   int64_t bytes, unsigned int gen)
+{
+    if (!bdrv_unalloc_cache_usable(bs) || bytes <= 0 ||
+        gen != bs->unalloc_cache_gen) {
+        return;
+    }
+
+    if (!bs->unalloc_cache) {
+        bs->unalloc_cache = extent_set_new();
+    } else if (extent_set_nb_extents(bs->unalloc_cache) >=
+               BDRV_UNALLOC_CACHE_MAX_EXTENTS) {
+        extent_set_clear(bs->unalloc_cache);
+    }
+    extent_set_add(bs->unalloc_cache, offset, bytes);
+}
+
+/* Forget about [offset, offset + bytes) being unallocated in @bs */
+void bdrv_unalloc_cache_drop(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes)
+{
+    bs->unalloc_cache_gen++;
+    if (bs->unalloc_cache && bytes > 0) {
+        extent_set_remove(bs->unalloc_cache, offset, bytes);
+    }
+}
+
+/* Forget about all unallocated ranges of @bs */
+void bdrv_unalloc_cache_clear(BlockDriverState *bs)
+{
+    bs->unalloc_cache_gen++;
+    if (bs->unalloc_cache) {
+        extent_set_clear(bs->unalloc_cache);
+    }
+}
+
 typedef struct BdrvCoBlockStatusData {
     BlockDriverState *bs;
     BlockDriverState *base;
@@ -1864,6 +1920,7 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     BlockDriverState *local_file = NULL;
     int64_t aligned_offset, aligned_bytes;
     uint32_t align;
+    unsigned int cache_gen;
 
     assert(pnum);
     *pnum = 0;
@@ -1905,6 +1962,16 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
 
     bdrv_inc_in_flight(bs);
 
+    if (bs->unalloc_cache && bdrv_unalloc_cache_usable(bs)) {
+        *pnum = extent_set_count(bs->unalloc_cache, offset, bytes);
+        if (*pnum) {
+            trace_bdrv_co_block_status_cached(bs, offset, *pnum);
+            ret = 0;
+            goto unallocated;
+        }
+    }
+    cache_gen = bs->unalloc_cache_gen;
+
     /* Round out to request_alignment boundaries */
     /* TODO: until we have a byte-based driver callback, we also have to
      * round out to sectors, even if that is bigger than request_alignment */
@@ -1959,6 +2026,12 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
         goto out;
     }
 
+    if (!(ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO |
+                 BDRV_BLOCK_OFFSET_VALID))) {
+        bdrv_unalloc_cache_add(bs, offset, *pnum, cache_gen);
+    }
+
+unallocated:
     if (ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) {
         ret |= BDRV_BLOCK_ALLOCATED;
     } else if (want_zero) {
@@ -2540,6 +2613,7 @@ int coroutine_fn bdrv_co_pdiscard(BlockDriverState *bs, int64_t offset,
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_DISCARD);
 
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
+    bdrv_unalloc_cache_drop(bs, offset, bytes);
     if (ret < 0) {
         goto out;
     }
@@ -2607,6 +2681,9 @@ int coroutine_fn bdrv_co_pdiscard(BlockDriverState *bs, int64_t offset,
 out:
     atomic_inc(&bs->write_gen);
     bdrv_set_dirty(bs, req.offset, req.bytes);
+    /* Discarding a cluster may turn it into a zero cluster that hides the
+     * backing file, so this counts as allocation */
+    bdrv_unalloc_cache_drop(bs, req.offset, req.bytes);
     tracked_request_end(&req);
     bdrv_dec_in_flight(bs);
     return ret;
@@ -2663,6 +2740,240 @@ out:
     return co.ret;
 }
 
+/* Maximum size of the bounce buffer for copy_range requests without offload */
+#define BDRV_COPY_RANGE_BOUNCE_SIZE (1 * 1024 * 1024)
+
+/*
+ * Copies @bytes from @src to @dst through a bounce buffer, used when no
+ * driver in the chain can offload the copy.
+ */
+static int coroutine_fn bdrv_co_copy_range_bounce(BdrvChild *src,
+                                                  uint64_t src_offset,
+                                                  BdrvChild *dst,
+                                                  uint64_t dst_offset,
+                                                  uint64_t bytes,
+                                                  BdrvRequestFlags read_flags,
+                                                  BdrvRequestFlags write_flags)
+{
+    uint64_t buf_size = MIN(bytes, BDRV_COPY_RANGE_BOUNCE_SIZE);
+    QEMUIOVector qiov;
+    struct iovec iov;
+    void *buf;
+    int ret = 0;
+
+    buf = qemu_try_blockalign(src->bs, buf_size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    while (bytes) {
+        uint64_t num = MIN(bytes, buf_size);
+
+        iov = (struct iovec) {
+            .iov_base   = buf,
+            .iov_len    = num,
+        };
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_preadv(src, src_offset, num, &qiov, read_flags);
+        if (ret < 0) {
+            break;
+        }
+        ret = bdrv_co_pwritev(dst, dst_offset, num, &qiov, write_flags);
+        if (ret < 0) {
+            break;
+        }
+
+        src_offset += num;
+        dst_offset += num;
+        bytes -= num;
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn bdrv_co_copy_range_internal(BdrvChild *src,
+                                                    uint64_t src_offset,
+                                                    BdrvChild *dst,
+                                                    uint64_t dst_offset,
+                                                    uint64_t bytes,
+                                                    BdrvRequestFlags read_flags,
+                                                    BdrvRequestFlags write_flags,
+                                                    bool recurse_src)
+{
+    BdrvTrackedRequest req;
+    BlockDriverState *bs;
+    int ret;
+
+    if (!dst || !dst->bs || !dst->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_byte_request(dst->bs, dst_offset, bytes);
+    if (ret) {
+        return ret;
+    }
+    if (write_flags & BDRV_REQ_ZERO_WRITE) {
+        return bdrv_co_pwrite_zeroes(dst, dst_offset, bytes,
+                                     write_flags & ~BDRV_REQ_NO_FALLBACK);
+    }
+
+    if (!src || !src->bs || !src->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_byte_request(src->bs, src_offset, bytes);
+    if (ret) {
+        return ret;
+    }
+
+    if (!src->bs->drv->bdrv_co_copy_range_from ||
+        !dst->bs->drv->bdrv_co_copy_range_to ||
+        src->bs->encrypted || dst->bs->encrypted) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        bs = src->bs;
+        bdrv_inc_in_flight(bs);
+        tracked_request_begin(&req, bs, src_offset, bytes, BDRV_TRACKED_READ);
+        if (!(read_flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+
+        ret = bs->drv->bdrv_co_copy_range_from(bs, src, src_offset,
+                                               dst, dst_offset, bytes,
+                                               read_flags, write_flags);
+    } else {
+        int64_t end_sector = DIV_ROUND_UP(dst_offset + bytes,
+                                          BDRV_SECTOR_SIZE);
+
+        bs = dst->bs;
+        if (bs->read_only) {
+            return -EPERM;
+        }
+        if (bdrv_has_readonly_bitmaps(bs)) {
+            return -EPERM;
+        }
+        assert(!(bs->open_flags & BDRV_O_INACTIVE));
+        assert(dst->perm & BLK_PERM_WRITE);
+        assert(end_sector <= bs->total_sectors || dst->perm & BLK_PERM_RESIZE);
+
+        bdrv_inc_in_flight(bs);
+        tracked_request_begin(&req, bs, dst_offset, bytes,
+                              BDRV_TRACKED_WRITE);
+        wait_serialising_requests(&req);
+
+        ret = notifier_with_return_list_notify(&bs->before_write_notifiers,
+                                               &req);
+        bdrv_unalloc_cache_drop(bs, dst_offset, bytes);
+        if (ret == 0) {
+            ret = bs->drv->bdrv_co_copy_range_to(bs, src, src_offset,
+                                                 dst, dst_offset, bytes,
+                                                 read_flags, write_flags);
+        }
+
+        atomic_inc(&bs->write_gen);
+        bdrv_set_dirty(bs, dst_offset, bytes);
+        bdrv_unalloc_cache_drop(bs, dst_offset, bytes);
+        stat64_max(&bs->wr_highest_offset, dst_offset + bytes);
+        if (ret >= 0) {
+            bs->total_sectors = MAX(bs->total_sectors, end_sector);
+        }
+    }
+
+    trace_bdrv_co_copy_range(bs, src_offset, dst_offset, bytes, recurse_src,
+                             ret);
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
+/* Copy range from @src to @dst.
+ *
+ * See the comment of bdrv_co_copy_range for the parameter and return value
+ * semantics. */
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags read_flags,
+                                         BdrvRequestFlags write_flags)
+{
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, read_flags, write_flags, true);
+}
+
+/* Copy range from @src to @dst.
+ *
+ * See the comment of bdrv_co_copy_range for the parameter and return value
+ * semantics. */
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes,
+                                       BdrvRequestFlags read_flags,
+                                       BdrvRequestFlags write_flags)
+{
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, read_flags, write_flags, false);
+}
+
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes,
+                                    BdrvRequestFlags read_flags,
+                                    BdrvRequestFlags write_flags)
+{
+    int ret;
+
+    ret = bdrv_co_copy_range_from(src, src_offset, dst, dst_offset, bytes,
+                                  read_flags, write_flags);
+    if (ret == 0 && (write_flags & BDRV_REQ_FUA) &&
+        !(write_flags & BDRV_REQ_ZERO_WRITE)) {
+        /* Drivers don't implement FUA for offloaded copies */
+        ret = bdrv_co_flush(dst->bs);
+    }
+    if (ret != -ENOTSUP || (write_flags & BDRV_REQ_NO_FALLBACK)) {
+        return ret;
+    }
+
+    return bdrv_co_copy_range_bounce(src, src_offset, dst, dst_offset, bytes,
+                                     read_flags, write_flags);
+}
+
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, uint64_t offset,
+                                  uint64_t bytes, int out_fd)
+{
+    BlockDriverState *bs = child->bs;
+    BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_byte_request(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Copy-on-read and unaligned requests need the data in memory */
+    if (!drv->bdrv_co_sendfile || bs->encrypted ||
+        atomic_read(&bs->copy_on_read) ||
+        !QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    wait_serialising_requests(&req);
+
+    ret = drv->bdrv_co_sendfile(bs, offset, bytes, out_fd);
+    trace_bdrv_co_sendfile(bs, offset, bytes, out_fd, ret);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
 void *qemu_blockalign(BlockDriverState *bs, size_t size)
 {
     return qemu_memalign(bdrv_opt_mem_align(bs), size);
@@ -73,6 +73,8 @@ typedef struct MirrorBlockJob {
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
+    /* Cleared when the source and target cannot offload copies */
+    bool use_copy_range;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -174,6 +176,29 @@ static void mirror_read_complete(void *opaque, int ret)
     aio_context_release(blk_get_aio_context(s->common.blk));
 }
 
+/* Copy the range of @op without going through the job's buffers if the
+ * source and target nodes can offload it; the buffers of @op are only used
+ * if they cannot.  Errors are attributed to the target because the copy
+ * does not tell which side failed.
+ */
+static void coroutine_fn mirror_co_copy_range(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    ret = blk_co_copy_range(s->common.blk, op->offset, s->target, op->offset,
+                            op->bytes, 0, BDRV_REQ_NO_FALLBACK);
+    trace_mirror_copy_range(s, op->offset, op->bytes, ret);
+    if (ret == -ENOTSUP) {
+        s->use_copy_range = false;
+        ret = blk_co_preadv(s->common.blk, op->offset, op->bytes, &op->qiov, 0);
+        mirror_read_complete(op, ret);
+        return;
+    }
+    mirror_write_complete(op, ret);
+}
+
 /* Clip bytes relative to offset to not exceed end-of-file */
 static inline int64_t mirror_clip_bytes(MirrorBlockJob *s,
                                         int64_t offset,
@@ -291,7 +316,12 @@ static uint64_t mirror_do_read(MirrorBlockJob *s, int64_t offset,
     s->bytes_in_flight += bytes;
     trace_mirror_one_iteration(s, offset, bytes);
 
-    blk_aio_preadv(source, offset, &op->qiov, 0, mirror_read_complete, op);
+    if (s->use_copy_range) {
+        Coroutine *co = qemu_coroutine_create(mirror_co_copy_range, op);
+        qemu_coroutine_enter(co);
+    } else {
+        blk_aio_preadv(source, offset, &op->qiov, 0, mirror_read_complete, op);
+    }
     return ret;
 }
 
@@ -324,10 +354,11 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->source;
-    int64_t offset, first_chunk;
+    int64_t offset, first_chunk, next_clean;
     uint64_t delay_ns = 0;
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
+    int max_chunks;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
     int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
 
@@ -349,34 +380,25 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 
     block_job_pause_point(&s->common);
 
-    /* Find the number of consective dirty chunks following the first dirty
-     * one, and wait for in flight requests in them. */
+    /* Find the number of consecutive dirty chunks following the first dirty
+     * one, stopping at the first chunk that has requests in flight. */
+    max_chunks = MIN(DIV_ROUND_UP(s->buf_size, s->granularity),
+                     DIV_ROUND_UP(s->bdev_length - offset, s->granularity));
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    while (nb_chunks * s->granularity < s->buf_size) {
-        int64_t next_dirty;
-        int64_t next_offset = offset + nb_chunks * s->granularity;
-        int64_t next_chunk = next_offset / s->granularity;
-        if (next_offset >= s->bdev_length ||
-            !bdrv_get_dirty_locked(source, s->dirty_bitmap, next_offset)) {
-            break;
-        }
-        if (test_bit(next_chunk, s->in_flight_bitmap)) {
-            break;
-        }
-
-        next_dirty = bdrv_dirty_iter_next(s->dbi);
-        if (next_dirty > next_offset || next_dirty < 0) {
-            /* The bitmap iterator's cache is stale, refresh it */
-            bdrv_set_dirty_iter(s->dbi, next_offset);
-            next_dirty = bdrv_dirty_iter_next(s->dbi);
-        }
-        assert(next_dirty == next_offset);
-        nb_chunks++;
+    next_clean = bdrv_dirty_bitmap_next_zero(s->dirty_bitmap, offset,
+                                             max_chunks * s->granularity);
+    if (next_clean < 0) {
+        nb_chunks = MAX(max_chunks, 1);
+    } else {
+        nb_chunks = MAX((next_clean - offset) / s->granularity, 1);
     }
+    nb_chunks = find_next_bit(s->in_flight_bitmap, first_chunk + nb_chunks,
+                              first_chunk + 1) - first_chunk;
 
     /* Clear dirty bits before querying the block status, because
      * calling bdrv_block_status_above could yield - if some blocks are
-     * marked dirty in this window, we need to know.
+     * marked dirty in this window, we need to know.  This also makes the
+     * iterator skip the area, as it ignores bits that were reset.
      */
     bdrv_reset_dirty_bitmap_locked(s->dirty_bitmap, offset,
                                    nb_chunks * s->granularity);
@@ -1033,6 +1055,22 @@ static int coroutine_fn bdrv_mirror_top_pwritev(BlockDriverState *bs,
     return bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
 }
 
+static int coroutine_fn bdrv_mirror_top_copy_range_from(BlockDriverState *bs,
+    BdrvChild *src, uint64_t src_offset, BdrvChild *dst, uint64_t dst_offset,
+    uint64_t bytes, BdrvRequestFlags read_flags, BdrvRequestFlags write_flags)
+{
+    return bdrv_co_copy_range_from(bs->backing, src_offset, dst, dst_offset,
+                                   bytes, read_flags, write_flags);
+}
+
+static int coroutine_fn bdrv_mirror_top_copy_range_to(BlockDriverState *bs,
+    BdrvChild *src, uint64_t src_offset, BdrvChild *dst, uint64_t dst_offset,
+    uint64_t bytes, BdrvRequestFlags read_flags, BdrvRequestFlags write_flags)
+{
+    return bdrv_co_copy_range_to(src, src_offset, bs->backing, dst_offset,
+                                 bytes, read_flags, write_flags);
+}
+
 static int coroutine_fn bdrv_mirror_top_flush(BlockDriverState *bs)
 {
     if (bs->backing == NULL) {
@@ -1093,6 +1131,8 @@ static BlockDriver bdrv_mirror_top = {
     .bdrv_co_pwritev            = bdrv_mirror_top_pwritev,
     .bdrv_co_pwrite_zeroes      = bdrv_mirror_top_pwrite_zeroes,
     .bdrv_co_pdiscard           = bdrv_mirror_top_pdiscard,
+    .bdrv_co_copy_range_from    = bdrv_mirror_top_copy_range_from,
+    .bdrv_co_copy_range_to      = bdrv_mirror_top_copy_range_to,
     .bdrv_co_flush              = bdrv_mirror_top_flush,
     .bdrv_co_get_block_status   = bdrv_co_get_block_status_from_backing,
     .bdrv_refresh_filename      = bdrv_mirror_top_refresh_filename,
@@ -1219,6 +1259,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->use_copy_range = true;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -29,12 +29,15 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/clone-visitor.h"
 #include "nbd-client.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
 
-static void nbd_recv_coroutines_wake_all(NBDClientSession *s)
+static void nbd_recv_coroutines_wake_all(NBDClientConnection *s)
 {
     int i;
 
@@ -47,30 +50,43 @@ static void nbd_recv_coroutines_wake_all(NBDClientSession *s)
     }
 }
 
+/* Drops the channel of a connection whose reply coroutine is not running */
+static void nbd_connection_release(NBDClientConnection *s)
+{
+    assert(!s->read_reply_co);
+
+    qio_channel_detach_aio_context(s->ioc);
+    object_unref(OBJECT(s->sioc));
+    s->sioc = NULL;
+    object_unref(OBJECT(s->ioc));
+    s->ioc = NULL;
+}
+
 static void nbd_teardown_connection(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
+    int i;
 
-    if (!client->ioc) { /* Already closed */
-        return;
-    }
+    for (i = 0; i < client->num_conns; i++) {
+        NBDClientConnection *s = &client->conns[i];
+
+        if (!s->ioc) { /* Already closed */
+            continue;
+        }
 
-    /* finish any pending coroutines */
-    qio_channel_shutdown(client->ioc,
-                         QIO_CHANNEL_SHUTDOWN_BOTH,
-                         NULL);
-    BDRV_POLL_WHILE(bs, client->read_reply_co);
+        /* finish any pending coroutines */
+        qio_channel_shutdown(s->ioc,
+                             QIO_CHANNEL_SHUTDOWN_BOTH,
+                             NULL);
+        BDRV_POLL_WHILE(bs, s->read_reply_co);
 
-    nbd_client_detach_aio_context(bs);
-    object_unref(OBJECT(client->sioc));
-    client->sioc = NULL;
-    object_unref(OBJECT(client->ioc));
-    client->ioc = NULL;
+        nbd_connection_release(s);
+    }
 }
 
 static coroutine_fn void nbd_read_reply_entry(void *opaque)
 {
-    NBDClientSession *s = opaque;
+    NBDClientConnection *s = opaque;
     uint64_t i;
     int ret = 0;
     Error *local_err = NULL;
@@ -118,11 +134,10 @@ static coroutine_fn void nbd_read_reply_entry(void *opaque)
     s->read_reply_co = NULL;
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDClientConnection *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     int rc, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -269,7 +284,7 @@ static int nbd_parse_error_payload(NBDStructuredReplyChunk *chunk,
     return 0;
 }
 
-static int nbd_co_receive_offset_data_payload(NBDClientSession *s,
+static int nbd_co_receive_offset_data_payload(NBDClientConnection *s,
                                               uint64_t orig_offset,
                                               QEMUIOVector *qiov, Error **errp)
 {
@@ -314,7 +329,7 @@ static int nbd_co_receive_offset_data_payload(NBDClientSession *s,
 /* nbd_co_receive_structured_payload
  */
 static coroutine_fn int nbd_co_receive_structured_payload(
-        NBDClientSession *s, void **payload, Error **errp)
+        NBDClientConnection *s, void **payload, Error **errp)
 {
     int ret;
     uint32_t len;
@@ -363,7 +378,7 @@ static coroutine_fn int nbd_co_receive_structured_payload(
  * corresponding to the server's error reply), and errp is unchanged.
  */
 static coroutine_fn int nbd_co_do_receive_one_chunk(
-        NBDClientSession *s, uint64_t handle, bool only_structured,
+        NBDClientConnection *s, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, void **payload, Error **errp)
 {
     int ret;
@@ -454,7 +469,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
  * Return value is a fatal error code or normal nbd reply error code
  */
 static coroutine_fn int nbd_co_receive_one_chunk(
-        NBDClientSession *s, uint64_t handle, bool only_structured,
+        NBDClientConnection *s, uint64_t handle, bool only_structured,
         QEMUIOVector *qiov, NBDReply *reply, void **payload, Error **errp)
 {
     int request_ret;
@@ -513,7 +528,7 @@ static void nbd_iter_error(NBDReplyChunkIter *iter, bool fatal,
 
 /* nbd_reply_chunk_iter_receive
  */
-static bool nbd_reply_chunk_iter_receive(NBDClientSession *s,
+static bool nbd_reply_chunk_iter_receive(NBDClientConnection *s,
                                          NBDReplyChunkIter *iter,
                                          uint64_t handle,
                                          QEMUIOVector *qiov, NBDReply *reply,
@@ -578,8 +593,8 @@ break_loop:
     return false;
 }
 
-static int nbd_co_receive_return_code(NBDClientSession *s, uint64_t handle,
-                                      Error **errp)
+static int nbd_co_receive_return_code(NBDClientConnection *s,
+                                      uint64_t handle, Error **errp)
 {
     NBDReplyChunkIter iter;
 
@@ -591,9 +606,9 @@ static int nbd_co_receive_return_code(NBDClientSession *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_cmdread_reply(NBDClientSession *s, uint64_t handle,
-                                        uint64_t offset, QEMUIOVector *qiov,
-                                        Error **errp)
+static int nbd_co_receive_cmdread_reply(NBDClientConnection *s,
+                                        uint64_t handle, uint64_t offset,
+                                        QEMUIOVector *qiov, Error **errp)
 {
     NBDReplyChunkIter iter;
     NBDReply reply;
@@ -640,12 +655,307 @@ static int nbd_co_receive_cmdread_reply(NBDClientSession *s, uint64_t handle,
     return iter.ret;
 }
 
+static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
+                                                  Error **errp)
+{
+    QIOChannelSocket *sioc;
+    Error *local_err = NULL;
+
+    sioc = qio_channel_socket_new();
+    qio_channel_set_name(QIO_CHANNEL(sioc), "nbd-client");
+
+    qio_channel_socket_connect_sync(sioc,
+                                    saddr,
+                                    &local_err);
+    if (local_err) {
+        object_unref(OBJECT(sioc));
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    qio_channel_set_delay(QIO_CHANNEL(sioc), false);
+
+    return sioc;
+}
+
+/* Connects @s to the server and negotiates the export.  The reply coroutine
+ * is only started by nbd_connection_start(), so that the caller can still
+ * check the result of the negotiation.  */
+static int nbd_connection_open(NBDClientSession *client,
+                               NBDClientConnection *s, Error **errp)
+{
+    QIOChannelSocket *sioc;
+    int ret;
+
+    /* establish TCP connection, return error if it fails
+     * TODO: Configurable retry-until-timeout behaviour.
+     */
+    sioc = nbd_establish_connection(client->saddr, errp);
+    if (!sioc) {
+        return -ECONNREFUSED;
+    }
+
+    /* NBD handshake */
+    logout("session init %s\n", client->export);
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
+
+    s->info.request_sizes = true;
+    s->info.structured_reply = true;
+    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), client->export,
+                                client->tlscreds, client->hostname,
+                                &s->ioc, &s->info, errp);
+    if (ret < 0) {
+        logout("Failed to negotiate with the NBD server\n");
+        object_unref(OBJECT(sioc));
+        return ret;
+    }
+
+    s->sioc = sioc;
+    if (!s->ioc) {
+        s->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(s->ioc));
+    }
+
+    return 0;
+}
+
+/* All connections must talk to the same export, and the requests sent on
+ * them are built from what the first connection negotiated.  */
+static bool nbd_connection_check_info(NBDClientSession *client,
+                                      NBDClientConnection *s, Error **errp)
+{
+    if (s->info.size != client->info.size ||
+        s->info.flags != client->info.flags ||
+        s->info.structured_reply != client->info.structured_reply ||
+        s->info.min_block != client->info.min_block ||
+        s->info.max_block != client->info.max_block)
+    {
+        error_setg(errp, "NBD server offered a different export on "
+                   "connection %d", (int)(s - client->conns));
+        return false;
+    }
+
+    return true;
+}
+
+static void nbd_connection_start(BlockDriverState *bs, NBDClientConnection *s)
+{
+    AioContext *ctx = bdrv_get_aio_context(bs);
+
+    /* Now that we're connected, set the socket to be non-blocking and
+     * kick the reply mechanism.  */
+    qio_channel_set_blocking(QIO_CHANNEL(s->sioc), false, NULL);
+    s->quit = false;
+    s->reply.handle = 0;
+    s->read_reply_co = qemu_coroutine_create(nbd_read_reply_entry, s);
+    qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), ctx);
+    aio_co_schedule(ctx, s->read_reply_co);
+}
+
+/* A connection attempt running in its own thread, so that neither the TCP
+ * connect nor the handshake block the AioContext.  The thread works on
+ * copies of the connection parameters, so that the attempt can simply be
+ * abandoned if the BDS is closed before it completes.  */
+struct NBDClientReconnect {
+    QemuMutex mutex;
+    bool done;              /* the thread has finished */
+    bool abandoned;         /* nobody is interested in the result anymore */
+
+    NBDClientSession params;
+    NBDClientConnection conn;
+    int ret;
+    Error *err;
+};
+
+static void nbd_reconnect_free(NBDClientReconnect *rc)
+{
+    /* The channels of an unused connection were never attached to an
+     * AioContext, so they can be dropped from any thread */
+    if (rc->conn.ioc) {
+        object_unref(OBJECT(rc->conn.sioc));
+        object_unref(OBJECT(rc->conn.ioc));
+    }
+    error_free(rc->err);
+    qapi_free_SocketAddress(rc->params.saddr);
+    g_free((char *)rc->params.export);
+    g_free((char *)rc->params.hostname);
+    if (rc->params.tlscreds) {
+        object_unref(OBJECT(rc->params.tlscreds));
+    }
+    qemu_mutex_destroy(&rc->mutex);
+    g_free(rc);
+}
+
+static void *nbd_reconnect_thread(void *opaque)
+{
+    NBDClientReconnect *rc = opaque;
+    bool abandoned;
+
+    rc->ret = nbd_connection_open(&rc->params, &rc->conn, &rc->err);
+
+    qemu_mutex_lock(&rc->mutex);
+    rc->done = true;
+    abandoned = rc->abandoned;
+    qemu_mutex_unlock(&rc->mutex);
+
+    if (abandoned) {
+        nbd_reconnect_free(rc);
+    }
+    return NULL;
+}
+
+static void nbd_reconnect_start(NBDClientSession *client,
+                                NBDClientConnection *s)
+{
+    NBDClientReconnect *rc = g_new0(NBDClientReconnect, 1);
+    QemuThread thread;
+
+    qemu_mutex_init(&rc->mutex);
+    rc->params.saddr = QAPI_CLONE(SocketAddress, client->saddr);
+    rc->params.export = g_strdup(client->export);
+    rc->params.hostname = g_strdup(client->hostname);
+    if (client->tlscreds) {
+        object_ref(OBJECT(client->tlscreds));
+    }
+    rc->params.tlscreds = client->tlscreds;
+
+    s->reconnect = rc;
+    qemu_thread_create(&thread, "nbd-reconnect", nbd_reconnect_thread, rc,
+                       QEMU_THREAD_DETACHED);
+}
+
+/* Drops the connection attempt of @s; if the thread is still running, it
+ * frees the attempt itself when it is done.  */
+static void nbd_reconnect_cancel(NBDClientConnection *s)
+{
+    NBDClientReconnect *rc = s->reconnect;
+    bool done;
+
+    qemu_mutex_lock(&rc->mutex);
+    done = rc->done;
+    rc->abandoned = true;
+    qemu_mutex_unlock(&rc->mutex);
+
+    if (done) {
+        nbd_reconnect_free(rc);
+    }
+    s->reconnect = NULL;
+}
+
+/* Tries to reestablish a lost connection that has no requests left.  The
+ * connection is opened by a separate thread; it is put to use by the first
+ * request that comes along after the thread has finished.  Attempts are
+ * rate limited so that a server that is down does not cause a thread to
+ * be started for every request.  */
+static void coroutine_fn nbd_co_reconnect(BlockDriverState *bs,
+                                          NBDClientConnection *s)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientReconnect *rc = s->reconnect;
+    int64_t now;
+    bool done;
+    int ret;
+
+    if (!rc) {
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (s->reconnect_ns &&
+            now - s->reconnect_ns < NBD_RECONNECT_DELAY_NS) {
+            return;
+        }
+        s->reconnect_ns = now;
+
+        if (s->ioc) {
+            nbd_connection_release(s);
+        }
+        nbd_reconnect_start(client, s);
+        return;
+    }
+
+    qemu_mutex_lock(&rc->mutex);
+    done = rc->done;
+    qemu_mutex_unlock(&rc->mutex);
+    if (!done) {
+        return;
+    }
+
+    ret = rc->ret;
+    if (ret == 0) {
+        s->sioc = rc->conn.sioc;
+        s->ioc = rc->conn.ioc;
+        s->info = rc->conn.info;
+        rc->conn.sioc = NULL;
+        rc->conn.ioc = NULL;
+        if (!nbd_connection_check_info(client, s, NULL)) {
+            nbd_connection_release(s);
+            ret = -EINVAL;
+        }
+    }
+    trace_nbd_client_reconnect(bs, (int)(s - client->conns), ret);
+    nbd_reconnect_cancel(s);
+
+    if (ret == 0) {
+        nbd_connection_start(bs, s);
+    }
+}
+
+/* Returns the connection with the fewest requests in flight, starting the
+ * search at a different connection every time so that ties are spread
+ * evenly, or NULL if all connections are lost.  If connections are being
+ * reestablished and none is usable yet, waits for them without blocking
+ * the AioContext.  */
+static NBDClientConnection *coroutine_fn
+nbd_co_get_connection(BlockDriverState *bs)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConnection *best;
+    bool connecting;
+    int i;
+
+    for (;;) {
+        best = NULL;
+        connecting = false;
+
+        for (i = 0; i < client->num_conns; i++) {
+            NBDClientConnection *s =
+                &client->conns[(client->next_conn + i) % client->num_conns];
+
+            if (s->quit && s->ioc) {
+                /* A failed send leaves read_reply_co waiting for a reply
+                 * that will not come; make it notice that the connection
+                 * is gone */
+                qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH,
+                                     NULL);
+            }
+            if ((s->quit || !s->ioc) && !s->read_reply_co && !s->in_flight) {
+                nbd_co_reconnect(bs, s);
+            }
+            connecting |= s->reconnect != NULL;
+            if (!s->ioc || s->quit) {
+                continue;
+            }
+
+            if (!best || s->in_flight < best->in_flight) {
+                best = s;
+            }
+        }
+        client->next_conn++;
+
+        if (best || !connecting) {
+            return best;
+        }
+        co_aio_sleep_ns(bdrv_get_aio_context(bs), QEMU_CLOCK_REALTIME,
+                        NBD_RECONNECT_POLL_NS);
+    }
+}
+
 static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
                           QEMUIOVector *write_qiov)
 {
     int ret;
+    int attempts = 0;
     Error *local_err = NULL;
     NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConnection *s;
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -654,15 +964,33 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
-    if (ret < 0) {
-        return ret;
-    }
 
-    ret = nbd_co_receive_return_code(client, request->handle, &local_err);
-    if (local_err) {
-        error_report_err(local_err);
-    }
+    do {
+        s = nbd_co_get_connection(bs);
+        if (!s) {
+            return -EIO;
+        }
+
+        ret = nbd_co_send_request(s, request, write_qiov);
+        if (ret < 0) {
+            continue;
+        }
+
+        ret = nbd_co_receive_return_code(s, request->handle, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            local_err = NULL;
+        }
+
+        /* A request that was lost together with its connection is only
+         * repeated on another one if it does not modify the image: the
+         * server might still execute a lost write after newer writes to
+         * the same area.  A flush on any connection covers all connections
+         * because we only open several if NBD_FLAG_CAN_MULTI_CONN is set.
+         */
+    } while (ret < 0 && s->quit && request->type == NBD_CMD_FLUSH &&
+             ++attempts < client->num_conns);
+
     return ret;
 }
 
@@ -670,8 +998,10 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
     int ret;
+    int attempts = 0;
     Error *local_err = NULL;
     NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConnection *s;
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -684,16 +1014,26 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        return ret;
-    }
 
-    ret = nbd_co_receive_cmdread_reply(client, request.handle, offset, qiov,
-                                       &local_err);
-    if (local_err) {
-        error_report_err(local_err);
-    }
+    do {
+        s = nbd_co_get_connection(bs);
+        if (!s) {
+            return -EIO;
+        }
+
+        ret = nbd_co_send_request(s, &request, NULL);
+        if (ret < 0) {
+            continue;
+        }
+
+        ret = nbd_co_receive_cmdread_reply(s, request.handle, offset, qiov,
+                                           &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            local_err = NULL;
+        }
+    } while (ret < 0 && s->quit && ++attempts < client->num_conns);
+
     return ret;
 }
 
@@ -785,59 +1125,111 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        NBDClientConnection *s = &client->conns[i];
+
+        if (s->ioc) {
+            qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_attach_aio_context(QIO_CHANNEL(client->ioc), new_context);
-    aio_co_schedule(new_context, client->read_reply_co);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        NBDClientConnection *s = &client->conns[i];
+
+        if (s->ioc) {
+            qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
+        }
+        if (s->read_reply_co) {
+            aio_co_schedule(new_context, s->read_reply_co);
+        }
+    }
+}
+
+static void nbd_client_free(NBDClientSession *client)
+{
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].reconnect) {
+            nbd_reconnect_cancel(&client->conns[i]);
+        }
+    }
+    g_free(client->conns);
+    client->conns = NULL;
+    client->num_conns = 0;
+
+    if (client->tlscreds) {
+        object_unref(OBJECT(client->tlscreds));
+        client->tlscreds = NULL;
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].ioc) {
+            nbd_send_request(client->conns[i].ioc, &request);
+        }
     }
 
-    nbd_send_request(client->ioc, &request);
-
     nbd_teardown_connection(bs);
+    nbd_client_free(client);
 }
 
 int nbd_client_init(BlockDriverState *bs,
-                    QIOChannelSocket *sioc,
+                    SocketAddress *saddr,
                     const char *export,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
+                    int connections,
                     Error **errp)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
+    int i;
     int ret;
 
-    /* NBD handshake */
-    logout("session init %s\n", export);
-    qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
+    assert(connections > 0 && connections <= MAX_NBD_CONNECTIONS);
+
+    client->saddr = saddr;
+    client->export = export;
+    client->hostname = hostname;
+    if (tlscreds) {
+        object_ref(OBJECT(tlscreds));
+    }
+    client->tlscreds = tlscreds;
+
+    client->conns = g_new0(NBDClientConnection, connections);
+    for (i = 0; i < connections; i++) {
+        qemu_co_mutex_init(&client->conns[i].send_mutex);
+        qemu_co_queue_init(&client->conns[i].free_sema);
+    }
 
-    client->info.request_sizes = true;
-    client->info.structured_reply = true;
-    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
-                                tlscreds, hostname,
-                                &client->ioc, &client->info, errp);
+    client->num_conns = 1;
+    ret = nbd_connection_open(client, &client->conns[0], errp);
     if (ret < 0) {
-        logout("Failed to negotiate with the NBD server\n");
-        return ret;
+        goto fail;
     }
+    client->info = client->conns[0].info;
+
     if (client->info.flags & NBD_FLAG_READ_ONLY &&
         !bdrv_is_read_only(bs)) {
         error_setg(errp,
                    "request for write access conflicts with read-only export");
-        return -EACCES;
+        ret = -EACCES;
+        goto fail;
     }
     if (client->info.flags & NBD_FLAG_SEND_FUA) {
         bs->supported_write_flags = BDRV_REQ_FUA;
@@ -850,22 +1242,37 @@ int nbd_client_init(BlockDriverState *bs,
         bs->bl.request_alignment = client->info.min_block;
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_queue_init(&client->free_sema);
-    client->sioc = sioc;
-    object_ref(OBJECT(client->sioc));
-
-    if (!client->ioc) {
-        client->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(client->ioc));
+    /* Without NBD_FLAG_CAN_MULTI_CONN, a flush on one connection would not
+     * cover the writes sent on the others */
+    if (!(client->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        connections = 1;
+    }
+    for (i = 1; i < connections; i++) {
+        client->num_conns++;
+        ret = nbd_connection_open(client, &client->conns[i], errp);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (!nbd_connection_check_info(client, &client->conns[i], errp)) {
+            ret = -EINVAL;
+            goto fail;
+        }
     }
 
-    /* Now that we're connected, set the socket to be non-blocking and
-     * kick the reply mechanism.  */
-    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
-    client->read_reply_co = qemu_coroutine_create(nbd_read_reply_entry, client);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    for (i = 0; i < client->num_conns; i++) {
+        nbd_connection_start(bs, &client->conns[i]);
+    }
 
+    trace_nbd_client_init(bs, client->num_conns);
     logout("Established connection with NBD server\n");
     return 0;
+
+fail:
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].ioc) {
+            nbd_connection_release(&client->conns[i]);
+        }
+    }
+    nbd_client_free(client);
+    return ret;
 }
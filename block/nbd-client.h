@@ -16,6 +16,12 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
+
+/* Minimum time between two attempts to reestablish a lost connection */
+#define NBD_RECONNECT_DELAY_NS  (1 * NANOSECONDS_PER_SECOND)
+/* How often requests check whether a connection has been reestablished */
+#define NBD_RECONNECT_POLL_NS   (10 * SCALE_MS)
 
 typedef struct {
     Coroutine *coroutine;
@@ -23,7 +29,9 @@ typedef struct {
     bool receiving;         /* waiting for read_reply_co? */
 } NBDClientRequest;
 
-typedef struct NBDClientSession {
+typedef struct NBDClientReconnect NBDClientReconnect;
+
+typedef struct NBDClientConnection {
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
     NBDExportInfo info;
@@ -36,15 +44,36 @@ typedef struct NBDClientSession {
     NBDClientRequest requests[MAX_NBD_REQUESTS];
     NBDReply reply;
     bool quit;
+
+    int64_t reconnect_ns;   /* time of the last reconnect attempt */
+    NBDClientReconnect *reconnect; /* attempt in progress, if any */
+} NBDClientConnection;
+
+typedef struct NBDClientSession {
+    NBDExportInfo info;     /* as negotiated on the first connection */
+
+    /* If the server sets NBD_FLAG_CAN_MULTI_CONN, requests are spread over
+     * several connections; otherwise there is only conns[0].  */
+    NBDClientConnection *conns;
+    int num_conns;
+    unsigned next_conn;
+
+    /* Needed to reconnect.  Only @tlscreds is referenced by the session,
+     * the rest is owned by the caller of nbd_client_init().  */
+    SocketAddress *saddr;
+    const char *export;
+    QCryptoTLSCreds *tlscreds;
+    const char *hostname;
 } NBDClientSession;
 
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs);
 
 int nbd_client_init(BlockDriverState *bs,
-                    QIOChannelSocket *sock,
+                    SocketAddress *saddr,
                     const char *export_name,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
+                    int connections,
                     Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
@@ -393,29 +393,32 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
+    BlockAcctCounters counters;
 
-    ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
-    ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
-    ds->rd_operations = stats->nr_ops[BLOCK_ACCT_READ];
-    ds->wr_operations = stats->nr_ops[BLOCK_ACCT_WRITE];
+    block_acct_get_counters(stats, &counters);
 
-    ds->failed_rd_operations = stats->failed_ops[BLOCK_ACCT_READ];
-    ds->failed_wr_operations = stats->failed_ops[BLOCK_ACCT_WRITE];
-    ds->failed_flush_operations = stats->failed_ops[BLOCK_ACCT_FLUSH];
+    ds->rd_bytes = counters.nr_bytes[BLOCK_ACCT_READ];
+    ds->wr_bytes = counters.nr_bytes[BLOCK_ACCT_WRITE];
+    ds->rd_operations = counters.nr_ops[BLOCK_ACCT_READ];
+    ds->wr_operations = counters.nr_ops[BLOCK_ACCT_WRITE];
 
-    ds->invalid_rd_operations = stats->invalid_ops[BLOCK_ACCT_READ];
-    ds->invalid_wr_operations = stats->invalid_ops[BLOCK_ACCT_WRITE];
+    ds->failed_rd_operations = counters.failed_ops[BLOCK_ACCT_READ];
+    ds->failed_wr_operations = counters.failed_ops[BLOCK_ACCT_WRITE];
+    ds->failed_flush_operations = counters.failed_ops[BLOCK_ACCT_FLUSH];
+
+    ds->invalid_rd_operations = counters.invalid_ops[BLOCK_ACCT_READ];
+    ds->invalid_wr_operations = counters.invalid_ops[BLOCK_ACCT_WRITE];
     ds->invalid_flush_operations =
-        stats->invalid_ops[BLOCK_ACCT_FLUSH];
+        counters.invalid_ops[BLOCK_ACCT_FLUSH];
 
-    ds->rd_merged = stats->merged[BLOCK_ACCT_READ];
-    ds->wr_merged = stats->merged[BLOCK_ACCT_WRITE];
-    ds->flush_operations = stats->nr_ops[BLOCK_ACCT_FLUSH];
-    ds->wr_total_time_ns = stats->total_time_ns[BLOCK_ACCT_WRITE];
-    ds->rd_total_time_ns = stats->total_time_ns[BLOCK_ACCT_READ];
-    ds->flush_total_time_ns = stats->total_time_ns[BLOCK_ACCT_FLUSH];
+    ds->rd_merged = counters.merged[BLOCK_ACCT_READ];
+    ds->wr_merged = counters.merged[BLOCK_ACCT_WRITE];
+    ds->flush_operations = counters.nr_ops[BLOCK_ACCT_FLUSH];
+    ds->wr_total_time_ns = counters.total_time_ns[BLOCK_ACCT_WRITE];
+    ds->rd_total_time_ns = counters.total_time_ns[BLOCK_ACCT_READ];
+    ds->flush_total_time_ns = counters.total_time_ns[BLOCK_ACCT_FLUSH];
 
-    ds->has_idle_time_ns = stats->last_access_time_ns > 0;
+    ds->has_idle_time_ns = counters.last_access_time_ns > 0;
     if (ds->has_idle_time_ns) {
         ds->idle_time_ns = block_acct_idle_time_ns(stats);
     }
@@ -423,6 +426,16 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    ds->rd_latency_histogram =
+        block_latency_histogram_get(stats, BLOCK_ACCT_READ);
+    ds->has_rd_latency_histogram = !!ds->rd_latency_histogram;
+    ds->wr_latency_histogram =
+        block_latency_histogram_get(stats, BLOCK_ACCT_WRITE);
+    ds->has_wr_latency_histogram = !!ds->wr_latency_histogram;
+    ds->flush_latency_histogram =
+        block_latency_histogram_get(stats, BLOCK_ACCT_FLUSH);
+    ds->has_flush_latency_histogram = !!ds->flush_latency_histogram;
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
@@ -483,6 +496,9 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, blk_level);
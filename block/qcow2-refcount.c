@@ -133,6 +133,7 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     g_free(s->refcount_table);
+    qcow2_free_extents_reset(bs);
 }
 
 
@@ -282,6 +283,187 @@ int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
     return 0;
 }
 
+/*
+ * Free extent index
+ *
+ * s->free_extents holds the clusters with a zero refcount below
+ * s->free_extents_end.  It is filled lazily, one refcount block at a time,
+ * when an allocation does not find a large enough extent among the clusters
+ * scanned so far, and it is kept up to date by update_refcount().
+ *
+ * Clusters handed out by alloc_clusters_noref() are removed from the index
+ * before their refcount is increased, so that nested allocations (for new
+ * refcount blocks) cannot return them again.
+ */
+
+/* Number of clusters whose offsets can be represented in an int64_t */
+static inline uint64_t free_extents_limit(BDRVQcow2State *s)
+{
+    return (INT64_MAX >> s->cluster_bits) + 1;
+}
+
+static void free_extents_add(BDRVQcow2State *s, uint64_t cluster_index,
+                             uint64_t nb_clusters)
+{
+    if (s->free_extents && cluster_index < s->free_extents_end) {
+        extent_set_add(s->free_extents, cluster_index,
+                       MIN(nb_clusters, s->free_extents_end - cluster_index));
+    }
+}
+
+static void free_extents_remove(BDRVQcow2State *s, uint64_t cluster_index,
+                                uint64_t nb_clusters)
+{
+    if (s->free_extents) {
+        extent_set_remove(s->free_extents, cluster_index, nb_clusters);
+    }
+}
+
+/*
+ * Drops the free extent index; it is rebuilt from the refcount blocks on
+ * the next allocation.  Must be called whenever the refcount structures are
+ * changed without update_refcount().
+ */
+void qcow2_free_extents_reset(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    extent_set_free(s->free_extents);
+    s->free_extents = NULL;
+    s->free_extents_end = 0;
+}
+
+/* Adds the free clusters described by the next refcount block to the index */
+static int free_extents_scan_next(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start = s->free_extents_end;
+    uint64_t limit = free_extents_limit(s);
+    uint64_t refcount_table_index = start >> s->refcount_block_bits;
+    uint64_t refcount_block_offset, nb_clusters, i, j;
+    void *refcount_block;
+    int ret;
+
+    assert(start < limit);
+
+    if (refcount_table_index >= s->refcount_table_size ||
+        refcount_table_index > s->max_refcount_table_index) {
+        /* Nothing is allocated beyond the last refcount block */
+        extent_set_add(s->free_extents, start, limit - start);
+        s->free_extents_end = limit;
+        return 0;
+    }
+
+    nb_clusters = MIN(s->refcount_block_size, limit - start);
+    refcount_block_offset =
+        s->refcount_table[refcount_table_index] & REFT_OFFSET_MASK;
+    if (!refcount_block_offset) {
+        extent_set_add(s->free_extents, start, nb_clusters);
+        s->free_extents_end = start + nb_clusters;
+        return 0;
+    }
+
+    if (offset_into_cluster(s, refcount_block_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#" PRIx64
+                                " unaligned (reftable index: %#" PRIx64 ")",
+                                refcount_block_offset, refcount_table_index);
+        return -EIO;
+    }
+
+    ret = load_refcount_block(bs, refcount_block_offset, &refcount_block);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < nb_clusters; i = j) {
+        for (j = i; j < nb_clusters && !s->get_refcount(refcount_block, j);
+             j++) {
+            /* count free clusters */
+        }
+        if (j > i) {
+            extent_set_add(s->free_extents, start + i, j - i);
+        }
+        for (; j < nb_clusters && s->get_refcount(refcount_block, j); j++) {
+            /* skip used clusters */
+        }
+    }
+
+    qcow2_cache_put(bs, s->refcount_block_cache, &refcount_block);
+    s->free_extents_end = start + nb_clusters;
+    return 0;
+}
+
+/* Makes sure that the index covers all clusters below @cluster_index */
+static int free_extents_scan_to(BlockDriverState *bs, uint64_t cluster_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->free_extents) {
+        s->free_extents = extent_set_new();
+        s->free_extents_end = 0;
+    }
+
+    cluster_index = MIN(cluster_index, free_extents_limit(s));
+    while (s->free_extents_end < cluster_index) {
+        ret = free_extents_scan_next(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Finds the lowest run of @nb_clusters free clusters and stores the index of
+ * its first cluster in *cluster_index.  Refcount blocks are only scanned
+ * until such a run is found.
+ */
+static int free_extents_find(BlockDriverState *bs, uint64_t nb_clusters,
+                             uint64_t *cluster_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    ret = free_extents_scan_to(bs, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (!extent_set_find(s->free_extents, nb_clusters, cluster_index)) {
+        if (s->free_extents_end >= free_extents_limit(s)) {
+            return -EFBIG;
+        }
+        ret = free_extents_scan_next(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns clusters that were taken out of the index for an allocation which
+ * then failed.  Only the clusters that are still unused are put back: on
+ * -EAGAIN, some of them may have been used for new refcount structures.
+ */
+static void free_extents_release(BlockDriverState *bs, uint64_t cluster_index,
+                                 uint64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t i, refcount;
+
+    for (i = 0; i < nb_clusters; i++) {
+        if (qcow2_get_refcount(bs, cluster_index + i, &refcount) < 0) {
+            /* Leave it out of the index, at worst it is leaked */
+            continue;
+        }
+        if (refcount == 0) {
+            free_extents_add(s, cluster_index + i, 1);
+        }
+    }
+}
+
 /* Checks if two offsets are described by the same refcount block */
 static int in_same_refcount_block(BDRVQcow2State *s, uint64_t offset_a,
     uint64_t offset_b)
@@ -503,6 +685,7 @@ fail:
     if (*refcount_block != NULL) {
         qcow2_cache_put(bs, s->refcount_block_cache, refcount_block);
     }
+    free_extents_release(bs, new_block >> s->cluster_bits, 1);
     return ret;
 }
 
@@ -713,6 +896,10 @@ int64_t qcow2_refcount_area(BlockDriverState *bs, uint64_t start_offset,
     s->refcount_table_offset = table_offset;
     update_max_refcount_table_index(s);
 
+    /* The new refcount structures are in use now */
+    free_extents_remove(s, start_offset >> s->cluster_bits,
+                        (end_offset - start_offset) >> s->cluster_bits);
+
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
                         QCOW2_DISCARD_OTHER);
@@ -864,14 +1051,18 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         } else {
             refcount += addend;
         }
-        if (refcount == 0 && cluster_index < s->free_cluster_index) {
-            s->free_cluster_index = cluster_index;
+        if (refcount == 0) {
+            free_extents_add(s, cluster_index, 1);
+        } else if (!decrease && refcount == addend) {
+            free_extents_remove(s, cluster_index, 1);
         }
         s->set_refcount(refcount_block, block_index, refcount);
 
         if (refcount == 0) {
             void *table;
 
+            uint64_t slice_offset;
+
             table = qcow2_cache_is_table_offset(bs, s->refcount_block_cache,
                                                 offset);
             if (table != NULL) {
@@ -879,11 +1070,22 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                 qcow2_cache_discard(bs, s->refcount_block_cache, table);
             }
 
-            table = qcow2_cache_is_table_offset(bs, s->l2_table_cache, offset);
-            if (table != NULL) {
-                qcow2_cache_discard(bs, s->l2_table_cache, table);
+            /* L2 tables are cached in slices, drop all of them */
+            for (slice_offset = cluster_offset;
+                 slice_offset < cluster_offset + s->cluster_size;
+                 slice_offset += s->l2_slice_size * sizeof(uint64_t)) {
+                table = qcow2_cache_is_table_offset(bs, s->l2_table_cache,
+                                                    slice_offset);
+                if (table != NULL) {
+                    qcow2_cache_discard(bs, s->l2_table_cache, table);
+                }
             }
 
+            /* Compressed data in the cluster may be rewritten once the
+             * cluster is reallocated */
+            qcow2_compressed_cache_discard(bs, cluster_offset,
+                                           s->cluster_size);
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -947,11 +1149,18 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 
 
 
-/* return < 0 if error */
+/*
+ * Finds the lowest run of free clusters that can hold @size bytes and takes
+ * it out of the free extent index.  The refcounts are left alone; if the
+ * caller fails to increase them, it must give the clusters back with
+ * free_extents_release().
+ *
+ * return < 0 if error
+ */
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
+    uint64_t nb_clusters, cluster_index;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -959,37 +1168,25 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
         qcow2_process_discards(bs, 0);
     }
 
+    /* The index only covers clusters whose offsets are representable in an
+     * int64_t, so this fails with -EFBIG if the image cannot grow any more */
     nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
-
-        if (ret < 0) {
-            return ret;
-        } else if (refcount != 0) {
-            goto retry;
-        }
-    }
-
-    /* Make sure that all offsets in the "allocated" range are representable
-     * in an int64_t */
-    if (s->free_cluster_index > 0 &&
-        s->free_cluster_index - 1 > (INT64_MAX >> s->cluster_bits))
-    {
-        return -EFBIG;
+    ret = free_extents_find(bs, MAX(nb_clusters, 1), &cluster_index);
+    if (ret < 0) {
+        return ret;
     }
+    free_extents_remove(s, cluster_index, nb_clusters);
 
 #ifdef DEBUG_ALLOC2
     fprintf(stderr, "alloc_clusters: size=%" PRId64 " -> %" PRId64 "\n",
-            size,
-            (s->free_cluster_index - nb_clusters) << s->cluster_bits);
+            size, cluster_index << s->cluster_bits);
 #endif
-    return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
+    return cluster_index << s->cluster_bits;
 }
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
 {
+    BDRVQcow2State *s = bs->opaque;
     int64_t offset;
     int ret;
 
@@ -1001,6 +1198,10 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
         }
 
         ret = update_refcount(bs, offset, size, 1, false, QCOW2_DISCARD_NEVER);
+        if (ret < 0) {
+            free_extents_release(bs, offset >> s->cluster_bits,
+                                 size_to_clusters(s, size));
+        }
     } while (ret == -EAGAIN);
 
     if (ret < 0) {
@@ -1014,7 +1215,7 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t cluster_index, refcount;
+    uint64_t cluster_index;
     uint64_t i;
     int ret;
 
@@ -1023,21 +1224,22 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
         return 0;
     }
 
+    cluster_index = offset >> s->cluster_bits;
     do {
         /* Check how many clusters there are free */
-        cluster_index = offset >> s->cluster_bits;
-        for(i = 0; i < nb_clusters; i++) {
-            ret = qcow2_get_refcount(bs, cluster_index++, &refcount);
-            if (ret < 0) {
-                return ret;
-            } else if (refcount != 0) {
-                break;
-            }
+        ret = free_extents_scan_to(bs, cluster_index + nb_clusters);
+        if (ret < 0) {
+            return ret;
         }
+        i = extent_set_count(s->free_extents, cluster_index, nb_clusters);
 
         /* And then allocate them */
+        free_extents_remove(s, cluster_index, i);
         ret = update_refcount(bs, offset, i << s->cluster_bits, 1, false,
                               QCOW2_DISCARD_NEVER);
+        if (ret < 0) {
+            free_extents_release(bs, cluster_index, i);
+        }
     } while (ret == -EAGAIN);
 
     if (ret < 0) {
@@ -1052,7 +1254,7 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
 {
     BDRVQcow2State *s = bs->opaque;
-    int64_t offset;
+    int64_t offset, new_cluster;
     size_t free_in_cluster;
     int ret;
 
@@ -1076,8 +1278,9 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
 
     free_in_cluster = s->cluster_size - offset_into_cluster(s, offset);
     do {
+        new_cluster = 0;
         if (!offset || free_in_cluster < size) {
-            int64_t new_cluster = alloc_clusters_noref(bs, s->cluster_size);
+            new_cluster = alloc_clusters_noref(bs, s->cluster_size);
             if (new_cluster < 0) {
                 return new_cluster;
             }
@@ -1100,6 +1303,9 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
         assert(offset);
         ret = update_refcount(bs, offset, size, 1, false, QCOW2_DISCARD_NEVER);
         if (ret < 0) {
+            if (new_cluster) {
+                free_extents_release(bs, new_cluster >> s->cluster_bits, 1);
+            }
             offset = 0;
         }
     } while (ret == -EAGAIN);
@@ -1184,15 +1390,19 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, entry, l1_size2, refcount;
+    uint64_t *l1_table, *l2_slice, l2_offset, entry, l1_size2, refcount;
     bool l1_allocated = false;
     int64_t old_entry, old_l2_offset;
+    unsigned slice, slice_size2, n_slices;
     int i, j, l1_modified = 0, nb_csectors;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
 
-    l2_table = NULL;
+    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    n_slices = s->cluster_size / slice_size2;
+
+    l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1237,91 +1447,94 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                      l2_offset + slice * slice_size2,
+                                      (void **) &l2_slice);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for (j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-                uint64_t offset;
-
-                entry = be64_to_cpu(l2_table[j]);
-                old_entry = entry;
-                entry &= ~QCOW_OFLAG_COPIED;
-                offset = entry & L2E_OFFSET_MASK;
-
-                switch (qcow2_get_cluster_type(entry)) {
-                case QCOW2_CLUSTER_COMPRESSED:
-                    nb_csectors = ((entry >> s->csize_shift) &
-                                   s->csize_mask) + 1;
-                    if (addend != 0) {
-                        ret = update_refcount(bs,
-                                (entry & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                        if (ret < 0) {
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
+                    uint64_t offset;
+
+                    entry = be64_to_cpu(l2_slice[j]);
+                    old_entry = entry;
+                    entry &= ~QCOW_OFLAG_COPIED;
+                    offset = entry & L2E_OFFSET_MASK;
+
+                    switch (qcow2_get_cluster_type(entry)) {
+                    case QCOW2_CLUSTER_COMPRESSED:
+                        nb_csectors = ((entry >> s->csize_shift) &
+                                       s->csize_mask) + 1;
+                        if (addend != 0) {
+                            ret = update_refcount(bs,
+                                    (entry & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, abs(addend), addend < 0,
+                                    QCOW2_DISCARD_SNAPSHOT);
+                            if (ret < 0) {
+                                goto fail;
+                            }
+                        }
+                        /* compressed clusters are never modified */
+                        refcount = 2;
+                        break;
+
+                    case QCOW2_CLUSTER_NORMAL:
+                    case QCOW2_CLUSTER_ZERO_ALLOC:
+                        if (offset_into_cluster(s, offset)) {
+                            qcow2_signal_corruption(
+                                bs, true, -1, -1, "Cluster allocation offset "
+                                "%#" PRIx64 " unaligned (L2 offset: %#"
+                                PRIx64 ", L2 index: %#x)", offset, l2_offset,
+                                slice * s->l2_slice_size + j);
+                            ret = -EIO;
                             goto fail;
                         }
-                    }
-                    /* compressed clusters are never modified */
-                    refcount = 2;
-                    break;
-
-                case QCOW2_CLUSTER_NORMAL:
-                case QCOW2_CLUSTER_ZERO_ALLOC:
-                    if (offset_into_cluster(s, offset)) {
-                        qcow2_signal_corruption(bs, true, -1, -1, "Cluster "
-                                                "allocation offset %#" PRIx64
-                                                " unaligned (L2 offset: %#"
-                                                PRIx64 ", L2 index: %#x)",
-                                                offset, l2_offset, j);
-                        ret = -EIO;
-                        goto fail;
-                    }
 
-                    cluster_index = offset >> s->cluster_bits;
-                    assert(cluster_index);
-                    if (addend != 0) {
-                        ret = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, abs(addend), addend < 0,
-                                    QCOW2_DISCARD_SNAPSHOT);
+                        cluster_index = offset >> s->cluster_bits;
+                        assert(cluster_index);
+                        if (addend != 0) {
+                            ret = qcow2_update_cluster_refcount(bs,
+                                        cluster_index, abs(addend), addend < 0,
+                                        QCOW2_DISCARD_SNAPSHOT);
+                            if (ret < 0) {
+                                goto fail;
+                            }
+                        }
+
+                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
                         if (ret < 0) {
                             goto fail;
                         }
-                    }
-
-                    ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                    if (ret < 0) {
-                        goto fail;
-                    }
-                    break;
+                        break;
 
-                case QCOW2_CLUSTER_ZERO_PLAIN:
-                case QCOW2_CLUSTER_UNALLOCATED:
-                    refcount = 0;
-                    break;
+                    case QCOW2_CLUSTER_ZERO_PLAIN:
+                    case QCOW2_CLUSTER_UNALLOCATED:
+                        refcount = 0;
+                        break;
 
-                default:
-                    abort();
-                }
+                    default:
+                        abort();
+                    }
 
-                if (refcount == 1) {
-                    entry |= QCOW_OFLAG_COPIED;
-                }
-                if (entry != old_entry) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        entry |= QCOW_OFLAG_COPIED;
+                    }
+                    if (entry != old_entry) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        l2_slice[j] = cpu_to_be64(entry);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_slice);
                     }
-                    l2_table[j] = cpu_to_be64(entry);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
                 }
-            }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+            }
 
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
@@ -1348,8 +1561,8 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     ret = bdrv_flush(bs);
 fail:
-    if (l2_table) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (l2_slice) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
 
     s->cache_discards = false;
@@ -2330,6 +2543,7 @@ write_refblocks:
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
     update_max_refcount_table_index(s);
+    qcow2_free_extents_reset(bs);
 
     return 0;
 
@@ -3046,6 +3260,9 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
     s->get_refcount = new_get_refcount;
     s->set_refcount = new_set_refcount;
 
+    /* The free extent index is scanned in units of refcount blocks */
+    qcow2_free_extents_reset(bs);
+
     /* For cleaning up all old refblocks and the old reftable below the "done"
      * label */
     new_reftable        = old_reftable;
@@ -3138,9 +3355,7 @@ static int qcow2_discard_refcount_block(BlockDriverState *bs,
 
     qcow2_cache_put(bs, s->refcount_block_cache, &refblock);
 
-    if (cluster_index < s->free_cluster_index) {
-        s->free_cluster_index = cluster_index;
-    }
+    free_extents_add(s, cluster_index, 1);
 
     refblock = qcow2_cache_is_table_offset(bs, s->refcount_block_cache,
                                            discard_block_offs);
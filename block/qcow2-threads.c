@@ -0,0 +1,248 @@
+/*
+ * Threaded data processing for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/*
+ * Compression and decompression functions
+ *
+ * Compression returns the size of the compressed data, -ENOSPC if it does
+ * not fit into @dest_size bytes (the cluster is then stored uncompressed), or
+ * -EIO on any other error.  Decompression returns 0 if exactly @dest_size
+ * bytes were produced, or -EIO.
+ */
+typedef ssize_t Qcow2CompressFunc(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size);
+
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    ssize_t ret;
+    z_stream strm;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       -12, 9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (Bytef *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK ? -ENOSPC : -EIO);
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ssize_t ret;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.avail_in = src_size;
+    strm.next_in = (Bytef *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    /* The compressed data is padded up to a sector boundary, so inflate()
+     * may stop on a full output buffer before it sees the end of stream */
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret == Z_STREAM_END || ret == Z_BUF_ERROR) && strm.avail_out == 0) {
+        ret = 0;
+    } else {
+        ret = -EIO;
+    }
+
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(dest, dest_size, src, src_size, ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(ret)) {
+        return ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall ?
+               -ENOSPC : -EIO;
+    }
+    return ret;
+}
+
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    size_t frame_size, ret;
+
+    /* Skip the padding after the end of the frame */
+    frame_size = ZSTD_findFrameCompressedSize(src, src_size);
+    if (ZSTD_isError(frame_size)) {
+        return -EIO;
+    }
+
+    ret = ZSTD_decompress(dest, dest_size, src, frame_size);
+    if (ZSTD_isError(ret) || ret != dest_size) {
+        return -EIO;
+    }
+    return 0;
+}
+#endif
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    Qcow2CompressFunc *func;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+    return 0;
+}
+
+/*
+ * Runs @func in a worker thread, so that the AioContext can go on with other
+ * requests meanwhile.  Up to QCOW2_MAX_THREADS jobs of an image run at the
+ * same time, further requests wait for a free slot.
+ */
+static ssize_t coroutine_fn
+qcow2_co_process(BlockDriverState *bs, void *dest, size_t dest_size,
+                 const void *src, size_t src_size, Qcow2CompressFunc func)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData arg = {
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+        .func       = func,
+    };
+
+    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+        qemu_co_queue_wait(&s->thread_task_queue, NULL);
+    }
+
+    s->nb_threads++;
+    trace_qcow2_thread_task_start(qemu_coroutine_self(), src_size,
+                                  s->nb_threads);
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &arg);
+    s->nb_threads--;
+    trace_qcow2_thread_task_done(qemu_coroutine_self(), arg.ret);
+
+    qemu_co_queue_next(&s->thread_task_queue);
+
+    return arg.ret;
+}
+
+/*
+ * Compresses @src_size bytes from @src into @dest in a worker thread.
+ *
+ * Returns the size of the compressed data, -ENOSPC if it does not fit into
+ * @dest_size bytes, or another negative errno on error.
+ */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        func = qcow2_zstd_compress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_process(bs, dest, dest_size, src, src_size, func);
+}
+
+/*
+ * Decompresses the data in @src, which may be followed by padding, into
+ * exactly @dest_size bytes at @dest in a worker thread.
+ *
+ * Returns 0 on success, -EIO if the compressed data is invalid.
+ */
+int coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+                                     void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_decompress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        func = qcow2_zstd_decompress;
+        break;
+#endif
+    default:
+        /* Rejected when the image is opened */
+        abort();
+    }
+
+    return qcow2_co_process(bs, dest, dest_size, src, src_size, func);
+}
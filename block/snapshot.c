@@ -193,6 +193,9 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
         return -EBUSY;
     }
 
+    /* The allocation status of the whole image changes */
+    bdrv_unalloc_cache_clear(bs);
+
     if (drv->bdrv_snapshot_goto) {
         ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
         if (ret < 0) {
@@ -372,6 +375,7 @@ int bdrv_snapshot_load_tmp(BlockDriverState *bs,
         return -EINVAL;
     }
     if (drv->bdrv_snapshot_load_tmp) {
+        bdrv_unalloc_cache_clear(bs);
         return drv->bdrv_snapshot_load_tmp(bs, snapshot_id, name, errp);
     }
     error_setg(errp, "Block format '%s' used by device '%s' "
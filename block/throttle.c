@@ -138,6 +138,22 @@ static int coroutine_fn throttle_co_pdiscard(BlockDriverState *bs,
     return bdrv_co_pdiscard(bs->file->bs, offset, bytes);
 }
 
+static int coroutine_fn throttle_co_sendfile(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             int out_fd)
+{
+    ThrottleGroupMember *tgm = bs->opaque;
+    int ret;
+
+    /* The caller tries again with whatever did not fit into @out_fd, so
+     * only the bytes sent are charged, after sending them */
+    ret = bdrv_co_sendfile(bs->file, offset, bytes, out_fd);
+    if (ret > 0) {
+        throttle_group_co_io_limits_intercept(tgm, ret, false);
+    }
+    return ret;
+}
+
 static int throttle_co_flush(BlockDriverState *bs)
 {
     return bdrv_co_flush(bs->file->bs);
@@ -230,6 +246,7 @@ static BlockDriver bdrv_throttle = {
 
     .bdrv_co_pwrite_zeroes              =   throttle_co_pwrite_zeroes,
     .bdrv_co_pdiscard                   =   throttle_co_pdiscard,
+    .bdrv_co_sendfile                   =   throttle_co_sendfile,
 
     .bdrv_recurse_is_first_non_filter   =   throttle_recurse_is_first_non_filter,
 
@@ -370,13 +370,9 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         }
 
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
-            if (!strcmp(aio, "native")) {
-                *bdrv_flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(aio, "threads")) {
-                /* this is the default */
-            } else {
-               error_setg(errp, "invalid aio option");
-               return;
+            if (bdrv_parse_aio(aio, bdrv_flags) < 0) {
+                error_setg(errp, "invalid aio option");
+                return;
             }
         }
     }
@@ -2029,6 +2025,9 @@ static void block_dirty_bitmap_clear_prepare(BlkActionState *common,
     if (bdrv_dirty_bitmap_frozen(state->bitmap)) {
         error_setg(errp, "Cannot modify a frozen bitmap");
         return;
+    } else if (bdrv_dirty_bitmap_qmp_locked(state->bitmap)) {
+        error_setg(errp, "Cannot modify a locked bitmap");
+        return;
     } else if (!bdrv_dirty_bitmap_enabled(state->bitmap)) {
         error_setg(errp, "Cannot clear a disabled bitmap");
         return;
@@ -2604,6 +2603,64 @@ fail:
     bdrv_unref(medium_bs);
 }
 
+void qmp_block_latency_histogram_set(bool has_device, const char *device,
+                                     bool has_id, const char *id,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    uint64List *type_boundaries[BLOCK_MAX_IOTYPE];
+    int i;
+
+    blk = qmp_get_blk(has_device ? device : NULL, has_id ? id : NULL, errp);
+    if (!blk) {
+        return;
+    }
+    stats = blk_get_stats(blk);
+
+    if ((has_boundaries && !boundaries) ||
+        (has_boundaries_read && !boundaries_read) ||
+        (has_boundaries_write && !boundaries_write) ||
+        (has_boundaries_flush && !boundaries_flush)) {
+        error_setg(errp, "Histogram boundaries must not be empty");
+        return;
+    }
+
+    type_boundaries[BLOCK_ACCT_READ] =
+        has_boundaries_read ? boundaries_read : boundaries;
+    type_boundaries[BLOCK_ACCT_WRITE] =
+        has_boundaries_write ? boundaries_write : boundaries;
+    type_boundaries[BLOCK_ACCT_FLUSH] =
+        has_boundaries_flush ? boundaries_flush : boundaries;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        uint64List *entry;
+
+        for (entry = type_boundaries[i]; entry && entry->next;
+             entry = entry->next)
+        {
+            if (entry->next->value <= entry->value) {
+                error_setg(errp, "Histogram boundaries must be strictly "
+                           "increasing");
+                return;
+            }
+        }
+    }
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        int ret = block_latency_histogram_set(stats, i, type_boundaries[i]);
+        assert(ret == 0);
+    }
+}
+
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
 {
@@ -2780,6 +2837,11 @@ void qmp_block_dirty_bitmap_remove(const char *node, const char *name,
                    "Bitmap '%s' is currently frozen and cannot be removed",
                    name);
         return;
+    } else if (bdrv_dirty_bitmap_qmp_locked(bitmap)) {
+        error_setg(errp,
+                   "Bitmap '%s' is currently locked and cannot be removed",
+                   name);
+        return;
     }
 
     if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
@@ -2814,6 +2876,11 @@ void qmp_block_dirty_bitmap_clear(const char *node, const char *name,
                    "Bitmap '%s' is currently frozen and cannot be modified",
                    name);
         return;
+    } else if (bdrv_dirty_bitmap_qmp_locked(bitmap)) {
+        error_setg(errp,
+                   "Bitmap '%s' is currently locked and cannot be modified",
+                   name);
+        return;
     } else if (!bdrv_dirty_bitmap_enabled(bitmap)) {
         error_setg(errp,
                    "Bitmap '%s' is currently disabled and cannot be cleared",
@@ -255,10 +255,38 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache hit rate: %0.2f\n",
+                       info->xbzrle_cache->cache_hit_rate);
+        monitor_printf(mon, "xbzrle cache evictions: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
+        monitor_printf(mon, "xbzrle cache conflicts: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_conflict);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_multifd) {
+        MultiFDChannelStatsList *chan;
+
+        for (chan = info->multifd; chan; chan = chan->next) {
+            monitor_printf(mon, "multifd channel %" PRId64 ": %" PRIu64
+                           " packets, %" PRIu64 " pages, %" PRIu64
+                           " kbytes\n",
+                           chan->value->id, chan->value->packets,
+                           chan->value->pages, chan->value->bytes >> 10);
+        }
+    }
+
+    if (info->has_postcopy_prefetch) {
+        monitor_printf(mon, "postcopy prefetch: requested %" PRIu64
+                       " used %" PRIu64 " wasted %" PRIu64 " pages\n",
+                       info->postcopy_prefetch->requested,
+                       info->postcopy_prefetch->used,
+                       info->postcopy_prefetch->wasted);
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -296,6 +324,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRId64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_COMPRESS_LEVEL),
             params->compress_level);
+        assert(params->has_compress_method);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_COMPRESS_METHOD),
+            MigrationCompressMethod_str(params->compress_method));
         assert(params->has_compress_threads);
         monitor_printf(mon, "%s: %" PRId64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_COMPRESS_THREADS),
@@ -345,6 +377,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRId64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
+        assert(params->has_zero_page_threads);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_ZERO_PAGE_THREADS),
+            params->zero_page_threads);
+        assert(params->has_postcopy_prefetch_depth);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_DEPTH),
+            params->postcopy_prefetch_depth);
+        assert(params->has_postcopy_place_threads);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PLACE_THREADS),
+            params->postcopy_place_threads);
     }
 
     qapi_free_MigrationParameters(params);
@@ -1587,6 +1631,11 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_compress_level = true;
         visit_type_int(v, param, &p->compress_level, &err);
         break;
+    case MIGRATION_PARAMETER_COMPRESS_METHOD:
+        p->has_compress_method = true;
+        visit_type_MigrationCompressMethod(v, param, &p->compress_method,
+                                           &err);
+        break;
     case MIGRATION_PARAMETER_COMPRESS_THREADS:
         p->has_compress_threads = true;
         visit_type_int(v, param, &p->compress_threads, &err);
@@ -1659,6 +1708,18 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         }
         p->xbzrle_cache_size = cache_size;
         break;
+    case MIGRATION_PARAMETER_ZERO_PAGE_THREADS:
+        p->has_zero_page_threads = true;
+        visit_type_int(v, param, &p->zero_page_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_DEPTH:
+        p->has_postcopy_prefetch_depth = true;
+        visit_type_int(v, param, &p->postcopy_prefetch_depth, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PLACE_THREADS:
+        p->has_postcopy_place_threads = true;
+        visit_type_int(v, param, &p->postcopy_place_threads, &err);
+        break;
     default:
         assert(0);
     }
@@ -2203,7 +2264,8 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
             continue;
         }
 
-        qmp_nbd_server_add(info->value->device, true, writable, &local_err);
+        qmp_nbd_server_add(info->value->device, true, writable, false, NULL,
+                           &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -2223,7 +2285,7 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
     bool writable = qdict_get_try_bool(qdict, "writable", false);
     Error *local_err = NULL;
 
-    qmp_nbd_server_add(device, true, writable, &local_err);
+    qmp_nbd_server_add(device, true, writable, false, NULL, &local_err);
 
     if (local_err != NULL) {
         hmp_handle_error(mon, &local_err);
@@ -27,10 +27,18 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/rcu.h"
+#include "qemu/stats64.h"
+#include "qapi-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 typedef struct BlockAcctStats BlockAcctStats;
 
+/* Number of counter sets in a BlockAcctStats.  Each thread that accounts
+ * requests uses one of them, so that threads do not fight over the same
+ * cache lines; readers add them up. */
+#define BLOCK_ACCT_SHARDS 8
+
 enum BlockAcctType {
     BLOCK_ACCT_READ,
     BLOCK_ACCT_WRITE,
@@ -45,8 +53,18 @@ struct BlockAcctTimedStats {
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
-struct BlockAcctStats {
-    QemuMutex lock;
+typedef struct BlockAcctShard {
+    Stat64 nr_bytes[BLOCK_MAX_IOTYPE];
+    Stat64 nr_ops[BLOCK_MAX_IOTYPE];
+    Stat64 invalid_ops[BLOCK_MAX_IOTYPE];
+    Stat64 failed_ops[BLOCK_MAX_IOTYPE];
+    Stat64 total_time_ns[BLOCK_MAX_IOTYPE];
+    Stat64 merged[BLOCK_MAX_IOTYPE];
+    Stat64 last_access_time_ns;
+} QEMU_ALIGNED(64) BlockAcctShard;
+
+/* The sum of all shards of a BlockAcctStats */
+typedef struct BlockAcctCounters {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t invalid_ops[BLOCK_MAX_IOTYPE];
@@ -54,6 +72,29 @@ struct BlockAcctStats {
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
+} BlockAcctCounters;
+
+/*
+ * A latency histogram with @nbins bins: bin 0 counts the requests that took
+ * less than boundaries[0] nanoseconds, bin i counts those in
+ * [boundaries[i - 1], boundaries[i]) and the last bin those that took
+ * boundaries[nbins - 2] nanoseconds or more.  Like the other counters, the
+ * bins exist once per shard.
+ */
+typedef struct BlockLatencyHistogram {
+    struct rcu_head rcu;
+    int nbins;
+    int stride;             /* distance between the bins of two shards */
+    uint64_t *boundaries;   /* nbins - 1 entries, strictly increasing */
+    Stat64 *bins;           /* BLOCK_ACCT_SHARDS * stride entries */
+} BlockLatencyHistogram;
+
+struct BlockAcctStats {
+    /* Protects the TimedAverages of the intervals only */
+    QemuMutex lock;
+    BlockAcctShard shards[BLOCK_ACCT_SHARDS];
+    /* RCU-protected, NULL if no histogram is configured for the type */
+    BlockLatencyHistogram *latency_histogram[BLOCK_MAX_IOTYPE];
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
     bool account_invalid;
     bool account_failed;
@@ -79,8 +120,15 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
+void block_acct_get_counters(BlockAcctStats *stats,
+                             BlockAcctCounters *counters);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
+int block_latency_histogram_set(BlockAcctStats *stats,
+                                enum BlockAcctType type,
+                                uint64List *boundaries);
+BlockLatencyHistogramInfo *
+block_latency_histogram_get(BlockAcctStats *stats, enum BlockAcctType type);
 
 #endif
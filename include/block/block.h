@@ -66,8 +66,12 @@ typedef enum {
     BDRV_REQ_FUA                = 0x10,
     BDRV_REQ_WRITE_COMPRESSED   = 0x20,
 
+    /* Only valid for bdrv_co_copy_range(): fail with -ENOTSUP instead of
+     * copying through a bounce buffer if the copy cannot be offloaded */
+    BDRV_REQ_NO_FALLBACK        = 0x40,
+
     /* Mask of valid flags */
-    BDRV_REQ_MASK               = 0x3f,
+    BDRV_REQ_MASK               = 0x7f,
 } BdrvRequestFlags;
 
 typedef struct BlockSizes {
@@ -98,6 +102,7 @@ typedef struct HDGeometry {
                                       select an appropriate protocol driver,
                                       ignoring the format layer */
 #define BDRV_O_NO_IO       0x10000 /* don't initialize for I/O */
+#define BDRV_O_IO_URING    0x20000 /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_NO_FLUSH)
 
@@ -253,6 +258,7 @@ void bdrv_replace_node(BlockDriverState *from, BlockDriverState *to,
 
 int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough);
 int bdrv_parse_discard_flags(const char *mode, int *flags);
+int bdrv_parse_aio(const char *mode, int *flags);
 BdrvChild *bdrv_open_child(const char *filename,
                            QDict *options, const char *bdref_key,
                            BlockDriverState* parent,
@@ -300,6 +306,52 @@ int coroutine_fn bdrv_co_writev(BdrvChild *child, int64_t sector_num,
  */
 int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                                        int bytes, BdrvRequestFlags flags);
+/**
+ * bdrv_co_copy_range:
+ *
+ * Do offloaded copy between two children. If the operation is not implemented
+ * by the driver, or if the backend storage doesn't support it, the data is
+ * copied through a bounce buffer instead, unless @write_flags contains
+ * BDRV_REQ_NO_FALLBACK, in which case -ENOTSUP is returned.
+ *
+ * Note: block layer doesn't emulate or fall back to a bounce buffer approach
+ * when BDRV_REQ_NO_FALLBACK is set because the caller is expected to have
+ * its own, possibly better tuned, read/write loop.
+ *
+ * @src: the source child to copy data from.
+ * @src_offset: offset in @src image to read data.
+ * @dst: the destination child to copy data to.
+ * @dst_offset: offset in @dst image to write data.
+ * @bytes: number of bytes to copy.
+ * @read_flags: request flags for reading data from @src.
+ * @write_flags: request flags for writing data to @dst.  If
+ *               BDRV_REQ_ZERO_WRITE is set, @src is not read and the range
+ *               is zeroed instead.
+ *
+ * Returns: 0 if succeeded; negative error code if failed.
+ **/
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes,
+                                    BdrvRequestFlags read_flags,
+                                    BdrvRequestFlags write_flags);
+/**
+ * bdrv_co_sendfile:
+ *
+ * Write up to @bytes bytes of @child at @offset to the non-blocking file
+ * descriptor @out_fd (typically a socket) without copying them through
+ * userspace.  This never waits for @out_fd to become writable; callers
+ * wait for it themselves, outside of the request, and call again for the
+ * rest of the range.
+ *
+ * Returns: the number of bytes written, which may be less than @bytes;
+ * -EAGAIN if @out_fd could not take any data; -ENOTSUP if no data was
+ * written because neither the drivers nor the backend storage support the
+ * operation, and the caller should read and send the data itself; any
+ * other negative error code if failed, in which case no data was written.
+ **/
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, uint64_t offset,
+                                  uint64_t bytes, int out_fd);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 void bdrv_refresh_filename(BlockDriverState *bs);
@@ -473,6 +525,7 @@ const char *bdrv_get_device_or_node_name(const BlockDriverState *bs);
 int bdrv_get_flags(BlockDriverState *bs);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs);
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs);
 void bdrv_round_to_clusters(BlockDriverState *bs,
                             int64_t offset, int64_t bytes,
                             int64_t *cluster_offset,
@@ -47,8 +47,25 @@ struct RAMBlock {
      * of the postcopy phase
      */
     unsigned long *unsentmap;
+    /* bitmaps of the dirty pages already checked by the zero page
+     * scanner threads, and of the ones among them that are zero
+     */
+    unsigned long *zscanmap;
+    unsigned long *zeromap;
+    /* dirty page rate statistics, maintained by migration/ram.c */
+    uint64_t dirty_pages_period;
+    uint64_t dirty_rate;
+    uint8_t *dirty_heat;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /*
+     * mapped-ram migration: pages of the block that are stored in the
+     * file, and where the bitmap and the pages are stored
+     */
+    unsigned long *file_bmap;
+    unsigned long file_pages;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -0,0 +1,95 @@
+/*
+ * Sets of disjoint 64-bit extents
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_EXTENT_SET_H
+#define QEMU_EXTENT_SET_H
+
+/*
+ * An ExtentSet keeps a set of integers as a sorted collection of maximal
+ * disjoint extents [start, start + len): adding a range merges it with the
+ * extents it overlaps or touches, removing a range splits the extents it
+ * cuts.  The extents are kept in a balanced search tree that also records
+ * the longest extent of every subtree, so that the lowest extent of at
+ * least a given length can be found in O(log n).
+ *
+ * Ranges must not include UINT64_MAX.
+ */
+typedef struct ExtentSet ExtentSet;
+
+/**
+ * extent_set_new: create an empty set
+ */
+ExtentSet *extent_set_new(void);
+
+/**
+ * extent_set_free: free a set and all of its extents
+ *
+ * @set: the set, may be NULL
+ */
+void extent_set_free(ExtentSet *set);
+
+/**
+ * extent_set_clear: remove all extents from a set
+ *
+ * @set: the set
+ */
+void extent_set_clear(ExtentSet *set);
+
+/**
+ * extent_set_add: add the range [@start, @start + @len) to a set
+ *
+ * Parts of the range that are already in the set are left alone.
+ *
+ * @set: the set
+ * @start: first element of the range
+ * @len: length of the range
+ */
+void extent_set_add(ExtentSet *set, uint64_t start, uint64_t len);
+
+/**
+ * extent_set_remove: remove the range [@start, @start + @len) from a set
+ *
+ * Parts of the range that are not in the set are ignored.
+ *
+ * @set: the set
+ * @start: first element of the range
+ * @len: length of the range
+ */
+void extent_set_remove(ExtentSet *set, uint64_t start, uint64_t len);
+
+/**
+ * extent_set_find: look for an extent of at least @min_len elements
+ *
+ * Returns true and stores the start of the lowest extent that is at
+ * least @min_len long in *@start, or returns false if there is none.
+ *
+ * @set: the set
+ * @min_len: minimum length of the extent, at least 1
+ * @start: location to store the start of the extent
+ */
+bool extent_set_find(ExtentSet *set, uint64_t min_len, uint64_t *start);
+
+/**
+ * extent_set_count: count the elements of the set following @start
+ *
+ * Returns the number of consecutive elements of the set starting at
+ * @start, but at most @max.  Returns 0 if @start is not in the set.
+ *
+ * @set: the set
+ * @start: first element to count
+ * @max: maximum number of elements to count
+ */
+uint64_t extent_set_count(ExtentSet *set, uint64_t start, uint64_t max);
+
+/**
+ * extent_set_nb_extents: return the number of extents in a set
+ *
+ * @set: the set
+ */
+uint64_t extent_set_nb_extents(ExtentSet *set);
+
+#endif
@@ -145,6 +145,31 @@ void hbitmap_reset_all(HBitmap *hb);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_next_zero:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at.
+ * @count: Number of bits to look at.  The range is clamped to the end of
+ * the bitmap.
+ *
+ * Return the first bit in [@start, @start + @count) that is not set, or -1
+ * if all of them are.  Words whose bits are all set are skipped at once.
+ */
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_next_dirty_area:
+ * @hb: HBitmap to operate on.
+ * @start: In: first bit to look at.  Out: start of the area found.
+ * @count: In: number of bits to look at.  Out: length of the area found.
+ *
+ * Find the first run of set bits in [*@start, *@start + *@count).  The run
+ * is clipped to that range.  Return true and update *@start and *@count if
+ * there is one, otherwise return false and leave them unchanged.
+ */
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count);
+
 /**
  * hbitmap_is_serializable:
  * @hb: HBitmap which should be (de-)serialized.
@@ -322,6 +347,19 @@ void hbitmap_free_meta(HBitmap *hb);
  */
 int64_t hbitmap_iter_next(HBitmapIter *hbi);
 
+/**
+ * hbitmap_iter_next_area:
+ * @hbi: HBitmapIter to operate on.
+ * @max_offset: End of the range to iterate on (exclusive).
+ * @offset: Set to the start of the next run of set bits.
+ * @count: Set to the length of that run.
+ *
+ * Return the next run of set bits before @max_offset, clipped to it, and
+ * continue the iteration behind it.  Return false if there is none.
+ */
+bool hbitmap_iter_next_area(HBitmapIter *hbi, uint64_t max_offset,
+                            uint64_t *offset, uint64_t *count);
+
 /**
  * hbitmap_iter_next_word:
  * @hbi: HBitmapIter to operate on.
@@ -0,0 +1,88 @@
+/*
+ * Helpers for driving PCI devices with VFIO from userspace
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_VFIO_HELPERS_H
+#define QEMU_VFIO_HELPERS_H
+
+#include "qemu/event_notifier.h"
+
+/*
+ * A QEMUVFIOState owns a VFIO container, the IOMMU group of one PCI device
+ * and the device itself.  It also manages the IO virtual address space of
+ * the container: all guest RAM is mapped once when the state is created
+ * (and whenever RAM blocks are added later), other buffers can be mapped
+ * either permanently or until the next qemu_vfio_dma_reset_temporary().
+ */
+typedef struct QEMUVFIOState QEMUVFIOState;
+
+/**
+ * qemu_vfio_open_pci: bind to a PCI device that is bound to vfio-pci
+ *
+ * @device: PCI address of the device, e.g. "0000:44:00.0"
+ * @errp: error object
+ */
+QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp);
+
+/**
+ * qemu_vfio_close: unmap all DMA mappings and release the device
+ */
+void qemu_vfio_close(QEMUVFIOState *s);
+
+/**
+ * qemu_vfio_dma_map: make [@host, @host + @size) accessible to the device
+ *
+ * @host and @size must be page aligned.  If the range is already covered by
+ * a mapping, that one is reused.  Otherwise a new mapping is created, which
+ * is only valid until the next qemu_vfio_dma_reset_temporary() call if
+ * @temporary is true.
+ *
+ * Returns 0 and stores the IO virtual address of @host in *@iova on success,
+ * or a negative errno (-ENOMEM if the IOVA space is exhausted).
+ */
+int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
+                      bool temporary, uint64_t *iova);
+
+/**
+ * qemu_vfio_dma_reset_temporary: drop all temporary mappings
+ *
+ * The caller must ensure that no request uses a temporary mapping anymore.
+ */
+int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s);
+
+/**
+ * qemu_vfio_dma_unmap: remove the permanent mapping that covers @host
+ */
+void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host);
+
+/**
+ * qemu_vfio_pci_map_bar: map part of a BAR of the device into memory
+ *
+ * @index: BAR number
+ * @offset: page aligned offset into the BAR
+ * @size: number of bytes to map
+ * @errp: error object
+ */
+void *qemu_vfio_pci_map_bar(QEMUVFIOState *s, int index,
+                            uint64_t offset, uint64_t size,
+                            Error **errp);
+
+/**
+ * qemu_vfio_pci_unmap_bar: unmap a region returned by qemu_vfio_pci_map_bar()
+ */
+void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
+                             uint64_t offset, uint64_t size);
+
+/**
+ * qemu_vfio_pci_init_irq: signal @e when the device raises an interrupt
+ *
+ * @irq_type: VFIO_PCI_*_IRQ_INDEX; MSI-X uses vector 0 only
+ * @errp: error object
+ */
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp);
+
+#endif
@@ -0,0 +1,419 @@
+/*
+ * Page compression backends for live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#include "qapi/error.h"
+#include "compress.h"
+
+/* lz4 keeps its history in place; pages are copied to a ring of this size */
+#define LZ4_RING_MIN_SIZE (64 * 1024)
+
+typedef struct MigrationCompressOps {
+    bool stream;
+    size_t (*bound)(size_t len);
+    int (*init)(MigrationCompress *c, int level, Error **errp);
+    void (*cleanup)(MigrationCompress *c);
+    ssize_t (*compress)(MigrationCompress *c, const uint8_t *src, size_t slen,
+                        uint8_t *dst, size_t dlen);
+    ssize_t (*decompress)(MigrationCompress *c, const uint8_t *src,
+                          size_t slen, uint8_t *dst, size_t dlen);
+} MigrationCompressOps;
+
+struct MigrationCompress {
+    const MigrationCompressOps *ops;
+    MigrationCompressMethod method;
+    bool decompress;
+    int level;
+    z_stream zstream;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+#ifdef CONFIG_LZ4
+    LZ4_stream_t *lz4_stream;
+    LZ4_streamDecode_t *lz4_stream_decode;
+#endif
+    uint8_t *ring;
+    size_t ring_size;
+    size_t ring_pos;
+};
+
+/*
+ * zlib: every page is a complete zlib stream, exactly as produced by
+ * compress2(), so that the wire format stays compatible with older QEMU.
+ * The deflate/inflate state is only reset between pages rather than
+ * allocated from scratch each time.
+ */
+static size_t zlib_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+static int zlib_init(MigrationCompress *c, int level, Error **errp)
+{
+    int ret;
+
+    if (c->decompress) {
+        ret = inflateInit(&c->zstream);
+    } else {
+        ret = deflateInit(&c->zstream, level);
+    }
+    if (ret != Z_OK) {
+        error_setg(errp, "failed to initialize zlib %s stream: %d",
+                   c->decompress ? "inflate" : "deflate", ret);
+        return -1;
+    }
+    return 0;
+}
+
+static void zlib_cleanup(MigrationCompress *c)
+{
+    if (c->decompress) {
+        inflateEnd(&c->zstream);
+    } else {
+        deflateEnd(&c->zstream);
+    }
+}
+
+static ssize_t zlib_compress(MigrationCompress *c, const uint8_t *src,
+                             size_t slen, uint8_t *dst, size_t dlen)
+{
+    z_stream *zs = &c->zstream;
+
+    if (deflateReset(zs) != Z_OK) {
+        return -1;
+    }
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = slen;
+    zs->next_out = dst;
+    zs->avail_out = dlen;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dlen - zs->avail_out;
+}
+
+static ssize_t zlib_decompress(MigrationCompress *c, const uint8_t *src,
+                               size_t slen, uint8_t *dst, size_t dlen)
+{
+    z_stream *zs = &c->zstream;
+
+    if (inflateReset(zs) != Z_OK) {
+        return -1;
+    }
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = slen;
+    zs->next_out = dst;
+    zs->avail_out = dlen;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dlen - zs->avail_out;
+}
+
+static const MigrationCompressOps zlib_ops = {
+    .stream = false,
+    .bound = zlib_bound,
+    .init = zlib_init,
+    .cleanup = zlib_cleanup,
+    .compress = zlib_compress,
+    .decompress = zlib_decompress,
+};
+
+#ifdef CONFIG_ZSTD
+/*
+ * zstd: one endless frame per stream, flushed after every page.  zstd
+ * copies its input into the window, so a page that is modified while it
+ * is being compressed still produces a consistent stream.
+ */
+static size_t zstd_bound(size_t len)
+{
+    /* room for the frame header and the block header of every flush */
+    return ZSTD_compressBound(len) + 32;
+}
+
+static int zstd_init(MigrationCompress *c, int level, Error **errp)
+{
+    size_t ret;
+
+    if (c->decompress) {
+        c->zstd_dctx = ZSTD_createDCtx();
+        if (!c->zstd_dctx) {
+            error_setg(errp, "failed to create zstd decompression context");
+            return -1;
+        }
+        return 0;
+    }
+
+    c->zstd_cctx = ZSTD_createCCtx();
+    if (!c->zstd_cctx) {
+        error_setg(errp, "failed to create zstd compression context");
+        return -1;
+    }
+    /* zstd has no "store only" level, use the fastest one for level 0 */
+    ret = ZSTD_CCtx_setParameter(c->zstd_cctx, ZSTD_c_compressionLevel,
+                                 MAX(level, 1));
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "failed to set zstd compression level: %s",
+                   ZSTD_getErrorName(ret));
+        ZSTD_freeCCtx(c->zstd_cctx);
+        c->zstd_cctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void zstd_cleanup(MigrationCompress *c)
+{
+    ZSTD_freeCCtx(c->zstd_cctx);
+    ZSTD_freeDCtx(c->zstd_dctx);
+}
+
+static ssize_t zstd_compress(MigrationCompress *c, const uint8_t *src,
+                             size_t slen, uint8_t *dst, size_t dlen)
+{
+    ZSTD_inBuffer in = { .src = src, .size = slen, .pos = 0 };
+    ZSTD_outBuffer out = { .dst = dst, .size = dlen, .pos = 0 };
+    size_t ret;
+
+    do {
+        ret = ZSTD_compressStream2(c->zstd_cctx, &out, &in, ZSTD_e_flush);
+        if (ZSTD_isError(ret)) {
+            return -1;
+        }
+    } while (ret != 0 && out.pos < out.size);
+
+    /* Anything left in the context would desynchronize the stream */
+    if (ret != 0) {
+        return -1;
+    }
+    return out.pos;
+}
+
+static ssize_t zstd_decompress(MigrationCompress *c, const uint8_t *src,
+                               size_t slen, uint8_t *dst, size_t dlen)
+{
+    ZSTD_inBuffer in = { .src = src, .size = slen, .pos = 0 };
+    ZSTD_outBuffer out = { .dst = dst, .size = dlen, .pos = 0 };
+    size_t in_pos, out_pos, ret;
+
+    while (in.pos < in.size) {
+        in_pos = in.pos;
+        out_pos = out.pos;
+        ret = ZSTD_decompressStream(c->zstd_dctx, &out, &in);
+        if (ZSTD_isError(ret)) {
+            return -1;
+        }
+        if (in.pos == in_pos && out.pos == out_pos) {
+            /* no progress: the page does not fit in @dst */
+            return -1;
+        }
+    }
+    return out.pos;
+}
+
+static const MigrationCompressOps zstd_ops = {
+    .stream = true,
+    .bound = zstd_bound,
+    .init = zstd_init,
+    .cleanup = zstd_cleanup,
+    .compress = zstd_compress,
+    .decompress = zstd_decompress,
+};
+#endif
+
+#ifdef CONFIG_LZ4
+/*
+ * lz4: the history is referenced in place, so pages go through a ring
+ * buffer on both sides.  Compressor and decompressor use rings of the
+ * same size and wrap at the same points, which is what lz4 calls the
+ * synchronized mode.  This also protects the history against the guest
+ * (or a later copy of the same page) overwriting the original memory.
+ */
+static size_t lz4_bound(size_t len)
+{
+    return LZ4_compressBound(len);
+}
+
+static int lz4_init(MigrationCompress *c, int level, Error **errp)
+{
+    if (c->decompress) {
+        c->lz4_stream_decode = LZ4_createStreamDecode();
+    } else {
+        c->lz4_stream = LZ4_createStream();
+    }
+    if (!c->lz4_stream && !c->lz4_stream_decode) {
+        error_setg(errp, "failed to create lz4 stream");
+        return -1;
+    }
+    return 0;
+}
+
+static void lz4_cleanup(MigrationCompress *c)
+{
+    if (c->lz4_stream) {
+        LZ4_freeStream(c->lz4_stream);
+    }
+    if (c->lz4_stream_decode) {
+        LZ4_freeStreamDecode(c->lz4_stream_decode);
+    }
+}
+
+static uint8_t *lz4_ring_get(MigrationCompress *c, size_t len)
+{
+    uint8_t *p;
+
+    if (!c->ring) {
+        c->ring_size = MAX(LZ4_RING_MIN_SIZE, 4 * len);
+        c->ring = g_malloc(c->ring_size);
+    }
+    if (len > c->ring_size) {
+        return NULL;
+    }
+    if (c->ring_pos + len > c->ring_size) {
+        c->ring_pos = 0;
+    }
+    p = c->ring + c->ring_pos;
+    c->ring_pos += len;
+    return p;
+}
+
+static ssize_t lz4_compress(MigrationCompress *c, const uint8_t *src,
+                            size_t slen, uint8_t *dst, size_t dlen)
+{
+    /* compress-level 9 means best ratio, i.e. the smallest acceleration */
+    int acceleration = MAX(10 - c->level, 1);
+    uint8_t *p = lz4_ring_get(c, slen);
+    int ret;
+
+    if (!p) {
+        return -1;
+    }
+    memcpy(p, src, slen);
+    ret = LZ4_compress_fast_continue(c->lz4_stream, (const char *)p,
+                                     (char *)dst, slen, dlen, acceleration);
+    return ret > 0 ? ret : -1;
+}
+
+static ssize_t lz4_decompress(MigrationCompress *c, const uint8_t *src,
+                              size_t slen, uint8_t *dst, size_t dlen)
+{
+    uint8_t *p = lz4_ring_get(c, dlen);
+    int ret;
+
+    if (!p) {
+        return -1;
+    }
+    ret = LZ4_decompress_safe_continue(c->lz4_stream_decode,
+                                       (const char *)src, (char *)p,
+                                       slen, dlen);
+    if (ret < 0) {
+        return -1;
+    }
+    memcpy(dst, p, ret);
+    return ret;
+}
+
+static const MigrationCompressOps lz4_ops = {
+    .stream = true,
+    .bound = lz4_bound,
+    .init = lz4_init,
+    .cleanup = lz4_cleanup,
+    .compress = lz4_compress,
+    .decompress = lz4_decompress,
+};
+#endif
+
+static const MigrationCompressOps *
+migration_compress_ops[MIGRATION_COMPRESS_METHOD__MAX] = {
+    [MIGRATION_COMPRESS_METHOD_ZLIB] = &zlib_ops,
+#ifdef CONFIG_ZSTD
+    [MIGRATION_COMPRESS_METHOD_ZSTD] = &zstd_ops,
+#endif
+#ifdef CONFIG_LZ4
+    [MIGRATION_COMPRESS_METHOD_LZ4] = &lz4_ops,
+#endif
+};
+
+bool migration_compress_method_supported(MigrationCompressMethod method)
+{
+    return method < MIGRATION_COMPRESS_METHOD__MAX &&
+           migration_compress_ops[method] != NULL;
+}
+
+bool migration_compress_method_is_stream(MigrationCompressMethod method)
+{
+    assert(migration_compress_method_supported(method));
+    return migration_compress_ops[method]->stream;
+}
+
+size_t migration_compress_bound(MigrationCompressMethod method, size_t len)
+{
+    assert(migration_compress_method_supported(method));
+    return migration_compress_ops[method]->bound(len);
+}
+
+MigrationCompress *migration_compress_new(MigrationCompressMethod method,
+                                          int level, bool decompress,
+                                          Error **errp)
+{
+    MigrationCompress *c;
+
+    if (!migration_compress_method_supported(method)) {
+        error_setg(errp, "compression method '%s' is not supported by "
+                   "this QEMU binary", MigrationCompressMethod_str(method));
+        return NULL;
+    }
+
+    c = g_new0(MigrationCompress, 1);
+    c->ops = migration_compress_ops[method];
+    c->method = method;
+    c->decompress = decompress;
+    c->level = level;
+    if (c->ops->init(c, level, errp) < 0) {
+        g_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void migration_compress_free(MigrationCompress *c)
+{
+    if (!c) {
+        return;
+    }
+    c->ops->cleanup(c);
+    g_free(c->ring);
+    g_free(c);
+}
+
+MigrationCompressMethod migration_compress_get_method(MigrationCompress *c)
+{
+    return c->method;
+}
+
+ssize_t migration_compress_buffer(MigrationCompress *c, const uint8_t *src,
+                                  size_t slen, uint8_t *dst, size_t dlen)
+{
+    assert(!c->decompress);
+    return c->ops->compress(c, src, slen, dst, dlen);
+}
+
+ssize_t migration_decompress_buffer(MigrationCompress *c, const uint8_t *src,
+                                    size_t slen, uint8_t *dst, size_t dlen)
+{
+    assert(c->decompress);
+    return c->ops->decompress(c, src, slen, dst, dlen);
+}
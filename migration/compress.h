@@ -0,0 +1,119 @@
+/*
+ * Page compression backends for live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi-types.h"
+
+/*
+ * Number of independent compression streams that can be told apart on
+ * the wire; the stream id is sent as a single byte in front of every
+ * page compressed with a streaming method.
+ */
+#define MIGRATION_COMPRESS_MAX_STREAMS 256
+
+/* Compression or decompression context of a single stream */
+typedef struct MigrationCompress MigrationCompress;
+
+/**
+ * migration_compress_method_supported: check if @method was compiled in
+ *
+ * Returns true if @method can be used on this build.
+ *
+ * @method: compression method to check
+ */
+bool migration_compress_method_supported(MigrationCompressMethod method);
+
+/**
+ * migration_compress_method_is_stream: check if @method keeps history
+ *
+ * Streaming methods carry their history from one page to the next, so
+ * the pages of one stream must be decompressed in the order they were
+ * compressed, and by the same context.  Non streaming methods (zlib, to
+ * stay compatible with older QEMU) compress every page independently.
+ *
+ * @method: compression method to check
+ */
+bool migration_compress_method_is_stream(MigrationCompressMethod method);
+
+/**
+ * migration_compress_bound: worst case size of a compressed buffer
+ *
+ * Returns the maximum number of bytes that compressing @len bytes with
+ * @method can produce.
+ *
+ * @method: compression method
+ * @len: size of the uncompressed input
+ */
+size_t migration_compress_bound(MigrationCompressMethod method, size_t len);
+
+/**
+ * migration_compress_new: create a compression or decompression context
+ *
+ * The context is meant to be owned by a single thread and reused for
+ * all the pages of one stream, so that the backend keeps its internal
+ * state (and, for streaming methods, its history) across pages.
+ *
+ * Returns the new context, or NULL on error.
+ *
+ * @method: compression method
+ * @level: compression level between 0 and 9, as for the compress-level
+ *         migration parameter; ignored when @decompress is true
+ * @decompress: true to create a decompression context
+ * @errp: set *errp on failure
+ */
+MigrationCompress *migration_compress_new(MigrationCompressMethod method,
+                                          int level, bool decompress,
+                                          Error **errp);
+
+/**
+ * migration_compress_free: free a context created by migration_compress_new
+ *
+ * @c: context to free, may be NULL
+ */
+void migration_compress_free(MigrationCompress *c);
+
+/**
+ * migration_compress_get_method: return the method used by a context
+ *
+ * @c: compression or decompression context
+ */
+MigrationCompressMethod migration_compress_get_method(MigrationCompress *c);
+
+/**
+ * migration_compress_buffer: compress @slen bytes from @src into @dst
+ *
+ * Returns the size of the compressed data, or -1 on error.  For
+ * streaming methods the output is only valid when decompressed after all
+ * the previous buffers compressed by @c.
+ *
+ * @c: compression context
+ * @src: data to compress
+ * @slen: size of @src
+ * @dst: output buffer
+ * @dlen: size of @dst; migration_compress_bound() is always enough
+ */
+ssize_t migration_compress_buffer(MigrationCompress *c, const uint8_t *src,
+                                  size_t slen, uint8_t *dst, size_t dlen);
+
+/**
+ * migration_decompress_buffer: decompress @slen bytes from @src into @dst
+ *
+ * Returns the size of the decompressed data, or -1 on error.
+ *
+ * @c: decompression context
+ * @src: compressed data
+ * @slen: size of @src
+ * @dst: output buffer
+ * @dlen: size of @dst
+ */
+ssize_t migration_decompress_buffer(MigrationCompress *c, const uint8_t *src,
+                                    size_t slen, uint8_t *dst, size_t dlen);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * Unlike exec: or fd:, the file: protocol knows that it writes to a
+ * regular file, which lets the mapped-ram capability store each page of
+ * RAM at a fixed offset of the file instead of appending every copy of it
+ * to the stream.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_outgoing(filename);
+    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(fioc), NULL);
+    object_unref(OBJECT(fioc));
+}
+
+/*
+ * With mapped-ram, RAM is read in large chunks straight into guest memory;
+ * bypass the page cache for those if the file system allows, so that
+ * restoring does not need twice the memory.
+ */
+static QIOChannel *file_open_direct(const char *filename)
+{
+#ifdef O_DIRECT
+    QIOChannelFile *fioc;
+
+    fioc = qio_channel_file_new_path(filename, O_RDONLY | O_DIRECT, 0, NULL);
+    if (fioc) {
+        return QIO_CHANNEL(fioc);
+    }
+#endif
+    return NULL;
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QIOChannelFile *fioc;
+
+    trace_migration_file_incoming(filename);
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    mis->file_direct_ioc = file_open_direct(filename);
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch(QIO_CHANNEL(fioc),
+                          G_IO_IN,
+                          file_accept_incoming_migration,
+                          NULL,
+                          NULL);
+}
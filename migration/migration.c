@@ -19,6 +19,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "rdma.h"
 #include "ram.h"
@@ -34,6 +35,7 @@
 #include "qemu/rcu.h"
 #include "block.h"
 #include "postcopy-ram.h"
+#include "compress.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
@@ -42,6 +44,7 @@
 #include "io/channel-buffer.h"
 #include "migration/colo.h"
 #include "hw/boards.h"
+#include "sysemu/cpus.h"
 #include "monitor/monitor.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
@@ -79,6 +82,9 @@
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
 #define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 16
+#define DEFAULT_MIGRATE_ZERO_PAGE_THREADS 0
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_DEPTH 0
+#define DEFAULT_MIGRATE_POSTCOPY_PLACE_THREADS 0
 
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
@@ -171,6 +177,11 @@ void migration_incoming_state_destroy(void)
         mis->from_src_file = NULL;
     }
 
+    if (mis->file_direct_ioc) {
+        object_unref(OBJECT(mis->file_direct_ioc));
+        mis->file_direct_ioc = NULL;
+    }
+
     qemu_event_reset(&mis->main_thread_load_event);
 }
 
@@ -259,6 +270,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -406,12 +419,28 @@ void migration_fd_process_incoming(QEMUFile *f)
 void migration_ioc_process_incoming(QIOChannel *ioc)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
+    bool start_migration;
 
     if (!mis->from_src_file) {
+        /* The first connection is always the main migration channel */
         QEMUFile *f = qemu_fopen_channel_input(ioc);
-        migration_fd_process_incoming(f);
+        migration_incoming_setup(f);
+        start_migration = !migrate_use_multifd();
+    } else {
+        Error *local_err = NULL;
+
+        /* Any further connection is a multifd channel */
+        assert(migrate_use_multifd());
+        start_migration = multifd_recv_new_channel(ioc, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            return;
+        }
+    }
+
+    if (start_migration) {
+        migration_incoming_process();
     }
-    /* We still only have a single channel.  Nothing to do here yet */
 }
 
 /**
@@ -422,7 +451,9 @@ void migration_ioc_process_incoming(QIOChannel *ioc)
  */
 bool migration_has_all_channels(void)
 {
-    return true;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    return mis->from_src_file != NULL && multifd_recv_all_channels_created();
 }
 
 /*
@@ -491,6 +522,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params = g_malloc0(sizeof(*params));
     params->has_compress_level = true;
     params->compress_level = s->parameters.compress_level;
+    params->has_compress_method = true;
+    params->compress_method = s->parameters.compress_method;
     params->has_compress_threads = true;
     params->compress_threads = s->parameters.compress_threads;
     params->has_decompress_threads = true;
@@ -517,6 +550,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->x_multifd_page_count = s->parameters.x_multifd_page_count;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
+    params->has_zero_page_threads = true;
+    params->zero_page_threads = s->parameters.zero_page_threads;
+    params->has_postcopy_prefetch_depth = true;
+    params->postcopy_prefetch_depth = s->parameters.postcopy_prefetch_depth;
+    params->has_postcopy_place_threads = true;
+    params->postcopy_place_threads = s->parameters.postcopy_place_threads;
 
     return params;
 }
@@ -561,14 +600,24 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
-        info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
+        info->xbzrle_cache->cache_size = xbzrle_counters.cache_size ?:
+                                         migrate_xbzrle_cache_size();
         info->xbzrle_cache->bytes = xbzrle_counters.bytes;
         info->xbzrle_cache->pages = xbzrle_counters.pages;
         info->xbzrle_cache->cache_miss = xbzrle_counters.cache_miss;
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
+        info->xbzrle_cache->cache_hit = xbzrle_counters.cache_hit;
+        info->xbzrle_cache->cache_hit_rate = xbzrle_counters.cache_hit_rate;
+        info->xbzrle_cache->cache_eviction = xbzrle_counters.cache_eviction;
+        info->xbzrle_cache->cache_conflict = xbzrle_counters.cache_conflict;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
     }
 
+    if (migrate_use_multifd()) {
+        info->multifd = multifd_query_stats();
+        info->has_multifd = info->multifd != NULL;
+    }
+
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
@@ -595,6 +644,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
     MigrationState *s = migrate_get_current();
+    MigrationIncomingState *mis = migration_incoming_get_current();
 
     switch (s->state) {
     case MIGRATION_STATUS_NONE:
@@ -650,6 +700,16 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     }
     info->status = s->state;
 
+    if (mis->postcopy_prefetch) {
+        PostcopyPrefetchStats *stats = &mis->postcopy_prefetch_stats;
+
+        info->has_postcopy_prefetch = true;
+        info->postcopy_prefetch = g_malloc0(sizeof(*info->postcopy_prefetch));
+        info->postcopy_prefetch->requested = stats->requested;
+        info->postcopy_prefetch->used = stats->used;
+        info->postcopy_prefetch->wasted = stats->wasted;
+    }
+
     return info;
 }
 
@@ -711,6 +771,46 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        /* These send pages that are not whole or not in the main stream */
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            cap_list[MIGRATION_CAPABILITY_X_MULTIFD] ||
+            cap_list[MIGRATION_CAPABILITY_RELEASE_RAM]) {
+            error_setg(errp, "mapped-ram is not compatible with postcopy-ram, "
+                       "xbzrle, compress, x-multifd or release-ram");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+        /*
+         * Pages are saved once, as they were when the snapshot started;
+         * these rely on dirty logging, send pages again or let the
+         * guest run elsewhere.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            cap_list[MIGRATION_CAPABILITY_X_MULTIFD] ||
+            cap_list[MIGRATION_CAPABILITY_RELEASE_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO] ||
+            cap_list[MIGRATION_CAPABILITY_BLOCK] ||
+            cap_list[MIGRATION_CAPABILITY_RETURN_PATH] ||
+            cap_list[MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER]) {
+            error_setg(errp, "background-snapshot is not compatible with "
+                       "postcopy-ram, xbzrle, compress, x-multifd, "
+                       "release-ram, x-colo, block, return-path or "
+                       "pause-before-switchover");
+            return false;
+        }
+
+        if (!ram_write_tracking_available(errp)) {
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -747,6 +847,14 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_compress_method &&
+        !migration_compress_method_supported(params->compress_method)) {
+        error_setg(errp, "Compression method '%s' is not supported by "
+                   "this QEMU binary",
+                   MigrationCompressMethod_str(params->compress_method));
+        return false;
+    }
+
     if (params->has_compress_threads &&
         (params->compress_threads < 1 || params->compress_threads > 255)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
@@ -829,6 +937,32 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_zero_page_threads &&
+        (params->zero_page_threads < 0 || params->zero_page_threads > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "zero_page_threads",
+                   "is invalid, it should be in the range of 0 to 255");
+        return false;
+    }
+
+    if (params->has_postcopy_prefetch_depth &&
+        (params->postcopy_prefetch_depth < 0 ||
+         params->postcopy_prefetch_depth > 1024)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_depth",
+                   "is invalid, it should be in the range of 0 to 1024");
+        return false;
+    }
+
+    if (params->has_postcopy_place_threads &&
+        (params->postcopy_place_threads < 0 ||
+         params->postcopy_place_threads > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_place_threads",
+                   "is invalid, it should be in the range of 0 to 255");
+        return false;
+    }
+
     return true;
 }
 
@@ -843,6 +977,10 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
         dest->compress_level = params->compress_level;
     }
 
+    if (params->has_compress_method) {
+        dest->compress_method = params->compress_method;
+    }
+
     if (params->has_compress_threads) {
         dest->compress_threads = params->compress_threads;
     }
@@ -893,6 +1031,15 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
+    if (params->has_zero_page_threads) {
+        dest->zero_page_threads = params->zero_page_threads;
+    }
+    if (params->has_postcopy_prefetch_depth) {
+        dest->postcopy_prefetch_depth = params->postcopy_prefetch_depth;
+    }
+    if (params->has_postcopy_place_threads) {
+        dest->postcopy_place_threads = params->postcopy_place_threads;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -905,6 +1052,10 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.compress_level = params->compress_level;
     }
 
+    if (params->has_compress_method) {
+        s->parameters.compress_method = params->compress_method;
+    }
+
     if (params->has_compress_threads) {
         s->parameters.compress_threads = params->compress_threads;
     }
@@ -965,6 +1116,16 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
     }
+    if (params->has_zero_page_threads) {
+        s->parameters.zero_page_threads = params->zero_page_threads;
+    }
+    if (params->has_postcopy_prefetch_depth) {
+        s->parameters.postcopy_prefetch_depth =
+            params->postcopy_prefetch_depth;
+    }
+    if (params->has_postcopy_place_threads) {
+        s->parameters.postcopy_place_threads = params->postcopy_place_threads;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -1354,11 +1515,32 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         error_setg(errp, "Guest is waiting for an incoming migration");
         return;
     }
+    if (ram_dirty_rate_measuring()) {
+        error_setg(errp, "A dirty page rate measurement is in progress");
+        return;
+    }
 
     if (migration_is_blocked(errp)) {
         return;
     }
 
+    if (migrate_use_multifd()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "multifd is only supported on tcp: and unix: "
+                       "migrations");
+            return;
+        }
+        if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+            error_setg(errp, "multifd is not supported with TLS");
+            return;
+        }
+    }
+
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped-ram is only supported on file: migrations");
+        return;
+    }
+
     if ((has_blk && blk) || (has_inc && inc)) {
         if (migrate_use_block() || migrate_use_block_incremental()) {
             error_setg(errp, "Command options are incompatible with "
@@ -1391,6 +1573,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -1476,6 +1660,42 @@ bool migrate_release_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_RELEASE_RAM];
 }
 
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_adaptive_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ADAPTIVE_CONVERGE];
+}
+
+int64_t migrate_downtime_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.downtime_limit;
+}
+
 bool migrate_postcopy_ram(void)
 {
     MigrationState *s;
@@ -1526,6 +1746,15 @@ int migrate_compress_level(void)
     return s->parameters.compress_level;
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -1608,6 +1837,42 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->parameters.xbzrle_cache_size;
 }
 
+int migrate_postcopy_place_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_place_threads;
+}
+
+int migrate_postcopy_prefetch_depth(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_depth;
+}
+
+int migrate_zero_page_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.zero_page_threads;
+}
+
+bool migrate_xbzrle_cache_autosize(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE_CACHE_AUTOSIZE];
+}
+
 bool migrate_use_block(void)
 {
     MigrationState *s;
@@ -2333,6 +2598,167 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+/**
+ * bg_migration_completion: Used by bg_migration_thread once all of RAM
+ *   is saved, to append the device state saved at the start.
+ *
+ * @s: Current migration state
+ * @bioc: Buffer holding the device state
+ */
+static void bg_migration_completion(MigrationState *s, QIOChannelBuffer *bioc)
+{
+    int ret;
+
+    /* All of RAM is saved, nothing can be waiting to write to it anymore */
+    ram_write_tracking_stop();
+
+    qemu_mutex_lock_iothread();
+    ret = qemu_savevm_state_complete_precopy(s->to_dst_file, true, false);
+    qemu_mutex_unlock_iothread();
+
+    if (ret >= 0) {
+        qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+        qemu_fflush(s->to_dst_file);
+    }
+
+    if (ret < 0 || qemu_file_get_error(s->to_dst_file)) {
+        trace_migration_completion_file_err();
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+        return;
+    }
+
+    migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_COMPLETED);
+}
+
+/*
+ * Migration thread of a background snapshot.
+ * The VM is only stopped while the state of the devices is saved into a
+ * buffer and RAM is write protected; RAM is then saved with the guest
+ * running, each page before the guest first writes to it, and followed
+ * by the device state so that loading it sees RAM as the devices did.
+ */
+static void *bg_migration_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    int64_t initial_bytes = 0;
+    int64_t stop_time, end_time;
+    bool old_vm_running;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    Error *local_err = NULL;
+    int ret;
+
+    rcu_register_thread();
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_setup(s->to_dst_file);
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    trace_migration_thread_setup_complete();
+
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-snapshot-buffer");
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    ret = qemu_file_get_error(s->to_dst_file);
+    if (!ret) {
+        qemu_mutex_lock_iothread();
+        stop_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+        old_vm_running = runstate_is_running();
+        ret = global_state_store();
+        if (!ret) {
+            ret = vm_stop_force_state(RUN_STATE_PAUSED);
+        }
+        if (!ret) {
+            cpu_synchronize_all_states();
+            ret = qemu_savevm_state_complete_precopy_non_iterable(fb, false,
+                                                                  false);
+        }
+        if (!ret) {
+            ret = ram_write_tracking_start(&local_err);
+        }
+        if (old_vm_running) {
+            vm_start();
+        }
+        s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - stop_time;
+        qemu_mutex_unlock_iothread();
+    }
+
+    if (ret) {
+        if (local_err) {
+            error_report_err(local_err);
+        }
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+    }
+
+    while (s->state == MIGRATION_STATUS_ACTIVE) {
+        int64_t current_time;
+
+        if (!qemu_file_rate_limit(s->to_dst_file)) {
+            if (qemu_savevm_state_iterate(s->to_dst_file, false) > 0) {
+                bg_migration_completion(s, bioc);
+                break;
+            }
+        }
+
+        if (qemu_file_get_error(s->to_dst_file)) {
+            migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                              MIGRATION_STATUS_FAILED);
+            trace_migration_thread_file_err();
+            break;
+        }
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (current_time >= initial_time + BUFFER_DELAY) {
+            uint64_t transferred_bytes = qemu_ftell(s->to_dst_file) -
+                                         initial_bytes;
+            uint64_t time_spent = current_time - initial_time;
+
+            s->mbps = (((double) transferred_bytes * 8.0) /
+                    ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
+
+            qemu_file_reset_rate_limit(s->to_dst_file);
+            initial_time = current_time;
+            initial_bytes = qemu_ftell(s->to_dst_file);
+        }
+        if (qemu_file_rate_limit(s->to_dst_file)) {
+            /* usleep expects microseconds */
+            g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
+        }
+    }
+
+    trace_migration_thread_after_loop();
+    /* On failure or cancellation, wake up anything waiting to write */
+    ram_write_tracking_stop();
+    qemu_fclose(fb);
+    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    qemu_mutex_lock_iothread();
+    qemu_savevm_state_cleanup();
+    if (s->state == MIGRATION_STATUS_COMPLETED) {
+        uint64_t transferred_bytes = qemu_ftell(s->to_dst_file);
+        s->total_time = end_time - s->total_time;
+        if (s->total_time) {
+            s->mbps = (((double) transferred_bytes * 8.0) /
+                       ((double) s->total_time)) / 1000;
+        }
+    }
+    qemu_bh_schedule(s->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s)
 {
     s->expected_downtime = s->parameters.downtime_limit;
@@ -2366,8 +2792,13 @@ void migrate_fd_connect(MigrationState *s)
         migrate_fd_cleanup(s);
         return;
     }
-    qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "bg_snapshot", bg_migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
@@ -2426,6 +2857,15 @@ static Property migration_properties[] = {
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
+    DEFINE_PROP_INT64("x-zero-page-threads", MigrationState,
+                      parameters.zero_page_threads,
+                      DEFAULT_MIGRATE_ZERO_PAGE_THREADS),
+    DEFINE_PROP_INT64("x-postcopy-prefetch-depth", MigrationState,
+                      parameters.postcopy_prefetch_depth,
+                      DEFAULT_MIGRATE_POSTCOPY_PREFETCH_DEPTH),
+    DEFINE_PROP_INT64("x-postcopy-place-threads", MigrationState,
+                      parameters.postcopy_place_threads,
+                      DEFAULT_MIGRATE_POSTCOPY_PLACE_THREADS),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -2440,6 +2880,13 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_X_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-xbzrle-cache-autosize",
+                        MIGRATION_CAPABILITY_XBZRLE_CACHE_AUTOSIZE),
+    DEFINE_PROP_MIG_CAP("x-adaptive-converge",
+                        MIGRATION_CAPABILITY_ADAPTIVE_CONVERGE),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-background-snapshot",
+                        MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -2478,6 +2925,7 @@ static void migration_instance_init(Object *obj)
 
     /* Set has_* up only for parameter checks */
     params->has_compress_level = true;
+    params->has_compress_method = true;
     params->has_compress_threads = true;
     params->has_decompress_threads = true;
     params->has_cpu_throttle_initial = true;
@@ -2489,6 +2937,9 @@ static void migration_instance_init(Object *obj)
     params->has_x_multifd_channels = true;
     params->has_x_multifd_page_count = true;
     params->has_xbzrle_cache_size = true;
+    params->has_zero_page_threads = true;
+    params->has_postcopy_prefetch_depth = true;
+    params->has_postcopy_place_threads = true;
 }
 
 /*
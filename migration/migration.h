@@ -21,6 +21,9 @@
 #include "qemu/coroutine_int.h"
 #include "hw/qdev.h"
 #include "io/channel.h"
+#include "postcopy-prefetch.h"
+
+typedef struct PostcopyPlaceParam PostcopyPlaceParam;
 
 /* State for the incoming migration */
 struct MigrationIncomingState {
@@ -41,6 +44,9 @@ struct MigrationIncomingState {
     QemuThread     listen_thread;
     QemuSemaphore  listen_thread_sem;
 
+    /* file: migration opened with O_DIRECT, for mapped-ram to read RAM */
+    QIOChannel *file_direct_ioc;
+
     /* For the kernel to send us notifications */
     int       userfault_fd;
     /* To tell the fault_thread to quit */
@@ -50,6 +56,16 @@ struct MigrationIncomingState {
     void     *postcopy_tmp_page;
     void     *postcopy_tmp_zero_page;
 
+    /* Postcopy page placement threads, see postcopy-ram.c */
+    PostcopyPlaceParam *place_param;
+    int       place_thread_count;
+    /* Thread whose temporary page is being filled */
+    int       place_next;
+    /* First error hit by a placement thread */
+    int       place_error;
+    QemuMutex place_done_lock;
+    QemuCond  place_done_cond;
+
     QEMUBH *bh;
 
     int state;
@@ -59,6 +75,10 @@ struct MigrationIncomingState {
     /* The coroutine we should enter (back) after failover */
     Coroutine *migration_incoming_co;
     QemuSemaphore colo_incoming_sem;
+
+    /* Pages requested ahead of postcopy faults, see postcopy-prefetch.c */
+    bool      postcopy_prefetch;
+    PostcopyPrefetchStats postcopy_prefetch_stats;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -183,6 +203,10 @@ bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
+bool migrate_adaptive_converge(void);
+bool migrate_mapped_ram(void);
+bool migrate_background_snapshot(void);
+int64_t migrate_downtime_limit(void);
 bool migrate_use_multifd(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
@@ -190,6 +214,10 @@ int migrate_multifd_page_count(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
+bool migrate_xbzrle_cache_autosize(void);
+int migrate_zero_page_threads(void);
+int migrate_postcopy_prefetch_depth(void);
+int migrate_postcopy_place_threads(void);
 bool migrate_colo_enabled(void);
 
 bool migrate_use_block(void);
@@ -198,6 +226,7 @@ bool migrate_use_return_path(void);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
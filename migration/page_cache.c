@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is base on a hash of the page address, and is set associative
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -31,37 +31,85 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* Number of pages that can share a set */
+#define CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint64_t it_hits;
     uint8_t *it_data;
 };
 
+/*
+ * The cache is set associative: an address selects a set of num_ways
+ * consecutive items, and can be stored in any of them.  When the set is
+ * full, the least recently used page (the one with the oldest it_age,
+ * and then the fewest hits) is replaced, unless it is still fresh.
+ */
 struct PageCache {
     CacheItem *page_cache;
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    size_t num_ways;
+    size_t num_sets;
 };
 
-PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
+static bool cache_alloc_items(PageCache *cache, size_t num_pages,
+                              Error **errp)
 {
-    int64_t i;
-    size_t num_pages = new_size / page_size;
-    PageCache *cache;
+    size_t i;
+
+    cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
+
+    DPRINTF("Setting cache buckets to %zu (%zu sets of %zu)\n",
+            cache->max_num_items, cache->num_sets, cache->num_ways);
+
+    /* We prefer not to abort if there is no memory */
+    cache->page_cache = g_try_malloc((cache->max_num_items) *
+                                     sizeof(*cache->page_cache));
+    if (!cache->page_cache) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                   "Failed to allocate page cache");
+        return false;
+    }
+
+    for (i = 0; i < cache->max_num_items; i++) {
+        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
+        cache->page_cache[i].it_addr = -1;
+    }
+    return true;
+}
 
+static bool cache_check_size(int64_t new_size, size_t page_size, Error **errp)
+{
     if (new_size < page_size) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
                    "is smaller than one target page size");
-        return NULL;
+        return false;
     }
 
     /* round down to the nearest power of 2 */
-    if (!is_power_of_2(num_pages)) {
+    if (!is_power_of_2(new_size / page_size)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
                    "is not a power of two number of pages");
+        return false;
+    }
+    return true;
+}
+
+PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
+{
+    PageCache *cache;
+
+    if (!cache_check_size(new_size, page_size, errp)) {
         return NULL;
     }
 
@@ -74,26 +122,12 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     }
     cache->page_size = page_size;
     cache->num_items = 0;
-    cache->max_num_items = num_pages;
-
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
 
-    /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
-        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
-                   "Failed to allocate page cache");
+    if (!cache_alloc_items(cache, new_size / page_size, errp)) {
         g_free(cache);
         return NULL;
     }
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
-    }
-
     return cache;
 }
 
@@ -113,28 +147,55 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    size_t set;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it = cache_get_set(cache, addr);
+    size_t i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (it[i].it_data && it[i].it_addr == addr) {
+            return &it[i];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/* Returns the item that should receive @addr: an empty one if possible */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    size_t i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (!it[i].it_data) {
+            return &it[i];
+        }
+        if (!victim || it[i].it_age < victim->it_age ||
+            (it[i].it_age == victim->it_age &&
+             it[i].it_hits < victim->it_hits)) {
+            victim = &it[i];
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -144,9 +205,10 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_hits++;
         return true;
     }
     return false;
@@ -155,17 +217,23 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
-
     CacheItem *it;
+    int ret = 0;
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+        if (it->it_data) {
+            if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+                /* all the pages in the set are fresh, don't replace them */
+                return -1;
+            }
+            ret = 1;
+        }
+        it->it_hits = 0;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -181,5 +249,55 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     it->it_age = current_age;
     it->it_addr = addr;
 
+    return ret;
+}
+
+int cache_resize(PageCache *cache, int64_t new_size, Error **errp)
+{
+    CacheItem *old_items = cache->page_cache;
+    size_t old_num_items = cache->max_num_items;
+    size_t old_num_ways = cache->num_ways;
+    size_t old_num_sets = cache->num_sets;
+    CacheItem *old, *it;
+    size_t i;
+
+    if (!cache_check_size(new_size, cache->page_size, errp)) {
+        return -1;
+    }
+    if (!cache_alloc_items(cache, new_size / cache->page_size, errp)) {
+        cache->page_cache = old_items;
+        cache->max_num_items = old_num_items;
+        cache->num_ways = old_num_ways;
+        cache->num_sets = old_num_sets;
+        return -1;
+    }
+
+    /* Move the pages over, keeping the most recently used ones */
+    cache->num_items = 0;
+    for (i = 0; i < old_num_items; i++) {
+        old = &old_items[i];
+        if (!old->it_data) {
+            continue;
+        }
+        it = cache_get_victim(cache, old->it_addr);
+        if (it->it_data) {
+            if (it->it_age > old->it_age ||
+                (it->it_age == old->it_age && it->it_hits >= old->it_hits)) {
+                g_free(old->it_data);
+                continue;
+            }
+            g_free(it->it_data);
+            cache->num_items--;
+        }
+        *it = *old;
+        cache->num_items++;
+    }
+    g_free(old_items);
+
     return 0;
 }
+
+int64_t cache_get_size(const PageCache *cache)
+{
+    return cache->max_num_items * cache->page_size;
+}
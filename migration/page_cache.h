@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is base on a hash of the page address, and is set associative
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -61,7 +61,12 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 when the page isn't inserted into cache
+ * If all the pages of the set that @addr maps to are in use, the least
+ * recently used one is evicted, unless it was used within the last two
+ * generations.
+ *
+ * Returns -1 when the page isn't inserted into cache, 1 when another
+ * page was evicted to make room for it, 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -71,4 +76,25 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
+/**
+ * cache_resize: change the size of the cache, keeping its contents
+ *
+ * Pages that do not fit in the new size are dropped, starting from the
+ * least recently used ones.  On error the cache is left unchanged.
+ *
+ * Returns 0 on success, -1 on error
+ *
+ * @cache pointer to the PageCache struct
+ * @new_size: new cache size in bytes
+ * @errp: set *errp if the check failed, with reason
+ */
+int cache_resize(PageCache *cache, int64_t new_size, Error **errp);
+
+/**
+ * cache_get_size: return the size of the cache in bytes
+ *
+ * @cache pointer to the PageCache struct
+ */
+int64_t cache_get_size(const PageCache *cache);
+
 #endif
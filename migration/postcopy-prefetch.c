@@ -0,0 +1,183 @@
+/*
+ * Postcopy fault stream prediction
+ *
+ * Guests often walk memory sequentially or with a fixed stride, and each
+ * such walk turns into a series of faults, each one paying a round trip
+ * to the source.  The fault thread keeps track of a few streams of
+ * faults; once two faults of a stream are a constant distance apart, it
+ * asks for a window of pages further along the stream, so that they are
+ * already on their way when the guest gets there.  As with readahead the
+ * window starts small and doubles for every fault that stays on the
+ * stream, up to the postcopy-prefetch-depth parameter.
+ *
+ * When the prefetched pages arrive in time the guest does not fault on
+ * them at all, and the next fault of the stream is at the first page
+ * after the window.  That fault still belongs to the stream.
+ *
+ * All positions are indexes of host pages in their RAMBlock.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "postcopy-prefetch.h"
+
+#define POSTCOPY_PREFETCH_STREAMS 16
+/* Largest distance between the first two faults of a stream */
+#define POSTCOPY_PREFETCH_MAX_STRIDE 16
+
+typedef struct PostcopyFaultStream {
+    const void *block;
+    /* Last fault of the stream */
+    int64_t last;
+    /* Distance between faults, 0 if the stream has a single fault */
+    int64_t stride;
+    /* Number of faults that followed the stride */
+    unsigned run;
+    /* Next requested page the guest has not reached yet */
+    int64_t pf_next;
+    /* Number of requested pages, from pf_next on, not reached yet */
+    uint64_t pf_left;
+    /* Fault count at the last fault of the stream */
+    uint64_t lru;
+} PostcopyFaultStream;
+
+struct PostcopyPrefetch {
+    uint64_t depth;
+    uint64_t faults;
+    PostcopyPrefetchStats *stats;
+    PostcopyFaultStream streams[POSTCOPY_PREFETCH_STREAMS];
+};
+
+PostcopyPrefetch *postcopy_prefetch_new(uint64_t depth,
+                                        PostcopyPrefetchStats *stats)
+{
+    PostcopyPrefetch *pf = g_new0(PostcopyPrefetch, 1);
+
+    pf->depth = depth;
+    pf->stats = stats;
+    return pf;
+}
+
+void postcopy_prefetch_free(PostcopyPrefetch *pf)
+{
+    int i;
+
+    /* The guest never got to the pages still pending */
+    for (i = 0; i < POSTCOPY_PREFETCH_STREAMS; i++) {
+        pf->stats->wasted += pf->streams[i].pf_left;
+    }
+    g_free(pf);
+}
+
+/*
+ * Is @page on the requested window of stream @s, or the first page after
+ * it, where the guest faults once it has used the whole window?
+ */
+static bool postcopy_prefetch_on_window(PostcopyFaultStream *s, int64_t page)
+{
+    int64_t n;
+
+    if (!s->pf_left || (page - s->pf_next) % s->stride) {
+        return false;
+    }
+    n = (page - s->pf_next) / s->stride;
+    return n >= 0 && n <= s->pf_left;
+}
+
+/*
+ * Find the stream a fault at @page of @block belongs to: one that
+ * predicted it, else a single fault stream close enough to give it a
+ * stride.  Otherwise *@hit is set to false and the least recently used
+ * stream is returned, for the caller to recycle.
+ */
+static PostcopyFaultStream *postcopy_prefetch_find(PostcopyPrefetch *pf,
+                                                   const void *block,
+                                                   int64_t page, bool *hit)
+{
+    PostcopyFaultStream *s, *near = NULL, *victim = NULL;
+    int i;
+
+    for (i = 0; i < POSTCOPY_PREFETCH_STREAMS; i++) {
+        s = &pf->streams[i];
+        if (s->block == block) {
+            if (s->stride && (page == s->last + s->stride ||
+                              postcopy_prefetch_on_window(s, page))) {
+                *hit = true;
+                return s;
+            }
+            if (!s->stride && !near && page != s->last &&
+                ABS(page - s->last) <= POSTCOPY_PREFETCH_MAX_STRIDE) {
+                near = s;
+            }
+        }
+        if (!victim || s->lru < victim->lru) {
+            victim = s;
+        }
+    }
+
+    *hit = near;
+    return near ? near : victim;
+}
+
+int64_t postcopy_prefetch_fault(PostcopyPrefetch *pf, const void *block,
+                                int64_t page, int64_t pages,
+                                int64_t *next, int64_t *stride)
+{
+    PostcopyFaultStream *s;
+    int64_t end, n;
+    uint64_t window;
+    bool hit;
+
+    pf->faults++;
+    s = postcopy_prefetch_find(pf, block, page, &hit);
+    if (!hit) {
+        /* A new stream, whatever was requested for the old one is lost */
+        pf->stats->wasted += s->pf_left;
+        *s = (PostcopyFaultStream) {
+            .block = block,
+            .last = page,
+            .lru = pf->faults,
+        };
+        return 0;
+    }
+
+    s->lru = pf->faults;
+    if (!s->stride) {
+        s->stride = page - s->last;
+        s->run = 1;
+    } else {
+        /*
+         * The guest went past the requested pages up to this one; a fault
+         * right after the window means that it used all of them.  They
+         * are counted before the window grows.
+         */
+        n = (page - s->pf_next) / s->stride + 1;
+        n = MIN(MAX(n, 0), s->pf_left);
+        pf->stats->used += n;
+        s->pf_left -= n;
+        s->pf_next += n * s->stride;
+        s->run = MIN(s->run + 1, 32);
+    }
+    s->last = page;
+
+    window = MIN(pf->depth, 1ULL << s->run);
+    end = page + (int64_t)window * s->stride;
+    end = MIN(MAX(end, 0), pages - 1);
+    if (!s->pf_left) {
+        s->pf_next = page + s->stride;
+    }
+    *next = s->pf_next + (int64_t)s->pf_left * s->stride;
+    *stride = s->stride;
+    n = (end - *next) / s->stride + 1;
+    if (*next < 0 || *next >= pages || n <= 0) {
+        return 0;
+    }
+
+    s->pf_left += n;
+    pf->stats->requested += n;
+    return n;
+}
@@ -0,0 +1,61 @@
+/*
+ * Postcopy fault stream prediction
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_POSTCOPY_PREFETCH_H
+#define QEMU_MIGRATION_POSTCOPY_PREFETCH_H
+
+typedef struct PostcopyPrefetch PostcopyPrefetch;
+
+/* Pages requested ahead of faults, counted in host pages */
+typedef struct PostcopyPrefetchStats {
+    /* Pages requested */
+    uint64_t requested;
+    /* Requested pages the guest got to */
+    uint64_t used;
+    /* Requested pages left behind when their stream was given up */
+    uint64_t wasted;
+} PostcopyPrefetchStats;
+
+/**
+ * postcopy_prefetch_new: create the fault streams of a destination
+ *
+ * Returns the new fault streams
+ *
+ * @depth: largest number of pages requested ahead of a stream
+ * @stats: counters updated by postcopy_prefetch_fault()
+ */
+PostcopyPrefetch *postcopy_prefetch_new(uint64_t depth,
+                                        PostcopyPrefetchStats *stats);
+
+/**
+ * postcopy_prefetch_free: free the fault streams
+ *
+ * The pages still pending ahead of the streams are counted as wasted.
+ *
+ * @pf: fault streams
+ */
+void postcopy_prefetch_free(PostcopyPrefetch *pf);
+
+/**
+ * postcopy_prefetch_fault: account a fault and predict the next pages
+ *
+ * Returns the number of pages to request, 0 if none.  The pages to
+ * request are *@next, *@next + *@stride, ..., in that order.
+ *
+ * @pf: fault streams
+ * @block: the RAM block of the fault, only compared with other blocks
+ * @page: index of the host page of the fault in @block
+ * @pages: number of host pages in @block
+ * @next: set to the first page to request
+ * @stride: set to the distance between the pages to request
+ */
+int64_t postcopy_prefetch_fault(PostcopyPrefetch *pf, const void *block,
+                                int64_t page, int64_t pages,
+                                int64_t *next, int64_t *stride);
+
+#endif
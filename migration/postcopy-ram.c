@@ -25,6 +25,7 @@
 #include "ram.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
+#include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 
@@ -369,6 +370,8 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis, size_t ram_pages)
     return 0;
 }
 
+static void postcopy_place_threads_cleanup(MigrationIncomingState *mis);
+
 /*
  * At the end of a migration where postcopy_ram_incoming_init was called.
  */
@@ -376,6 +379,8 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    postcopy_place_threads_cleanup(mis);
+
     if (mis->have_fault_thread) {
         uint64_t tmp64;
 
@@ -494,6 +499,57 @@ static int ram_block_enable_notify(const char *block_name, void *host_addr,
     return 0;
 }
 
+/*
+ * Send a page request to the source, naming the RAMBlock only if it
+ * differs from the one of the previous request to save some space
+ */
+static void postcopy_request_pages(MigrationIncomingState *mis, RAMBlock *rb,
+                                   RAMBlock **last_rb, ram_addr_t start,
+                                   ram_addr_t len)
+{
+    if (rb != *last_rb) {
+        *last_rb = rb;
+        migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb), start, len);
+    } else {
+        migrate_send_rp_req_pages(mis, NULL, start, len);
+    }
+}
+
+/*
+ * Account a fault at @offset of @rb and request the pages that its
+ * stream is predicted to touch next.
+ */
+static void postcopy_prefetch(MigrationIncomingState *mis,
+                              PostcopyPrefetch *pf, RAMBlock *rb,
+                              ram_addr_t offset, RAMBlock **last_rb)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    int64_t pages = qemu_ram_get_used_length(rb) / pagesize;
+    int64_t next, stride, n, i;
+
+    n = postcopy_prefetch_fault(pf, rb, offset / pagesize, pages,
+                                &next, &stride);
+    if (!n) {
+        return;
+    }
+
+    trace_postcopy_ram_fault_thread_prefetch(qemu_ram_get_idstr(rb),
+                                             next * pagesize, stride, n);
+    if (stride == 1) {
+        postcopy_request_pages(mis, rb, last_rb, next * pagesize,
+                               n * pagesize);
+    } else if (stride == -1) {
+        postcopy_request_pages(mis, rb, last_rb, (next - n + 1) * pagesize,
+                               n * pagesize);
+    } else {
+        for (i = 0; i < n; i++) {
+            postcopy_request_pages(mis, rb, last_rb,
+                                   (next + i * stride) * pagesize,
+                                   pagesize);
+        }
+    }
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
  */
@@ -504,6 +560,15 @@ static void *postcopy_ram_fault_thread(void *opaque)
     int ret;
     RAMBlock *rb = NULL;
     RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
+    PostcopyPrefetch *pf = NULL;
+
+    if (migrate_postcopy_prefetch_depth()) {
+        memset(&mis->postcopy_prefetch_stats, 0,
+               sizeof(mis->postcopy_prefetch_stats));
+        pf = postcopy_prefetch_new(migrate_postcopy_prefetch_depth(),
+                                   &mis->postcopy_prefetch_stats);
+        mis->postcopy_prefetch = true;
+    }
 
     trace_postcopy_ram_fault_thread_entry();
     qemu_sem_post(&mis->fault_thread_sem);
@@ -577,16 +642,16 @@ static void *postcopy_ram_fault_thread(void *opaque)
          * Send the request to the source - we want to request one
          * of our host page sizes (which is >= TPS)
          */
-        if (rb != last_rb) {
-            last_rb = rb;
-            migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
-                                     rb_offset, qemu_ram_pagesize(rb));
-        } else {
-            /* Save some space */
-            migrate_send_rp_req_pages(mis, NULL,
-                                     rb_offset, qemu_ram_pagesize(rb));
+        postcopy_request_pages(mis, rb, &last_rb, rb_offset,
+                               qemu_ram_pagesize(rb));
+        if (pf) {
+            postcopy_prefetch(mis, pf, rb, rb_offset, &last_rb);
         }
     }
+
+    if (pf) {
+        postcopy_prefetch_free(pf);
+    }
     trace_postcopy_ram_fault_thread_exit();
     return NULL;
 }
@@ -630,6 +695,10 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    if (postcopy_place_threads_setup(mis)) {
+        return -1;
+    }
+
     /*
      * Ballooning can mark pages as absent while we're postcopying
      * that would cause false userfaults.
@@ -692,6 +761,30 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
     return 0;
 }
 
+/*
+ * Allocate the large zero page that replaces UFFDIO_ZEROPAGE for
+ * hugepages, if it was not allocated yet
+ * returns 0 on success
+ */
+static int postcopy_alloc_tmp_zero_page(MigrationIncomingState *mis)
+{
+    if (!mis->postcopy_tmp_zero_page) {
+        mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS,
+                                           -1, 0);
+        if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
+            int e = errno;
+            mis->postcopy_tmp_zero_page = NULL;
+            error_report("%s: %s mapping large zero page",
+                         __func__, strerror(e));
+            return -e;
+        }
+        memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+    }
+    return 0;
+}
+
 /*
  * Place a zero page at (host) atomically
  * returns 0 on success
@@ -712,19 +805,10 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
         }
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
-        if (!mis->postcopy_tmp_zero_page) {
-            mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1, 0);
-            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
-                int e = errno;
-                mis->postcopy_tmp_zero_page = NULL;
-                error_report("%s: %s mapping large zero page",
-                             __func__, strerror(e));
-                return -e;
-            }
-            memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+        int ret = postcopy_alloc_tmp_zero_page(mis);
+
+        if (ret) {
+            return ret;
         }
         return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
                                    rb);
@@ -757,6 +841,366 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return mis->postcopy_tmp_page;
 }
 
+/*
+ * Page placement threads
+ *
+ * UFFDIO_COPY copies each page into guest memory and wakes up whoever
+ * waits for it, which at full line rate keeps a single incoming thread
+ * busier than reading the pages off the wire does.  With the
+ * postcopy-place-threads parameter set, each host page is read into the
+ * temporary page of an idle placement thread instead, and that thread
+ * places it while the incoming thread goes on with the next one.
+ *
+ * Host pages are placed atomically and independently of each other, so
+ * they can be placed in any order.  What must be kept is that a page is
+ * in place before its temporary page is reused, and that all the pages
+ * read by ram_load_postcopy() are in place when it returns, before the
+ * rest of the migration stream is handled: postcopy_place_wait().
+ */
+struct PostcopyPlaceParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    MigrationIncomingState *mis;
+    /* Temporary page of largest_page_size, filled by the incoming thread */
+    void *tmp_page;
+    /* Protected by mutex; host is NULL when there is nothing to place */
+    void *host;
+    RAMBlock *rb;
+    bool zero;
+    bool quit;
+    /* Protected by mis->place_done_lock; set when tmp_page is free */
+    bool done;
+};
+
+static void *postcopy_place_thread(void *opaque)
+{
+    PostcopyPlaceParam *param = opaque;
+    MigrationIncomingState *mis = param->mis;
+    void *host;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->host) {
+            host = param->host;
+            param->host = NULL;
+            qemu_mutex_unlock(&param->mutex);
+
+            if (param->zero) {
+                ret = postcopy_place_page_zero(mis, host, param->rb);
+            } else {
+                ret = postcopy_place_page(mis, host, param->tmp_page,
+                                          param->rb);
+            }
+
+            qemu_mutex_lock(&mis->place_done_lock);
+            if (ret && !mis->place_error) {
+                mis->place_error = ret;
+            }
+            param->done = true;
+            qemu_cond_signal(&mis->place_done_cond);
+            qemu_mutex_unlock(&mis->place_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void postcopy_place_threads_cleanup(MigrationIncomingState *mis)
+{
+    PostcopyPlaceParam *param;
+    int i;
+
+    if (!mis->place_param) {
+        return;
+    }
+
+    for (i = 0; i < mis->place_thread_count; i++) {
+        param = &mis->place_param[i];
+        if (!param->tmp_page) {
+            continue;
+        }
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+    }
+    for (i = 0; i < mis->place_thread_count; i++) {
+        param = &mis->place_param[i];
+        if (!param->tmp_page) {
+            continue;
+        }
+        qemu_thread_join(&param->thread);
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+        munmap(param->tmp_page, mis->largest_page_size);
+    }
+    qemu_mutex_destroy(&mis->place_done_lock);
+    qemu_cond_destroy(&mis->place_done_cond);
+    g_free(mis->place_param);
+    mis->place_param = NULL;
+    mis->place_thread_count = 0;
+}
+
+/*
+ * Start the placement threads asked for by the postcopy-place-threads
+ * parameter; the userfault fd must be open.
+ * returns 0 on success
+ */
+static int postcopy_place_threads_setup(MigrationIncomingState *mis)
+{
+    int i, ret, count = migrate_postcopy_place_threads();
+    PostcopyPlaceParam *param;
+
+    if (!count) {
+        return 0;
+    }
+
+    /*
+     * Allocated lazily otherwise, which the placement threads would race
+     * on
+     */
+    if (mis->largest_page_size != getpagesize()) {
+        ret = postcopy_alloc_tmp_zero_page(mis);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    mis->place_param = g_new0(PostcopyPlaceParam, count);
+    mis->place_thread_count = count;
+    mis->place_next = -1;
+    mis->place_error = 0;
+    qemu_mutex_init(&mis->place_done_lock);
+    qemu_cond_init(&mis->place_done_cond);
+
+    for (i = 0; i < count; i++) {
+        param = &mis->place_param[i];
+        param->tmp_page = mmap(NULL, mis->largest_page_size,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (param->tmp_page == MAP_FAILED) {
+            ret = -errno;
+            param->tmp_page = NULL;
+            error_report("%s: %s", __func__, strerror(-ret));
+            postcopy_place_threads_cleanup(mis);
+            return ret;
+        }
+        param->mis = mis;
+        param->done = true;
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, "postcopy/place",
+                           postcopy_place_thread, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+    trace_postcopy_place_threads_setup(count);
+
+    return 0;
+}
+
+/*
+ * Returns the temporary page of an idle placement thread, waiting for one
+ * to become idle if needed
+ */
+void *postcopy_place_get_tmp_page(MigrationIncomingState *mis)
+{
+    int idx;
+
+    qemu_mutex_lock(&mis->place_done_lock);
+    while (true) {
+        for (idx = 0; idx < mis->place_thread_count; idx++) {
+            if (mis->place_param[idx].done) {
+                break;
+            }
+        }
+        if (idx < mis->place_thread_count) {
+            break;
+        }
+        qemu_cond_wait(&mis->place_done_cond, &mis->place_done_lock);
+    }
+    qemu_mutex_unlock(&mis->place_done_lock);
+
+    mis->place_next = idx;
+    return mis->place_param[idx].tmp_page;
+}
+
+/*
+ * Hand the page filled in postcopy_place_get_tmp_page() to its thread, to
+ * be placed at (host), or a zero page if (zero)
+ * returns 0 on success, or the first error of a previous placement
+ */
+int postcopy_place_page_async(MigrationIncomingState *mis, void *host,
+                              bool zero, RAMBlock *rb)
+{
+    PostcopyPlaceParam *param;
+    int ret;
+
+    assert(mis->place_next >= 0);
+    param = &mis->place_param[mis->place_next];
+    mis->place_next = -1;
+
+    qemu_mutex_lock(&mis->place_done_lock);
+    ret = mis->place_error;
+    if (!ret) {
+        param->done = false;
+    }
+    qemu_mutex_unlock(&mis->place_done_lock);
+    if (ret) {
+        return ret;
+    }
+
+    qemu_mutex_lock(&param->mutex);
+    param->host = host;
+    param->rb = rb;
+    param->zero = zero;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return 0;
+}
+
+/*
+ * Wait until the placement threads have placed all the pages they were
+ * handed
+ * returns 0 on success, or the first error of a placement
+ */
+int postcopy_place_wait(MigrationIncomingState *mis)
+{
+    int idx, ret;
+
+    qemu_mutex_lock(&mis->place_done_lock);
+    for (idx = 0; idx < mis->place_thread_count; idx++) {
+        while (!mis->place_param[idx].done) {
+            qemu_cond_wait(&mis->place_done_cond, &mis->place_done_lock);
+        }
+    }
+    ret = mis->place_error;
+    qemu_mutex_unlock(&mis->place_done_lock);
+
+    return ret;
+}
+
+/*
+ * Write protection of RAM, used by background snapshots to save each page
+ * before the guest first writes to it.
+ */
+
+int ufd_wp_open(Error **errp)
+{
+    struct uffdio_api api_struct = {0};
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (ufd == -1) {
+        error_setg_errno(errp, errno, "Failed to open a userfault fd");
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        error_setg_errno(errp, errno,
+                         "Userfault on this host does not support "
+                         "write protection");
+        close(ufd);
+        return -1;
+    }
+
+    return ufd;
+}
+
+int ufd_wp_register(int ufd, void *host, uint64_t len, Error **errp)
+{
+    struct uffdio_register reg_struct;
+
+    reg_struct.range.start = (uintptr_t)host;
+    reg_struct.range.len = len;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+
+    if (ioctl(ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_setg_errno(errp, errno, "Failed to register %p/%" PRIu64
+                         " for write protection", host, len);
+        return -1;
+    }
+
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_setg(errp, "Userfault can not write protect %p/%" PRIu64,
+                   host, len);
+        ufd_wp_unregister(ufd, host, len);
+        return -1;
+    }
+
+    return 0;
+}
+
+int ufd_wp_unregister(int ufd, void *host, uint64_t len)
+{
+    struct uffdio_range range_struct;
+
+    range_struct.start = (uintptr_t)host;
+    range_struct.len = len;
+
+    if (ioctl(ufd, UFFDIO_UNREGISTER, &range_struct)) {
+        int e = errno;
+        error_report("%s: userfault unregister %p/%" PRIu64 ": %s",
+                     __func__, host, len, strerror(e));
+        return -e;
+    }
+
+    return 0;
+}
+
+int ufd_wp_protect(int ufd, void *host, uint64_t len, bool wp)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    wp_struct.range.start = (uintptr_t)host;
+    wp_struct.range.len = len;
+    /* Removing the protection also wakes up the writers */
+    wp_struct.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+
+    if (ioctl(ufd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        int e = errno;
+        error_report("%s: %s %p/%" PRIu64 ": %s", __func__,
+                     wp ? "protect" : "unprotect", host, len, strerror(e));
+        return -e;
+    }
+
+    return 0;
+}
+
+void *ufd_wp_read_fault(int ufd)
+{
+    struct uffd_msg msg;
+    ssize_t ret;
+
+    for (;;) {
+        ret = read(ufd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret < 0 && errno != EAGAIN) {
+                error_report("%s: Failed to read full userfault message: %s",
+                             __func__, strerror(errno));
+            }
+            return NULL;
+        }
+
+        if (msg.event == UFFD_EVENT_PAGEFAULT &&
+            (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            return (void *)(uintptr_t)msg.arg.pagefault.address;
+        }
+    }
+}
+
 #else
 /* No target OS support, stubs just fail */
 bool postcopy_ram_supported_by_host(MigrationIncomingState *mis)
@@ -809,6 +1253,55 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return NULL;
 }
 
+void *postcopy_place_get_tmp_page(MigrationIncomingState *mis)
+{
+    assert(0);
+    return NULL;
+}
+
+int postcopy_place_page_async(MigrationIncomingState *mis, void *host,
+                              bool zero, RAMBlock *rb)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_wait(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int ufd_wp_open(Error **errp)
+{
+    error_setg(errp, "Write protection of RAM: No OS support");
+    return -1;
+}
+
+int ufd_wp_register(int ufd, void *host, uint64_t len, Error **errp)
+{
+    assert(0);
+    return -1;
+}
+
+int ufd_wp_unregister(int ufd, void *host, uint64_t len)
+{
+    assert(0);
+    return -1;
+}
+
+int ufd_wp_protect(int ufd, void *host, uint64_t len, bool wp)
+{
+    assert(0);
+    return -1;
+}
+
+void *ufd_wp_read_fault(int ufd)
+{
+    assert(0);
+    return NULL;
+}
+
 #endif
 
 /* ------------------------------------------------------------------------- */
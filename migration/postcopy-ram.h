@@ -110,6 +110,34 @@ typedef enum {
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis);
 
+/*
+ * With postcopy-place-threads set, pages are placed by a pool of threads:
+ * postcopy_place_get_tmp_page returns the temporary page of an idle one,
+ * waiting if needed, and postcopy_place_page_async hands the filled page
+ * to it, to be placed at (host).  postcopy_place_wait waits for all the
+ * pages handed so far to be placed.
+ * postcopy_place_page_async and postcopy_place_wait return 0 on success,
+ * or the first error of a placement.
+ */
+void *postcopy_place_get_tmp_page(MigrationIncomingState *mis);
+int postcopy_place_page_async(MigrationIncomingState *mis, void *host,
+                              bool zero, RAMBlock *rb);
+int postcopy_place_wait(MigrationIncomingState *mis);
+
+/*
+ * Write protection of RAM through a userfault fd, for background
+ * snapshots.  ufd_wp_open returns a non-blocking fd, or -1 on error;
+ * ranges registered with ufd_wp_register can then be protected and
+ * unprotected with ufd_wp_protect, which wakes up the threads waiting
+ * to write when it removes the protection.  ufd_wp_read_fault returns
+ * the address of a pending write fault, or NULL if there is none.
+ */
+int ufd_wp_open(Error **errp);
+int ufd_wp_register(int ufd, void *host, uint64_t len, Error **errp);
+int ufd_wp_unregister(int ufd, void *host, uint64_t len);
+int ufd_wp_protect(int ufd, void *host, uint64_t len, bool wp);
+void *ufd_wp_read_fault(int ufd);
+
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
 PostcopyState postcopy_state_set(PostcopyState new_state);
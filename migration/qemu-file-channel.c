@@ -27,6 +27,7 @@
 #include "exec/cpu-common.h"
 #include "qemu-file.h"
 #include "io/channel-socket.h"
+#include "io/channel-file.h"
 #include "qemu/iov.h"
 
 
@@ -151,6 +152,73 @@ static QEMUFile *channel_get_output_return_path(void *opaque)
     return qemu_fopen_channel_input(ioc);
 }
 
+static ssize_t channel_pread(void *opaque, uint8_t *buf, size_t size,
+                             int64_t pos)
+{
+    QIOChannelFile *fioc = QIO_CHANNEL_FILE(opaque);
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < size) {
+        ret = pread(fioc->fd, buf + done, size - done, pos + done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            break;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+static ssize_t channel_pwrite(void *opaque, const uint8_t *buf, size_t size,
+                              int64_t pos)
+{
+    QIOChannelFile *fioc = QIO_CHANNEL_FILE(opaque);
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < size) {
+        ret = pwrite(fioc->fd, buf + done, size - done, pos + done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+static int64_t channel_seek(void *opaque, int64_t offset, int whence)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    off_t ret;
+
+    ret = qio_channel_io_seek(ioc, offset, whence, NULL);
+    if (ret == (off_t)-1) {
+        /* XXX handle Error * object */
+        return -EIO;
+    }
+    return ret;
+}
+
+/* Only regular files can be accessed at fixed positions */
+static bool channel_is_seekable(QIOChannel *ioc)
+{
+    struct stat st;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        return false;
+    }
+    return fstat(QIO_CHANNEL_FILE(ioc)->fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
 static const QEMUFileOps channel_input_ops = {
     .get_buffer = channel_get_buffer,
     .close = channel_close,
@@ -169,14 +237,42 @@ static const QEMUFileOps channel_output_ops = {
 };
 
 
+static const QEMUFileOps channel_seekable_input_ops = {
+    .get_buffer = channel_get_buffer,
+    .close = channel_close,
+    .shut_down = channel_shutdown,
+    .set_blocking = channel_set_blocking,
+    .get_return_path = channel_get_input_return_path,
+    .pread = channel_pread,
+    .seek = channel_seek,
+};
+
+
+static const QEMUFileOps channel_seekable_output_ops = {
+    .writev_buffer = channel_writev_buffer,
+    .close = channel_close,
+    .shut_down = channel_shutdown,
+    .set_blocking = channel_set_blocking,
+    .get_return_path = channel_get_output_return_path,
+    .pwrite = channel_pwrite,
+    .seek = channel_seek,
+};
+
+
 QEMUFile *qemu_fopen_channel_input(QIOChannel *ioc)
 {
     object_ref(OBJECT(ioc));
+    if (channel_is_seekable(ioc)) {
+        return qemu_fopen_ops(ioc, &channel_seekable_input_ops);
+    }
     return qemu_fopen_ops(ioc, &channel_input_ops);
 }
 
 QEMUFile *qemu_fopen_channel_output(QIOChannel *ioc)
 {
     object_ref(OBJECT(ioc));
+    if (channel_is_seekable(ioc)) {
+        return qemu_fopen_ops(ioc, &channel_seekable_output_ops);
+    }
     return qemu_fopen_ops(ioc, &channel_output_ops);
 }
@@ -22,12 +22,12 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
 #include "migration.h"
 #include "qemu-file.h"
+#include "compress.h"
 #include "trace.h"
 
 #define IO_BUF_SIZE 32768
@@ -43,6 +43,7 @@ struct QEMUFile {
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
+    int64_t bytes_at; /* written outside of the stream, at fixed places */
     int buf_index;
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
@@ -583,7 +584,105 @@ int64_t qemu_ftell_fast(QEMUFile *f)
 int64_t qemu_ftell(QEMUFile *f)
 {
     qemu_fflush(f);
-    return f->pos;
+    return f->pos + f->bytes_at;
+}
+
+/*
+ * Seekable files can also be accessed at fixed positions, which
+ * mapped-ram migration uses to keep one copy of each page in the file.
+ */
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    return f->ops->seek;
+}
+
+/*
+ * Write @size bytes from @buf at position @pos of the file, outside of the
+ * stream; errors are reported through qemu_file_get_error().
+ */
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        int64_t pos)
+{
+    ssize_t ret;
+
+    if (f->last_error) {
+        return;
+    }
+
+    ret = f->ops->pwrite(f->opaque, buf, size, pos);
+    if (ret != size) {
+        qemu_file_set_error(f, ret < 0 ? ret : -EIO);
+        return;
+    }
+    f->bytes_xfer += size;
+    f->bytes_at += size;
+}
+
+/*
+ * Read @size bytes into @buf from position @pos of the file, outside of
+ * the stream.  Unlike the stream functions this may be called from any
+ * thread, so errors are only returned.
+ *
+ * Returns the number of bytes read, or a negative errno value.
+ */
+ssize_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                           int64_t pos)
+{
+    return f->ops->pread(f->opaque, buf, size, pos);
+}
+
+/*
+ * Returns the position of the stream in the file, unlike qemu_ftell()
+ * which counts the bytes transferred, or -err on error
+ */
+int64_t qemu_get_offset(QEMUFile *f)
+{
+    int64_t ret;
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    }
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = f->ops->seek(f->opaque, 0, SEEK_CUR);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    /* What was read ahead is not consumed yet */
+    return ret - f->buf_size + f->buf_index;
+}
+
+/*
+ * Move the stream to position @pos of the file, flushing what was written
+ * so far or dropping what was read ahead.
+ *
+ * Returns 0 on success, -err on error
+ */
+int qemu_set_offset(QEMUFile *f, int64_t pos)
+{
+    int64_t ret;
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = f->ops->seek(f->opaque, pos, SEEK_SET);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    return 0;
 }
 
 int qemu_file_rate_limit(QEMUFile *f)
@@ -612,6 +711,15 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/*
+ * Account for data that was sent on behalf of this file through some
+ * other channel (e.g. multifd), so that rate limiting covers it too.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -658,8 +766,8 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* Compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
+/* Compress size bytes of data start at p with the compression context c
+ * and store the compressed data to the buffer of f.
  *
  * When f is not writable, return -1 if f has no space to save the
  * compressed data.
@@ -668,25 +776,29 @@ uint64_t qemu_get_be64(QEMUFile *f)
  * data, return -1.
  */
 
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
+ssize_t qemu_put_compression_data(QEMUFile *f, MigrationCompress *c,
+                                  const uint8_t *p, size_t size)
 {
     ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
+    size_t bound = migration_compress_bound(migration_compress_get_method(c),
+                                            size);
 
-    if (blen < compressBound(size)) {
+    if (blen < bound) {
         if (!qemu_file_is_writable(f)) {
             return -1;
         }
         qemu_fflush(f);
         blen = IO_BUF_SIZE - sizeof(int32_t);
-        if (blen < compressBound(size)) {
+        if (blen < bound) {
             return -1;
         }
     }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
+    blen = migration_compress_buffer(c, p, size,
+                                     f->buf + f->buf_index + sizeof(int32_t),
+                                     blen);
+    if (blen < 0) {
         error_report("Compress Failed!");
-        return 0;
+        return -1;
     }
     qemu_put_be32(f, blen);
     if (f->ops->writev_buffer) {
@@ -27,13 +27,14 @@
  */
 #include "qemu/osdep.h"
 #include "cpu.h"
-#include <zlib.h>
 #include "qapi-event.h"
+#include "qmp-commands.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
 #include "xbzrle.h"
+#include "compress.h"
 #include "ram.h"
 #include "migration.h"
 #include "migration/register.h"
@@ -42,6 +43,7 @@
 #include "postcopy-ram.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
@@ -49,6 +51,11 @@
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
 #include "migration/block.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/balloon.h"
+#include "qemu/uuid.h"
+#include "socket.h"
+#include "io/channel-file.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -119,7 +126,6 @@ static void XBZRLE_cache_unlock(void)
  */
 int xbzrle_cache_resize(int64_t new_size, Error **errp)
 {
-    PageCache *new_cache;
     int64_t ret = 0;
 
     /* Check for truncation */
@@ -137,20 +143,24 @@ int xbzrle_cache_resize(int64_t new_size, Error **errp)
     XBZRLE_cache_lock();
 
     if (XBZRLE.cache != NULL) {
-        new_cache = cache_init(new_size, TARGET_PAGE_SIZE, errp);
-        if (!new_cache) {
-            ret = -1;
+        if (migrate_xbzrle_cache_autosize() &&
+            cache_get_size(XBZRLE.cache) <= new_size) {
+            /* new_size is only an upper bound, let autosizing grow it */
             goto out;
         }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        ret = cache_resize(XBZRLE.cache, new_size, errp);
+        if (!ret) {
+            xbzrle_counters.cache_size = new_size;
+        }
     }
 out:
     XBZRLE_cache_unlock();
     return ret;
 }
 
+/* Smallest size the XBZRLE cache shrinks to when it sizes itself */
+#define XBZRLE_CACHE_MIN_AUTOSIZE (1 << 20)
+
 static void ramblock_recv_map_init(void)
 {
     RAMBlock *rb;
@@ -215,8 +225,14 @@ struct RAMState {
     uint64_t bytes_xfer_prev;
     /* number of dirty pages since start_time */
     uint64_t num_dirty_pages_period;
+    /* smoothed bytes per second the guest would dirty without throttling */
+    uint64_t dirty_bytes_rate_unthrottled;
     /* xbzrle misses since the beginning of the period */
     uint64_t xbzrle_cache_miss_prev;
+    /* xbzrle hits since the beginning of the period */
+    uint64_t xbzrle_cache_hit_prev;
+    /* average number of pages dirtied per period, for cache autosizing */
+    uint64_t xbzrle_working_set;
     /* number of iterations at the beginning of period */
     uint64_t iterations_prev;
     /* Iterations since start */
@@ -230,6 +246,8 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests;
+    /* userfault fd write protecting RAM for a background snapshot, or -1 */
+    int wp_fd;
 };
 typedef struct RAMState RAMState;
 
@@ -257,6 +275,8 @@ struct CompressParam {
     bool done;
     bool quit;
     QEMUFile *file;
+    /* compression stream owned by this thread, kept across pages */
+    MigrationCompress *comp;
     QemuMutex mutex;
     QemuCond cond;
     RAMBlock *block;
@@ -267,8 +287,10 @@ typedef struct CompressParam CompressParam;
 struct DecompressParam {
     bool done;
     bool quit;
+    bool failed;
     QemuMutex mutex;
     QemuCond cond;
+    MigrationCompress *comp;
     void *des;
     uint8_t *compbuf;
     int len;
@@ -283,6 +305,8 @@ static QemuThread *compress_threads;
  */
 static QemuMutex comp_done_lock;
 static QemuCond comp_done_cond;
+/* Used by the migration thread itself for the first page of a block */
+static MigrationCompress *comp_main;
 /* The empty QEMUFileOps will be used by file in CompressParam */
 static const QEMUFileOps empty_ops = { };
 
@@ -290,13 +314,16 @@ static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
+/* Decompression contexts, indexed by stream id (or thread for zlib) */
+static MigrationCompress *decomp_stream[MIGRATION_COMPRESS_MAX_STREAMS];
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+static int do_compress_ram_page(QEMUFile *f, MigrationCompress *c, int stream,
+                                RAMBlock *block, ram_addr_t offset);
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
+    int stream = param - comp_param;
     RAMBlock *block;
     ram_addr_t offset;
 
@@ -308,7 +335,8 @@ static void *do_data_compress(void *opaque)
             param->block = NULL;
             qemu_mutex_unlock(&param->mutex);
 
-            do_compress_ram_page(param->file, block, offset);
+            do_compress_ram_page(param->file, param->comp, stream,
+                                 block, offset);
 
             qemu_mutex_lock(&comp_done_lock);
             param->done = true;
@@ -343,7 +371,7 @@ static void compress_threads_save_cleanup(void)
 {
     int i, thread_count;
 
-    if (!migrate_use_compression()) {
+    if (!migrate_use_compression() || !comp_param) {
         return;
     }
     terminate_compression_threads();
@@ -351,27 +379,53 @@ static void compress_threads_save_cleanup(void)
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
         qemu_fclose(comp_param[i].file);
+        migration_compress_free(comp_param[i].comp);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
     }
     qemu_mutex_destroy(&comp_done_lock);
     qemu_cond_destroy(&comp_done_cond);
+    migration_compress_free(comp_main);
     g_free(compress_threads);
     g_free(comp_param);
     compress_threads = NULL;
     comp_param = NULL;
+    comp_main = NULL;
 }
 
-static void compress_threads_save_setup(void)
+static int compress_threads_save_setup(Error **errp)
 {
+    MigrationCompressMethod method = migrate_compress_method();
+    int level = migrate_compress_level();
     int i, thread_count;
 
     if (!migrate_use_compression()) {
-        return;
+        return 0;
     }
     thread_count = migrate_compress_threads();
-    compress_threads = g_new0(QemuThread, thread_count);
+
+    /* Create all the streams first, so that failing needs no thread cleanup */
+    comp_main = migration_compress_new(method, level, false, errp);
+    if (!comp_main) {
+        return -1;
+    }
     comp_param = g_new0(CompressParam, thread_count);
+    for (i = 0; i < thread_count; i++) {
+        comp_param[i].comp = migration_compress_new(method, level, false,
+                                                    errp);
+        if (!comp_param[i].comp) {
+            while (i-- > 0) {
+                migration_compress_free(comp_param[i].comp);
+            }
+            g_free(comp_param);
+            comp_param = NULL;
+            migration_compress_free(comp_main);
+            comp_main = NULL;
+            return -1;
+        }
+    }
+
+    compress_threads = g_new0(QemuThread, thread_count);
     qemu_cond_init(&comp_done_cond);
     qemu_mutex_init(&comp_done_lock);
     for (i = 0; i < thread_count; i++) {
@@ -387,35 +441,482 @@ static void compress_threads_save_setup(void)
                            do_data_compress, comp_param + i,
                            QEMU_THREAD_JOINABLE);
     }
+    return 0;
+}
+
+/* Zero page scanner threads */
+
+/* Pages handed out to a scanner thread at a time */
+#define ZERO_SCAN_CHUNK 256
+/* Chunks each scanner thread may work ahead of the migration thread */
+#define ZERO_SCAN_AHEAD 4
+
+/*
+ * The scanner threads check the dirty pages just ahead of the migration
+ * thread and record in each RAMBlock's zscanmap and zeromap which ones
+ * are zero, so that save_zero_page() does not have to read them.
+ *
+ * A result only stays valid until the next dirty bitmap sync: a page
+ * written after it was checked is still dirty in the KVM log and will be
+ * sent again after the sync, but once the sync has folded that write
+ * into the migration bitmap nothing would tell us to read it again.
+ * migration_bitmap_sync() therefore stops the scanners and clears the
+ * bitmaps.
+ *
+ * The scanners only run while the migration thread holds the RCU read
+ * lock in ram_save_iterate() or ram_save_complete(), which keeps the
+ * RAMBlocks alive; both stop the scanners before dropping it.
+ *
+ * The lookahead window is confined to the block the migration thread is
+ * in, which is enough as guest RAM mostly lives in one large block.
+ */
+static struct {
+    int thread_count;
+    QemuThread *threads;
+    /* protects everything below */
+    QemuMutex lock;
+    /* signalled when there is more to scan, or on quit */
+    QemuCond cond;
+    /* signalled when the last busy scanner is done with its chunk */
+    QemuCond idle_cond;
+    /* pages [next, end) of block remain to be scanned */
+    RAMBlock *block;
+    unsigned long next;
+    unsigned long end;
+    /* number of scanners working on a chunk */
+    int busy;
+    bool quit;
+    /* written by the migration thread only: scanners ran since the sync */
+    bool dirty;
+} zero_scan;
+
+static void zero_scan_range(RAMBlock *block, unsigned long start,
+                            unsigned long end)
+{
+    unsigned long page;
+
+    for (page = find_next_bit(block->bmap, end, start); page < end;
+         page = find_next_bit(block->bmap, end, page + 1)) {
+        if (test_bit(page, block->zscanmap)) {
+            continue;
+        }
+        if (is_zero_range(block->host + (page << TARGET_PAGE_BITS),
+                          TARGET_PAGE_SIZE)) {
+            set_bit_atomic(page, block->zeromap);
+        }
+        /* pairs with smp_rmb() in save_zero_page() */
+        smp_wmb();
+        set_bit_atomic(page, block->zscanmap);
+    }
+}
+
+static void *zero_scan_thread(void *opaque)
+{
+    RAMBlock *block;
+    unsigned long start, end;
+
+    qemu_mutex_lock(&zero_scan.lock);
+    while (!zero_scan.quit) {
+        if (!zero_scan.block || zero_scan.next >= zero_scan.end) {
+            qemu_cond_wait(&zero_scan.cond, &zero_scan.lock);
+            continue;
+        }
+        block = zero_scan.block;
+        start = zero_scan.next;
+        end = MIN(start + ZERO_SCAN_CHUNK, zero_scan.end);
+        zero_scan.next = end;
+        zero_scan.busy++;
+        qemu_mutex_unlock(&zero_scan.lock);
+
+        zero_scan_range(block, start, end);
+
+        qemu_mutex_lock(&zero_scan.lock);
+        if (!--zero_scan.busy) {
+            qemu_cond_broadcast(&zero_scan.idle_cond);
+        }
+    }
+    qemu_mutex_unlock(&zero_scan.lock);
+
+    return NULL;
+}
+
+/**
+ * zero_scan_advance: let the scanner threads work ahead of @pss
+ *
+ * Called by the migration thread before it sends the page at @pss.
+ *
+ * @pss: page the migration thread is about to send
+ */
+static void zero_scan_advance(PageSearchStatus *pss)
+{
+    unsigned long pages, end;
+
+    if (!zero_scan.thread_count) {
+        return;
+    }
+
+    pages = pss->block->used_length >> TARGET_PAGE_BITS;
+    end = MIN(pss->page + zero_scan.thread_count * ZERO_SCAN_CHUNK *
+              ZERO_SCAN_AHEAD, pages);
+    /* Only bother the scanners once there is a chunk more to do */
+    if (pss->block == zero_scan.block &&
+        end < zero_scan.end + ZERO_SCAN_CHUNK) {
+        return;
+    }
+
+    qemu_mutex_lock(&zero_scan.lock);
+    if (pss->block != zero_scan.block || zero_scan.next < pss->page) {
+        /* Skip what the migration thread has already gone past */
+        zero_scan.block = pss->block;
+        zero_scan.next = pss->page;
+    }
+    zero_scan.end = end;
+    zero_scan.dirty = true;
+    qemu_cond_broadcast(&zero_scan.cond);
+    qemu_mutex_unlock(&zero_scan.lock);
+}
+
+/**
+ * zero_scan_pause: stop handing out pages and wait for the scanners
+ *
+ * The results already recorded stay valid.
+ */
+static void zero_scan_pause(void)
+{
+    if (!zero_scan.thread_count) {
+        return;
+    }
+
+    qemu_mutex_lock(&zero_scan.lock);
+    zero_scan.block = NULL;
+    while (zero_scan.busy) {
+        qemu_cond_wait(&zero_scan.idle_cond, &zero_scan.lock);
+    }
+    qemu_mutex_unlock(&zero_scan.lock);
+}
+
+/**
+ * zero_scan_invalidate: forget the results of the scanners
+ *
+ * Called within an RCU critical section, before the dirty bitmap sync.
+ */
+static void zero_scan_invalidate(void)
+{
+    RAMBlock *block;
+    unsigned long pages;
+
+    if (!zero_scan.thread_count || !zero_scan.dirty) {
+        return;
+    }
+
+    zero_scan_pause();
+    RAMBLOCK_FOREACH(block) {
+        pages = block->used_length >> TARGET_PAGE_BITS;
+        bitmap_zero(block->zscanmap, pages);
+        bitmap_zero(block->zeromap, pages);
+    }
+    zero_scan.dirty = false;
+}
+
+static void zero_scan_save_cleanup(void)
+{
+    int i;
+
+    if (!zero_scan.threads) {
+        return;
+    }
+
+    qemu_mutex_lock(&zero_scan.lock);
+    zero_scan.quit = true;
+    qemu_cond_broadcast(&zero_scan.cond);
+    qemu_mutex_unlock(&zero_scan.lock);
+
+    for (i = 0; i < zero_scan.thread_count; i++) {
+        qemu_thread_join(zero_scan.threads + i);
+    }
+    qemu_cond_destroy(&zero_scan.idle_cond);
+    qemu_cond_destroy(&zero_scan.cond);
+    qemu_mutex_destroy(&zero_scan.lock);
+    g_free(zero_scan.threads);
+    memset(&zero_scan, 0, sizeof(zero_scan));
+}
+
+static void zero_scan_save_setup(void)
+{
+    int i, thread_count = migrate_zero_page_threads();
+
+    /* Already running when COLO sets up again, as for the bitmaps */
+    if (!thread_count || !ram_bytes_total() || zero_scan.threads) {
+        return;
+    }
+
+    qemu_mutex_init(&zero_scan.lock);
+    qemu_cond_init(&zero_scan.cond);
+    qemu_cond_init(&zero_scan.idle_cond);
+    zero_scan.threads = g_new0(QemuThread, thread_count);
+    for (i = 0; i < thread_count; i++) {
+        qemu_thread_create(zero_scan.threads + i, "zeroscan",
+                           zero_scan_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+    zero_scan.thread_count = thread_count;
 }
 
 /* Multiple fd's */
 
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    unsigned char uuid[16]; /* QemuUUID */
+    uint8_t id;
+} QEMU_PACKED MultiFDInit_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    /* maximum number of pages a packet can carry */
+    uint32_t size;
+    /* number of pages carried by this packet */
+    uint32_t used;
+    uint64_t packet_num;
+    char ramblock[256];
+    uint64_t offset[];
+} QEMU_PACKED MultiFDPacket_t;
+
+typedef struct {
+    /* number of used pages */
+    uint32_t used;
+    /* number of allocated pages */
+    uint32_t allocated;
+    /* offset of each page inside the block */
+    ram_addr_t *offset;
+    /* pointer to each page */
+    struct iovec *iov;
+    RAMBlock *block;
+} MultiFDPages_t;
+
 struct MultiFDSendParams {
+    /* these fields are not changed once the thread is created */
     uint8_t id;
     char *name;
     QemuThread thread;
     QemuSemaphore sem;
+    /* protects the fields below */
     QemuMutex mutex;
+    QIOChannel *c;
+    /* the thread has been created */
+    bool running;
+    /* we should quit the thread */
     bool quit;
+    /* number of jobs queued for the thread */
+    int pending_job;
+    /* pages to send, owned by the thread while pending_job != 0 */
+    MultiFDPages_t *pages;
+    uint32_t packet_len;
+    MultiFDPacket_t *packet;
+    uint32_t flags;
+    uint64_t packet_num;
+    /* channel statistics, reported by query-migrate */
+    MultiFDChannelStats *stats;
 };
 typedef struct MultiFDSendParams MultiFDSendParams;
 
 struct {
     MultiFDSendParams *params;
-    /* number of created threads */
-    int count;
+    /* pages being filled by the migration thread */
+    MultiFDPages_t *pages;
+    /* posted by a channel each time it can take a new job */
+    QemuSemaphore channels_ready;
+    /* posted by a channel once it has sent a sync packet */
+    QemuSemaphore sem_sync;
+    /* global number of generated multifd packets */
+    uint64_t packet_num;
+    /* next channel to try when sending pages */
+    int next_channel;
 } *multifd_send_state;
 
-static void terminate_multifd_send_threads(Error *errp)
+/*
+ * Per channel statistics of the last outgoing multifd migration.  They
+ * outlive multifd_send_state so that query-migrate can still report
+ * them once the migration has completed.
+ */
+static struct {
+    MultiFDChannelStats *stats;
+    int count;
+} multifd_send_stats;
+
+static MultiFDPages_t *multifd_pages_init(size_t size)
+{
+    MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
+
+    pages->allocated = size;
+    pages->iov = g_new0(struct iovec, size);
+    pages->offset = g_new0(ram_addr_t, size);
+
+    return pages;
+}
+
+static void multifd_pages_clear(MultiFDPages_t *pages)
+{
+    pages->used = 0;
+    pages->allocated = 0;
+    pages->block = NULL;
+    g_free(pages->iov);
+    pages->iov = NULL;
+    g_free(pages->offset);
+    pages->offset = NULL;
+    g_free(pages);
+}
+
+/*
+ * Large packets can carry more pages than the kernel accepts in a
+ * single readv/writev; split them in IOV_MAX sized chunks.
+ */
+static int multifd_writev_all(QIOChannel *c, struct iovec *iov, size_t niov,
+                              Error **errp)
+{
+    size_t done;
+
+    for (done = 0; done < niov; done += IOV_MAX) {
+        if (qio_channel_writev_all(c, iov + done, MIN(niov - done, IOV_MAX),
+                                   errp) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int multifd_readv_all(QIOChannel *c, struct iovec *iov, size_t niov,
+                             Error **errp)
+{
+    size_t done;
+
+    for (done = 0; done < niov; done += IOV_MAX) {
+        if (qio_channel_readv_all(c, iov + done, MIN(niov - done, IOV_MAX),
+                                  errp) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDInit_t msg;
+    int ret;
+
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.id = p->id;
+    memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
+
+    ret = qio_channel_write_all(p->c, (char *)&msg, sizeof(msg), errp);
+    if (ret != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
 {
+    MultiFDInit_t msg;
+    int ret;
+
+    ret = qio_channel_read_all(c, (char *)&msg, sizeof(msg), errp);
+    if (ret != 0) {
+        return -1;
+    }
+
+    be32_to_cpus(&msg.magic);
+    be32_to_cpus(&msg.version);
+
+    if (msg.magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "expected %x", msg.magic, MULTIFD_MAGIC);
+        return -1;
+    }
+
+    if (msg.version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d "
+                   "expected %d", msg.version, MULTIFD_VERSION);
+        return -1;
+    }
+
+    if (memcmp(msg.uuid, &qemu_uuid, sizeof(qemu_uuid))) {
+        char *uuid = qemu_uuid_unparse_strdup(&qemu_uuid);
+        QemuUUID *msg_uuid = (QemuUUID *)msg.uuid;
+        char *msg_uuid_str = qemu_uuid_unparse_strdup(msg_uuid);
+
+        error_setg(errp, "multifd: received uuid '%s' and expected "
+                   "uuid '%s' for channel %hhd", msg_uuid_str, uuid, msg.id);
+        g_free(uuid);
+        g_free(msg_uuid_str);
+        return -1;
+    }
+
+    if (msg.id >= migrate_multifd_channels()) {
+        error_setg(errp, "multifd: received channel id %d but only %d "
+                   "channels are expected", msg.id,
+                   migrate_multifd_channels());
+        return -1;
+    }
+
+    return msg.id;
+}
+
+/* Called with p->mutex held */
+static void multifd_send_fill_packet(MultiFDSendParams *p)
+{
+    MultiFDPacket_t *packet = p->packet;
     int i;
 
-    for (i = 0; i < multifd_send_state->count; i++) {
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(p->flags);
+    packet->size = cpu_to_be32(migrate_multifd_page_count());
+    packet->used = cpu_to_be32(p->pages->used);
+    packet->packet_num = cpu_to_be64(p->packet_num);
+
+    memset(packet->ramblock, 0, sizeof(packet->ramblock));
+    if (p->pages->block) {
+        strncpy(packet->ramblock, p->pages->block->idstr, 256);
+    }
+
+    for (i = 0; i < p->pages->used; i++) {
+        packet->offset[i] = cpu_to_be64(p->pages->offset[i]);
+    }
+}
+
+static void multifd_send_terminate_threads(Error *err)
+{
+    int i;
+
+    if (err) {
+        MigrationState *s = migrate_get_current();
+        migrate_set_error(s, err);
+        if (s->state == MIGRATION_STATUS_SETUP ||
+            s->state == MIGRATION_STATUS_PRE_SWITCHOVER ||
+            s->state == MIGRATION_STATUS_DEVICE ||
+            s->state == MIGRATION_STATUS_ACTIVE) {
+            migrate_set_state(&s->state, s->state,
+                              MIGRATION_STATUS_FAILED);
+        }
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
         qemu_mutex_lock(&p->mutex);
         p->quit = true;
+        /* Unblock channels stuck writing to a broken connection */
+        if (err && p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
         qemu_sem_post(&p->sem);
         qemu_mutex_unlock(&p->mutex);
     }
@@ -429,43 +930,302 @@ int multifd_save_cleanup(Error **errp)
     if (!migrate_use_multifd()) {
         return 0;
     }
-    terminate_multifd_send_threads(NULL);
-    for (i = 0; i < multifd_send_state->count; i++) {
+    multifd_send_terminate_threads(NULL);
+    for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
-        qemu_thread_join(&p->thread);
+        if (p->running) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->c) {
+            socket_send_channel_destroy(p->c);
+            p->c = NULL;
+        }
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
         g_free(p->name);
         p->name = NULL;
+        multifd_pages_clear(p->pages);
+        p->pages = NULL;
+        p->packet_len = 0;
+        g_free(p->packet);
+        p->packet = NULL;
     }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_sem_destroy(&multifd_send_state->sem_sync);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
+    multifd_pages_clear(multifd_send_state->pages);
+    multifd_send_state->pages = NULL;
     g_free(multifd_send_state);
     multifd_send_state = NULL;
     return ret;
 }
 
-static void *multifd_send_thread(void *opaque)
+/**
+ * multifd_send_pages: hand the queued pages to an idle channel
+ *
+ * Returns 1 on success or negative on error
+ *
+ * The pages array of multifd_send_state is swapped with the (empty)
+ * one of the channel, so no page data is ever copied: the channel
+ * writes the guest pages straight from guest memory.
+ *
+ * @rs: current RAM state
+ */
+static int multifd_send_pages(RAMState *rs)
 {
-    MultiFDSendParams *p = opaque;
+    int i;
+    MultiFDSendParams *p = NULL; /* make happy gcc */
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    uint64_t transferred;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    for (i = multifd_send_state->next_channel;;
+         i = (i + 1) % migrate_multifd_channels()) {
+        p = &multifd_send_state->params[i];
 
-    while (true) {
         qemu_mutex_lock(&p->mutex);
         if (p->quit) {
+            error_report("%s: channel %d has already quit!", __func__, i);
             qemu_mutex_unlock(&p->mutex);
+            return -1;
+        }
+        if (!p->pending_job) {
+            p->pending_job++;
+            multifd_send_state->next_channel =
+                (i + 1) % migrate_multifd_channels();
             break;
         }
         qemu_mutex_unlock(&p->mutex);
+    }
+    p->packet_num = multifd_send_state->packet_num++;
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    transferred = (uint64_t)pages->used * TARGET_PAGE_SIZE + p->packet_len;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    ram_counters.transferred += transferred;
+    qemu_file_update_transfer(rs->f, transferred);
+    qemu_update_position(rs->f, transferred);
+
+    return 1;
+}
+
+/**
+ * multifd_queue_page: queue a page to be sent over the multifd channels
+ *
+ * Returns 1 on success or negative on error
+ *
+ * Pages are batched per RAMBlock; the batch is handed to a channel when
+ * it is full or when a page of another RAMBlock is queued.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int multifd_queue_page(RAMState *rs, RAMBlock *block,
+                              ram_addr_t offset)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    if (!pages->block) {
+        pages->block = block;
+    }
+
+    if (pages->block == block) {
+        pages->offset[pages->used] = offset;
+        pages->iov[pages->used].iov_base = block->host + offset;
+        pages->iov[pages->used].iov_len = TARGET_PAGE_SIZE;
+        pages->used++;
+
+        if (pages->used < pages->allocated) {
+            return 1;
+        }
+        return multifd_send_pages(rs);
+    }
+
+    /* Flush the pages of the previous block first */
+    if (multifd_send_pages(rs) < 0) {
+        return -1;
+    }
+    return multifd_queue_page(rs, block, offset);
+}
+
+/**
+ * multifd_send_sync_main: flush the queued pages and sync all channels
+ *
+ * Returns 0 on success or negative on error
+ *
+ * Every channel sends a packet with MULTIFD_FLAG_SYNC; once this
+ * returns all pages queued so far have been written to the channels.
+ * The destination waits for the sync packets of all the channels when
+ * it sees RAM_SAVE_FLAG_EOS on the main stream, so a page can never be
+ * overwritten with stale contents arriving late on another channel.
+ *
+ * Pages are only sent over multifd during precopy, so once in postcopy
+ * there is nothing to synchronize.
+ *
+ * @rs: current RAM state
+ */
+static int multifd_send_sync_main(RAMState *rs)
+{
+    int i;
+
+    if (!migrate_use_multifd() || migration_in_postcopy()) {
+        return 0;
+    }
+    if (multifd_send_state->pages->used) {
+        if (multifd_send_pages(rs) < 0) {
+            error_report("%s: multifd_send_pages fail", __func__);
+            return -1;
+        }
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        trace_multifd_send_sync_main_signal(p->id);
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            error_report("%s: channel %d has already quit", __func__, i);
+            qemu_mutex_unlock(&p->mutex);
+            return -1;
+        }
+        p->packet_num = multifd_send_state->packet_num++;
+        p->flags |= MULTIFD_FLAG_SYNC;
+        p->pending_job++;
+        ram_counters.transferred += p->packet_len;
+        qemu_file_update_transfer(rs->f, p->packet_len);
+        qemu_update_position(rs->f, p->packet_len);
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        trace_multifd_send_sync_main_wait(p->id);
+        qemu_sem_wait(&multifd_send_state->sem_sync);
+    }
+    trace_multifd_send_sync_main(multifd_send_state->packet_num);
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        bool quit;
+
+        qemu_mutex_lock(&p->mutex);
+        quit = p->quit;
+        qemu_mutex_unlock(&p->mutex);
+        if (quit) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+    QIOChannel *c;
+    int ret;
+
+    trace_multifd_send_thread_start(p->id);
+    rcu_register_thread();
+
+    c = socket_send_channel_create_sync(&local_err);
+    if (!c) {
+        goto out;
+    }
+    qemu_mutex_lock(&p->mutex);
+    p->c = c;
+    qemu_mutex_unlock(&p->mutex);
+
+    if (multifd_send_initial_packet(p, &local_err) < 0) {
+        goto out;
+    }
+    p->stats->packets++;
+    p->stats->bytes += sizeof(MultiFDInit_t);
+
+    /* One for the initial job slot of this channel */
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
         qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+
+        if (p->pending_job) {
+            uint32_t used = p->pages->used;
+            uint64_t packet_num = p->packet_num;
+            uint32_t flags = p->flags;
+
+            multifd_send_fill_packet(p);
+            p->flags = 0;
+            p->stats->packets++;
+            p->stats->pages += used;
+            p->stats->bytes += p->packet_len +
+                               (uint64_t)used * TARGET_PAGE_SIZE;
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            qemu_mutex_unlock(&p->mutex);
+
+            trace_multifd_send(p->id, packet_num, used, flags);
+
+            ret = qio_channel_write_all(p->c, (void *)p->packet,
+                                        p->packet_len, &local_err);
+            if (ret != 0) {
+                break;
+            }
+
+            if (used) {
+                ret = multifd_writev_all(p->c, p->pages->iov, used,
+                                         &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->pending_job--;
+            qemu_mutex_unlock(&p->mutex);
+
+            if (flags & MULTIFD_FLAG_SYNC) {
+                qemu_sem_post(&multifd_send_state->sem_sync);
+            }
+            /* Sync only jobs never waited for channels_ready */
+            if (used) {
+                qemu_sem_post(&multifd_send_state->channels_ready);
+            }
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+            /* sometimes there are spurious wakeups */
+        }
+    }
+
+out:
+    if (local_err) {
+        multifd_send_terminate_threads(local_err);
+        error_free(local_err);
+        /* Don't leave the migration thread waiting on us */
+        qemu_sem_post(&multifd_send_state->sem_sync);
+        qemu_sem_post(&multifd_send_state->channels_ready);
     }
 
+    rcu_unregister_thread();
+    trace_multifd_send_thread_end(p->id, p->stats->packets, p->stats->pages);
+
     return NULL;
 }
 
 int multifd_save_setup(void)
 {
     int thread_count;
+    uint32_t page_count = migrate_multifd_page_count();
     uint8_t i;
 
     if (!migrate_use_multifd()) {
@@ -474,30 +1234,79 @@ int multifd_save_setup(void)
     thread_count = migrate_multifd_channels();
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
-    multifd_send_state->count = 0;
+    multifd_send_state->pages = multifd_pages_init(page_count);
+    qemu_sem_init(&multifd_send_state->sem_sync, 0);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+
+    g_free(multifd_send_stats.stats);
+    multifd_send_stats.stats = g_new0(MultiFDChannelStats, thread_count);
+    multifd_send_stats.count = thread_count;
+
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
         qemu_mutex_init(&p->mutex);
         qemu_sem_init(&p->sem, 0);
         p->quit = false;
+        p->pending_job = 0;
         p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->packet_len = sizeof(MultiFDPacket_t)
+                      + sizeof(uint64_t) * page_count;
+        p->packet = g_malloc0(p->packet_len);
+        p->stats = &multifd_send_stats.stats[i];
+        p->stats->id = i;
         p->name = g_strdup_printf("multifdsend_%d", i);
+        p->running = true;
         qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
                            QEMU_THREAD_JOINABLE);
-
-        multifd_send_state->count++;
     }
     return 0;
 }
 
+/**
+ * multifd_query_stats: per channel statistics of the outgoing migration
+ *
+ * Returns a newly allocated list, or NULL if multifd was not used
+ */
+MultiFDChannelStatsList *multifd_query_stats(void)
+{
+    MultiFDChannelStatsList *head = NULL;
+    int i;
+
+    for (i = multifd_send_stats.count - 1; i >= 0; i--) {
+        MultiFDChannelStatsList *entry = g_new0(MultiFDChannelStatsList, 1);
+
+        entry->value = g_memdup(&multifd_send_stats.stats[i],
+                                sizeof(MultiFDChannelStats));
+        entry->next = head;
+        head = entry;
+    }
+    return head;
+}
+
 struct MultiFDRecvParams {
+    /* these fields are not changed once the thread is created */
     uint8_t id;
     char *name;
     QemuThread thread;
-    QemuSemaphore sem;
+    QIOChannel *c;
+    /* posted by the main thread once all channels are synchronized */
+    QemuSemaphore sem_sync;
+    /* protects the fields below */
     QemuMutex mutex;
+    /* the thread has been created */
+    bool running;
+    /* the thread has exited */
     bool quit;
+    /* pages being received */
+    MultiFDPages_t *pages;
+    uint32_t packet_len;
+    MultiFDPacket_t *packet;
+    uint32_t flags;
+    uint64_t packet_num;
+    uint64_t num_packets;
+    uint64_t num_pages;
 };
 typedef struct MultiFDRecvParams MultiFDRecvParams;
 
@@ -505,19 +1314,116 @@ struct {
     MultiFDRecvParams *params;
     /* number of created threads */
     int count;
+    /* posted by a channel once it has received a sync packet */
+    QemuSemaphore sem_sync;
+    /* global number of received multifd packets */
+    uint64_t packet_num;
 } *multifd_recv_state;
 
-static void terminate_multifd_recv_threads(Error *errp)
+/**
+ * multifd_recv_unfill_packet: validate a received packet header
+ *
+ * Returns 0 on success or negative on error
+ *
+ * On success p->pages describes where in guest RAM the pages that
+ * follow the header have to be read to.
+ *
+ * @p: receiving channel
+ * @errp: set *errp on error
+ */
+static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
 {
+    MultiFDPacket_t *packet = p->packet;
+    RAMBlock *block;
     int i;
 
-    for (i = 0; i < multifd_recv_state->count; i++) {
+    be32_to_cpus(&packet->magic);
+    if (packet->magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet "
+                   "magic %x and expected magic %x",
+                   packet->magic, MULTIFD_MAGIC);
+        return -1;
+    }
+
+    be32_to_cpus(&packet->version);
+    if (packet->version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet "
+                   "version %d and expected version %d",
+                   packet->version, MULTIFD_VERSION);
+        return -1;
+    }
+
+    p->flags = be32_to_cpu(packet->flags);
+
+    be32_to_cpus(&packet->size);
+    if (packet->size != migrate_multifd_page_count()) {
+        error_setg(errp, "multifd: received packet "
+                   "with size %d and expected size %d",
+                   packet->size, migrate_multifd_page_count());
+        return -1;
+    }
+
+    p->pages->used = be32_to_cpu(packet->used);
+    if (p->pages->used > packet->size) {
+        error_setg(errp, "multifd: received packet "
+                   "with %d pages and expected maximum pages are %d",
+                   p->pages->used, packet->size);
+        return -1;
+    }
+
+    p->packet_num = be64_to_cpu(packet->packet_num);
+
+    if (p->pages->used == 0) {
+        return 0;
+    }
+
+    /* make sure that ramblock is 0 terminated */
+    packet->ramblock[255] = 0;
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        error_setg(errp, "multifd: unknown ram block %s",
+                   packet->ramblock);
+        return -1;
+    }
+    p->pages->block = block;
+
+    for (i = 0; i < p->pages->used; i++) {
+        ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+
+        if ((offset & ~TARGET_PAGE_MASK) ||
+            offset > block->used_length - TARGET_PAGE_SIZE) {
+            error_setg(errp, "multifd: offset too long " RAM_ADDR_FMT
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, block->used_length);
+            return -1;
+        }
+        p->pages->offset[i] = offset;
+        p->pages->iov[i].iov_base = block->host + offset;
+        p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static void multifd_recv_terminate_threads(Error *err)
+{
+    int i;
+
+    if (err) {
+        /* ram_load() fails the migration when the channels sync */
+        error_report("%s", error_get_pretty(err));
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
         qemu_mutex_lock(&p->mutex);
-        p->quit = true;
-        qemu_sem_post(&p->sem);
+        /* The threads sleep in the channel read, kick them out of it */
+        if (p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
         qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem_sync);
     }
 }
 
@@ -529,16 +1435,28 @@ int multifd_load_cleanup(Error **errp)
     if (!migrate_use_multifd()) {
         return 0;
     }
-    terminate_multifd_recv_threads(NULL);
-    for (i = 0; i < multifd_recv_state->count; i++) {
+    multifd_recv_terminate_threads(NULL);
+    for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
-        qemu_thread_join(&p->thread);
+        if (p->running) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+            p->c = NULL;
+        }
         qemu_mutex_destroy(&p->mutex);
-        qemu_sem_destroy(&p->sem);
+        qemu_sem_destroy(&p->sem_sync);
         g_free(p->name);
         p->name = NULL;
+        multifd_pages_clear(p->pages);
+        p->pages = NULL;
+        p->packet_len = 0;
+        g_free(p->packet);
+        p->packet = NULL;
     }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
@@ -547,19 +1465,116 @@ int multifd_load_cleanup(Error **errp)
     return ret;
 }
 
+/**
+ * multifd_recv_sync_main: wait until all channels are synchronized
+ *
+ * Returns 0 on success or negative if a channel has failed
+ *
+ * Called when RAM_SAVE_FLAG_EOS is read from the main stream; returns
+ * once every channel has received all the pages the source sent
+ * before the EOS, and lets the channels continue.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+    int ret = 0;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        trace_multifd_recv_sync_main_wait(p->id);
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            ret = -EIO;
+        }
+        if (multifd_recv_state->packet_num < p->packet_num) {
+            multifd_recv_state->packet_num = p->packet_num;
+        }
+        qemu_mutex_unlock(&p->mutex);
+        trace_multifd_recv_sync_main_signal(p->id);
+        qemu_sem_post(&p->sem_sync);
+    }
+    trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
+    return ret;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    int ret;
+
+    trace_multifd_recv_thread_start(p->id);
+    rcu_register_thread();
 
     while (true) {
+        uint32_t used;
+        uint32_t flags;
+        int i;
+
+        ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
+                                       p->packet_len, &local_err);
+        if (ret == 0) {   /* EOF */
+            break;
+        }
+        if (ret == -1) {   /* Error */
+            break;
+        }
+
         qemu_mutex_lock(&p->mutex);
-        if (p->quit) {
+        rcu_read_lock();
+        ret = multifd_recv_unfill_packet(p, &local_err);
+        rcu_read_unlock();
+        if (ret) {
             qemu_mutex_unlock(&p->mutex);
             break;
         }
+
+        used = p->pages->used;
+        flags = p->flags;
+        trace_multifd_recv(p->id, p->packet_num, used, flags);
+        p->num_packets++;
+        p->num_pages += used;
         qemu_mutex_unlock(&p->mutex);
-        qemu_sem_wait(&p->sem);
+
+        if (used) {
+            /* The pages land directly in guest memory */
+            ret = multifd_readv_all(p->c, p->pages->iov, used, &local_err);
+            if (ret != 0) {
+                break;
+            }
+            for (i = 0; i < used; i++) {
+                ramblock_recv_bitmap_set(p->pages->block,
+                                         p->pages->iov[i].iov_base);
+            }
+        }
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+    if (local_err) {
+        multifd_recv_terminate_threads(local_err);
+        error_free(local_err);
     }
+    qemu_mutex_lock(&p->mutex);
+    p->quit = true;
+    qemu_mutex_unlock(&p->mutex);
+    /* Don't leave the main thread waiting for a sync that won't come */
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+
+    rcu_unregister_thread();
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
 
     return NULL;
 }
@@ -567,6 +1582,7 @@ static void *multifd_recv_thread(void *opaque)
 int multifd_load_setup(void)
 {
     int thread_count;
+    uint32_t page_count = migrate_multifd_page_count();
     uint8_t i;
 
     if (!migrate_use_multifd()) {
@@ -576,21 +1592,77 @@ int multifd_load_setup(void)
     multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     multifd_recv_state->count = 0;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
         qemu_mutex_init(&p->mutex);
-        qemu_sem_init(&p->sem, 0);
-        p->quit = false;
+        qemu_sem_init(&p->sem_sync, 0);
         p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->packet_len = sizeof(MultiFDPacket_t)
+                      + sizeof(uint64_t) * page_count;
+        p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
-        qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
-                           QEMU_THREAD_JOINABLE);
-        multifd_recv_state->count++;
     }
     return 0;
 }
 
+bool multifd_recv_all_channels_created(void)
+{
+    int thread_count = migrate_multifd_channels();
+
+    if (!migrate_use_multifd()) {
+        return true;
+    }
+
+    return thread_count == atomic_read(&multifd_recv_state->count);
+}
+
+/**
+ * multifd_recv_new_channel: take over a newly accepted multifd channel
+ *
+ * Returns true once all the expected channels have been created
+ *
+ * @ioc: channel that was just accepted
+ * @errp: set *errp on error
+ */
+bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
+{
+    MultiFDRecvParams *p;
+    Error *local_err = NULL;
+    int id;
+
+    id = multifd_recv_initial_packet(ioc, &local_err);
+    if (id < 0) {
+        multifd_recv_terminate_threads(local_err);
+        error_propagate(errp, local_err);
+        return false;
+    }
+    trace_multifd_recv_new_channel(id);
+
+    p = &multifd_recv_state->params[id];
+    if (p->c != NULL) {
+        error_setg(&local_err, "multifd: received id '%d' already setup'",
+                   id);
+        multifd_recv_terminate_threads(local_err);
+        error_propagate(errp, local_err);
+        return false;
+    }
+    p->c = ioc;
+    object_ref(OBJECT(ioc));
+    /* initial packet */
+    p->num_packets = 1;
+
+    p->running = true;
+    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    atomic_inc(&multifd_recv_state->count);
+    return atomic_read(&multifd_recv_state->count) ==
+           migrate_multifd_channels();
+}
+
 /**
  * save_page_header: write page header to wire
  *
@@ -648,6 +1720,61 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+/**
+ * mig_throttle_adapt: choose the CPU throttle from the dirty page rate
+ *
+ * The guest is assumed to dirty memory in proportion to the time it
+ * runs, so the throttle is the share of time to take away to bring its
+ * dirty rate down to a target.  The target lets the pages dirtied while
+ * the remaining ones are sent fit in downtime-limit, but never asks for
+ * less than half the bandwidth, so that each pass at least halves what
+ * is left.  The unthrottled rate is smoothed so that a single burst does
+ * not push the throttle up, and the throttle only goes halfway down at
+ * a time.
+ *
+ * @rs: current RAM state
+ * @elapsed: length of the sync period in milliseconds
+ * @bytes_xfer: bytes sent during the period
+ */
+static void mig_throttle_adapt(RAMState *rs, int64_t elapsed,
+                               uint64_t bytes_xfer)
+{
+    int pct = cpu_throttle_active() ? cpu_throttle_get_percentage() : 0;
+    double bandwidth, dirty, remaining, target, raw;
+    int new_pct;
+
+    if (rs->ram_bulk_stage || !bytes_xfer || elapsed <= 0) {
+        return;
+    }
+
+    /* All in bytes per second */
+    bandwidth = (double)bytes_xfer * 1000 / elapsed;
+    dirty = (double)rs->num_dirty_pages_period * TARGET_PAGE_SIZE * 1000 /
+            elapsed;
+    raw = dirty * 100 / (100 - pct);
+    if (rs->dirty_bytes_rate_unthrottled) {
+        raw = (raw + rs->dirty_bytes_rate_unthrottled) / 2;
+    }
+    rs->dirty_bytes_rate_unthrottled = raw;
+
+    remaining = (double)rs->migration_dirty_pages * TARGET_PAGE_SIZE;
+    target = bandwidth * bandwidth * migrate_downtime_limit() / 1000 /
+             MAX(remaining, 1);
+    target = MAX(MIN(target, bandwidth), bandwidth / 2);
+
+    new_pct = raw > target ? 100 - (int)(target * 100 / raw) : 0;
+    if (new_pct < pct) {
+        new_pct = (pct + new_pct) / 2;
+    }
+
+    trace_migration_throttle_adapt(dirty, bandwidth, target, pct, new_pct);
+    if (new_pct > 0) {
+        cpu_throttle_set(new_pct);
+    } else if (pct) {
+        cpu_throttle_stop();
+    }
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -668,8 +1795,10 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count) == 1) {
+        xbzrle_counters.cache_eviction++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -692,17 +1821,22 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, bool last_stage)
 {
-    int encoded_len = 0, bytes_xbzrle;
+    int encoded_len = 0, bytes_xbzrle, ret;
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               ram_counters.dirty_sync_count);
+            if (ret == -1) {
+                xbzrle_counters.cache_conflict++;
                 return -1;
             } else {
+                if (ret == 1) {
+                    xbzrle_counters.cache_eviction++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -710,6 +1844,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
         }
         return -1;
     }
+    xbzrle_counters.cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -795,12 +1930,313 @@ static inline bool migration_bitmap_clear_dirty(RAMState *rs,
     return ret;
 }
 
-static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
-                                        ram_addr_t start, ram_addr_t length)
+/* Dirty page rate statistics */
+
+/* One page out of DIRTY_HEAT_STRIDE is followed for the hotness histogram */
+#define DIRTY_HEAT_STRIDE 64
+/* Set in dirty_heat while the sampled page is dirty before a sync */
+#define DIRTY_HEAT_PENDING 0x80
+#define DIRTY_HEAT_MAX 0x7f
+/* Histogram buckets: dirtied in 0, 1, 2-3, 4-7, ..., 64 or more periods */
+#define DIRTY_HEAT_BUCKETS 8
+/* Longest measurement accepted by calc-dirty-rate, in seconds */
+#define DIRTY_RATE_MAX_CALC_TIME 60
+
+/*
+ * The dirty page rate is computed over periods of about a second, at
+ * the end of each migration_bitmap_sync() period during migration, or
+ * by the calc-dirty-rate thread otherwise.  The figures of each RAMBlock
+ * are kept in the block; the totals live here, for query-dirty-rate.
+ */
+static struct {
+    /* protects everything below */
+    QemuMutex lock;
+    DirtyRateStatus status;
+    bool migration;
+    uint64_t periods;
+    uint64_t dirty_rate;
+    uint64_t heat[DIRTY_HEAT_BUCKETS];
+} dirty_rate;
+
+/* Number of sampled pages in the first @length bytes of a block */
+static inline size_t dirty_heat_samples(ram_addr_t length)
+{
+    return DIV_ROUND_UP(length >> TARGET_PAGE_BITS, DIRTY_HEAT_STRIDE);
+}
+
+static inline int dirty_heat_bucket(uint8_t heat)
+{
+    return heat ? MIN(32 - clz32(heat), DIRTY_HEAT_BUCKETS - 1) : 0;
+}
+
+static void dirty_rate_start(bool migration)
+{
+    qemu_mutex_lock(&dirty_rate.lock);
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURING;
+    dirty_rate.migration = migration;
+    dirty_rate.periods = 0;
+    dirty_rate.dirty_rate = 0;
+    memset(dirty_rate.heat, 0, sizeof(dirty_rate.heat));
+    qemu_mutex_unlock(&dirty_rate.lock);
+}
+
+static void dirty_rate_finish(void)
+{
+    qemu_mutex_lock(&dirty_rate.lock);
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURED;
+    qemu_mutex_unlock(&dirty_rate.lock);
+}
+
+bool ram_dirty_rate_measuring(void)
+{
+    bool ret;
+
+    qemu_mutex_lock(&dirty_rate.lock);
+    ret = dirty_rate.status == DIRTY_RATE_STATUS_MEASURING &&
+          !dirty_rate.migration;
+    qemu_mutex_unlock(&dirty_rate.lock);
+    return ret;
+}
+
+static void ram_block_dirty_stats_init(RAMBlock *rb)
+{
+    rb->dirty_pages_period = 0;
+    atomic_set(&rb->dirty_rate, 0);
+    rb->dirty_heat = g_new0(uint8_t, dirty_heat_samples(rb->max_length));
+}
+
+static void ram_block_dirty_stats_cleanup(RAMBlock *rb)
+{
+    g_free(rb->dirty_heat);
+    rb->dirty_heat = NULL;
+}
+
+/**
+ * ram_block_sync_dirty: fold the dirty log of a block into its bitmap
+ *
+ * Returns the number of pages that were not yet dirty in rb->bmap.
+ *
+ * A sampled page counts as dirtied in the period for the hotness
+ * histogram only when it was clean in rb->bmap before the sync.
+ *
+ * @rb: RAMBlock to synchronize
+ * @dirtied: incremented by the number of pages the guest dirtied
+ */
+static uint64_t ram_block_sync_dirty(RAMBlock *rb, uint64_t *dirtied)
+{
+    size_t i, samples = dirty_heat_samples(rb->used_length);
+    uint64_t num_dirty = 0, new_dirty;
+
+    if (rb->dirty_heat) {
+        for (i = 0; i < samples; i++) {
+            if (test_bit(i * DIRTY_HEAT_STRIDE, rb->bmap)) {
+                rb->dirty_heat[i] |= DIRTY_HEAT_PENDING;
+            }
+        }
+    }
+
+    new_dirty = cpu_physical_memory_sync_dirty_bitmap(rb, 0, rb->used_length,
+                                                      &num_dirty);
+    rb->dirty_pages_period += num_dirty;
+    *dirtied += num_dirty;
+
+    if (rb->dirty_heat) {
+        for (i = 0; i < samples; i++) {
+            uint8_t heat = rb->dirty_heat[i];
+
+            if (!(heat & DIRTY_HEAT_PENDING) &&
+                test_bit(i * DIRTY_HEAT_STRIDE, rb->bmap) &&
+                heat < DIRTY_HEAT_MAX) {
+                heat++;
+            }
+            rb->dirty_heat[i] = heat & ~DIRTY_HEAT_PENDING;
+        }
+    }
+
+    return new_dirty;
+}
+
+/**
+ * dirty_rate_period_end: compute the dirty page rates of a period
+ *
+ * Called within an RCU critical section.
+ *
+ * @elapsed: length of the period in milliseconds
+ */
+static void dirty_rate_period_end(int64_t elapsed)
+{
+    uint64_t heat[DIRTY_HEAT_BUCKETS] = { };
+    uint64_t total = 0;
+    RAMBlock *block;
+    size_t i, samples;
+
+    elapsed = MAX(elapsed, 1);
+    RAMBLOCK_FOREACH(block) {
+        atomic_set(&block->dirty_rate,
+                   block->dirty_pages_period * 1000 / elapsed);
+        total += block->dirty_pages_period;
+        block->dirty_pages_period = 0;
+
+        if (block->dirty_heat) {
+            samples = dirty_heat_samples(block->used_length);
+            for (i = 0; i < samples; i++) {
+                heat[dirty_heat_bucket(block->dirty_heat[i])] +=
+                    DIRTY_HEAT_STRIDE;
+            }
+        }
+    }
+
+    total = total * 1000 / elapsed;
+    trace_dirty_rate_period_end(elapsed, total);
+
+    qemu_mutex_lock(&dirty_rate.lock);
+    dirty_rate.periods++;
+    dirty_rate.dirty_rate = total;
+    memcpy(dirty_rate.heat, heat, sizeof(heat));
+    qemu_mutex_unlock(&dirty_rate.lock);
+}
+
+static void *dirty_rate_calc_thread(void *opaque)
+{
+    int64_t calc_time = (intptr_t)opaque;
+    int64_t start, now;
+    uint64_t dirtied = 0;
+    RAMBlock *block;
+    int i;
+
+    rcu_register_thread();
+
+    /* The first sync drops what was logged before the measurement */
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    memory_global_dirty_log_sync();
+    qemu_mutex_unlock_iothread();
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        block->bmap = bitmap_new(block->max_length >> TARGET_PAGE_BITS);
+        ram_block_dirty_stats_init(block);
+        ram_block_sync_dirty(block, &dirtied);
+        bitmap_zero(block->bmap, block->max_length >> TARGET_PAGE_BITS);
+        block->dirty_pages_period = 0;
+    }
+    rcu_read_unlock();
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    /*
+     * The RCU read lock is not held across the sleeps: blocks added in the
+     * meantime have no bitmap and are skipped, and the bitmaps of blocks
+     * that go away are leaked, like during migration.
+     */
+    for (i = 0; i < calc_time; i++) {
+        g_usleep(G_USEC_PER_SEC);
+
+        qemu_mutex_lock_iothread();
+        memory_global_dirty_log_sync();
+        qemu_mutex_unlock_iothread();
+
+        rcu_read_lock();
+        RAMBLOCK_FOREACH(block) {
+            if (block->bmap) {
+                ram_block_sync_dirty(block, &dirtied);
+                bitmap_zero(block->bmap,
+                            block->max_length >> TARGET_PAGE_BITS);
+            }
+        }
+        now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        dirty_rate_period_end(now - start);
+        rcu_read_unlock();
+        start = now;
+    }
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_stop();
+    qemu_mutex_unlock_iothread();
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        g_free(block->bmap);
+        block->bmap = NULL;
+        ram_block_dirty_stats_cleanup(block);
+    }
+    rcu_read_unlock();
+
+    dirty_rate_finish();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    QemuThread thread;
+
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "a value between 1 and 60");
+        return;
+    }
+    if (!migration_is_idle()) {
+        error_setg(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (ram_dirty_rate_measuring()) {
+        error_setg(errp, "A dirty page rate measurement is in progress");
+        return;
+    }
+
+    dirty_rate_start(false);
+    qemu_thread_create(&thread, "dirtyrate", dirty_rate_calc_thread,
+                       (void *)(intptr_t)calc_time, QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    RAMBlockDirtyRateList *blocks = NULL, *entry;
+    DirtyPageHeatList *heat = NULL, *bucket;
+    RAMBlock *block;
+    int i;
+
+    qemu_mutex_lock(&dirty_rate.lock);
+    info->status = dirty_rate.status;
+    info->migration = dirty_rate.migration;
+    info->periods = dirty_rate.periods;
+    info->dirty_rate = dirty_rate.dirty_rate;
+    for (i = DIRTY_HEAT_BUCKETS - 1; i >= 0; i--) {
+        if (!dirty_rate.heat[i] && !heat) {
+            continue;
+        }
+        bucket = g_new0(DirtyPageHeatList, 1);
+        bucket->value = g_new0(DirtyPageHeat, 1);
+        bucket->value->periods = i ? 1 << (i - 1) : 0;
+        bucket->value->pages = dirty_rate.heat[i];
+        bucket->next = heat;
+        heat = bucket;
+    }
+    qemu_mutex_unlock(&dirty_rate.lock);
+    info->page_size = TARGET_PAGE_SIZE;
+    info->heat = heat;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        entry = g_new0(RAMBlockDirtyRateList, 1);
+        entry->value = g_new0(RAMBlockDirtyRate, 1);
+        entry->value->id = g_strdup(block->idstr);
+        entry->value->size = block->used_length;
+        entry->value->dirty_rate = atomic_read(&block->dirty_rate);
+        entry->next = blocks;
+        blocks = entry;
+    }
+    rcu_read_unlock();
+    info->blocks = blocks;
+
+    return info;
+}
+
+static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb)
 {
     rs->migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(rb, start, length,
-                                              &rs->num_dirty_pages_period);
+        ram_block_sync_dirty(rb, &rs->num_dirty_pages_period);
 }
 
 /**
@@ -824,6 +2260,49 @@ uint64_t ram_pagesize_summary(void)
     return summary;
 }
 
+/**
+ * xbzrle_cache_autosize: size the XBZRLE cache after the dirty working set
+ *
+ * The pages dirtied during a sync period are the ones XBZRLE will have to
+ * send again, so the cache should be able to hold all of them.  It gets
+ * twice that to leave room for set conflicts, within the limit given by
+ * xbzrle-cache-size.  It only shrinks once it is four times too large,
+ * so that it does not keep flipping between two sizes.
+ *
+ * @rs: current RAM state
+ */
+static void xbzrle_cache_autosize(RAMState *rs)
+{
+    Error *local_err = NULL;
+    uint64_t target;
+    int64_t size;
+
+    if (!rs->xbzrle_working_set) {
+        rs->xbzrle_working_set = rs->num_dirty_pages_period;
+    } else {
+        rs->xbzrle_working_set = (rs->xbzrle_working_set * 3 +
+                                  rs->num_dirty_pages_period) / 4;
+    }
+
+    target = pow2ceil(rs->xbzrle_working_set * 2 * TARGET_PAGE_SIZE);
+    target = MAX(target, XBZRLE_CACHE_MIN_AUTOSIZE);
+    target = MIN(target, migrate_xbzrle_cache_size());
+
+    XBZRLE_cache_lock();
+    if (XBZRLE.cache) {
+        size = cache_get_size(XBZRLE.cache);
+        if (target > size || target * 4 <= size) {
+            trace_xbzrle_cache_autosize(rs->xbzrle_working_set, size, target);
+            if (cache_resize(XBZRLE.cache, target, &local_err) < 0) {
+                error_report_err(local_err);
+            } else {
+                xbzrle_counters.cache_size = target;
+            }
+        }
+    }
+    XBZRLE_cache_unlock();
+}
+
 static void migration_bitmap_sync(RAMState *rs)
 {
     RAMBlock *block;
@@ -841,8 +2320,9 @@ static void migration_bitmap_sync(RAMState *rs)
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
+    zero_scan_invalidate();
     RAMBLOCK_FOREACH(block) {
-        migration_bitmap_sync_range(rs, block, 0, block->used_length);
+        migration_bitmap_sync_range(rs, block);
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&rs->bitmap_mutex);
@@ -858,10 +2338,19 @@ static void migration_bitmap_sync(RAMState *rs)
             / (end_time - rs->time_last_bitmap_sync);
         bytes_xfer_now = ram_counters.transferred;
 
+        rcu_read_lock();
+        dirty_rate_period_end(end_time - rs->time_last_bitmap_sync);
+        rcu_read_unlock();
+
         /* During block migration the auto-converge logic incorrectly detects
          * that ram migration makes no progress. Avoid this by disabling the
          * throttling logic during the bulk phase of block migration. */
-        if (migrate_auto_converge() && !blk_mig_bulk_active()) {
+        if (migrate_auto_converge() && migrate_adaptive_converge()) {
+            if (!blk_mig_bulk_active()) {
+                mig_throttle_adapt(rs, end_time - rs->time_last_bitmap_sync,
+                                   bytes_xfer_now - rs->bytes_xfer_prev);
+            }
+        } else if (migrate_auto_converge() && !blk_mig_bulk_active()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
@@ -878,14 +2367,26 @@ static void migration_bitmap_sync(RAMState *rs)
         }
 
         if (migrate_use_xbzrle()) {
+            uint64_t hits = xbzrle_counters.cache_hit -
+                            rs->xbzrle_cache_hit_prev;
+            uint64_t misses = xbzrle_counters.cache_miss -
+                              rs->xbzrle_cache_miss_prev;
+
             if (rs->iterations_prev != rs->iterations) {
-                xbzrle_counters.cache_miss_rate =
-                   (double)(xbzrle_counters.cache_miss -
-                            rs->xbzrle_cache_miss_prev) /
+                xbzrle_counters.cache_miss_rate = (double)misses /
                    (rs->iterations - rs->iterations_prev);
             }
+            if (hits + misses) {
+                xbzrle_counters.cache_hit_rate = (double)hits /
+                                                 (hits + misses);
+            }
             rs->iterations_prev = rs->iterations;
             rs->xbzrle_cache_miss_prev = xbzrle_counters.cache_miss;
+            rs->xbzrle_cache_hit_prev = xbzrle_counters.cache_hit;
+
+            if (migrate_xbzrle_cache_autosize() && !rs->ram_bulk_stage) {
+                xbzrle_cache_autosize(rs);
+            }
         }
 
         /* reset period counters */
@@ -898,6 +2399,19 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 }
 
+/* Check if the page at @offset of @block, mapped at @p, is zero */
+static bool ram_page_is_zero(RAMBlock *block, ram_addr_t offset, uint8_t *p)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+
+    if (block->zscanmap && test_bit(page, block->zscanmap)) {
+        /* A scanner thread already checked it, don't read it again */
+        smp_rmb();
+        return test_bit(page, block->zeromap);
+    }
+    return is_zero_range(p, TARGET_PAGE_SIZE);
+}
+
 /**
  * save_zero_page: send the zero page to the stream
  *
@@ -913,7 +2427,7 @@ static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
 {
     int pages = -1;
 
-    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+    if (ram_page_is_zero(block, offset, p)) {
         ram_counters.duplicate++;
         ram_counters.transferred +=
             save_page_header(rs, rs->f, block, offset | RAM_SAVE_FLAG_ZERO);
@@ -961,6 +2475,11 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     p = block->host + offset;
     trace_ram_save_page(block->idstr, (uint64_t)offset, p);
 
+    if (migrate_background_snapshot()) {
+        /* The guest may write to the page as soon as it is saved */
+        send_async = false;
+    }
+
     /* In doubt sent page as normal */
     bytes_xmit = 0;
     ret = ram_control_save_page(rs->f, block->offset,
@@ -1024,8 +2543,116 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset)
+/*
+ * mapped-ram
+ *
+ * When migrating to a file, each RAMBlock gets a region of the file as
+ * large as the block, and a bitmap of the pages stored in that region.
+ * A page is written at its own offset in the region every time it is
+ * sent, so that the file holds a single copy of RAM however many times the
+ * guest dirtied it, and the destination can read it back in parallel
+ * rather than replay the stream.  Zero pages are not stored; their bit
+ * is clear.
+ *
+ * The stream keeps the block list, where each block is followed by the
+ * offsets of its bitmap and of its pages, and then jumps over them; what
+ * follows RAM in the stream, such as the device state, comes after them.
+ * The bitmaps are written once RAM is complete.
+ */
+#define MAPPED_RAM_ALIGN (1 << 20)
+/* Largest read of the destination, in pages */
+#define MAPPED_RAM_LOAD_CHUNK (8 << (20 - TARGET_PAGE_BITS))
+#define MAPPED_RAM_LOAD_THREADS 8
+
+static int mapped_ram_save_block_header(QEMUFile *f, RAMBlock *block)
+{
+    size_t bitmap_size;
+    int64_t pos;
+
+    block->file_pages = block->used_length >> TARGET_PAGE_BITS;
+    block->file_bmap = bitmap_new(block->file_pages);
+    bitmap_size = BITS_TO_LONGS(block->file_pages) * sizeof(unsigned long);
+
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    pos = qemu_get_offset(f);
+    if (pos < 0) {
+        return pos;
+    }
+    /* Leave room for the two offsets */
+    pos += 2 * sizeof(uint64_t);
+    block->bitmap_offset = QEMU_ALIGN_UP(pos, MAPPED_RAM_ALIGN);
+    block->pages_offset = QEMU_ALIGN_UP(block->bitmap_offset + bitmap_size,
+                                        MAPPED_RAM_ALIGN);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    trace_mapped_ram_save_block(block->idstr, block->bitmap_offset,
+                                block->pages_offset);
+
+    return qemu_set_offset(f, block->pages_offset + block->used_length);
+}
+
+static void mapped_ram_save_bitmap(QEMUFile *f, RAMBlock *block)
+{
+    size_t bitmap_size = BITS_TO_LONGS(block->file_pages) *
+                         sizeof(unsigned long);
+    unsigned long *le = bitmap_new(block->file_pages);
+
+    bitmap_to_le(le, block->file_bmap, block->file_pages);
+    qemu_put_buffer_at(f, (uint8_t *)le, bitmap_size, block->bitmap_offset);
+    g_free(le);
+}
+
+/**
+ * ram_save_mapped_page: write a page at its place in the file
+ *
+ * Returns the number of pages written, or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ */
+static int ram_save_mapped_page(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+    uint8_t *p = block->host + offset;
+
+    if (pss->page >= block->file_pages) {
+        error_report("RAM block %s grew past its place in the file",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    if (ram_page_is_zero(block, offset, p)) {
+        clear_bit(pss->page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    set_bit(pss->page, block->file_bmap);
+    qemu_put_buffer_at(rs->f, p, TARGET_PAGE_SIZE,
+                       block->pages_offset + offset);
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    ram_counters.normal++;
+    return 1;
+}
+
+/**
+ * do_compress_ram_page: compress a page into @f
+ *
+ * Returns the number of bytes written, 0 on error.
+ *
+ * For streaming compression methods the page is preceded by the id of
+ * the stream it belongs to, so that the destination can feed it to the
+ * decompression context that saw the previous pages of that stream.
+ *
+ * @f: QEMUFile where to save the data
+ * @c: compression context
+ * @stream: stream id of @c
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ */
+static int do_compress_ram_page(QEMUFile *f, MigrationCompress *c, int stream,
+                                RAMBlock *block, ram_addr_t offset)
 {
     RAMState *rs = ram_state;
     int bytes_sent, blen;
@@ -1033,8 +2660,11 @@ static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
 
     bytes_sent = save_page_header(rs, f, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
+    if (migration_compress_method_is_stream(migration_compress_get_method(c))) {
+        qemu_put_byte(f, stream);
+        bytes_sent++;
+    }
+    blen = qemu_put_compression_data(f, c, p, TARGET_PAGE_SIZE);
     if (blen < 0) {
         bytes_sent = 0;
         qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
@@ -1130,7 +2760,7 @@ static int ram_save_compressed_page(RAMState *rs, PageSearchStatus *pss,
     int pages = -1;
     uint64_t bytes_xmit = 0;
     uint8_t *p;
-    int ret, blen;
+    int ret;
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
 
@@ -1162,20 +2792,15 @@ static int ram_save_compressed_page(RAMState *rs, PageSearchStatus *pss,
             pages = save_zero_page(rs, block, offset, p);
             if (pages == -1) {
                 /* Make sure the first page is sent out before other pages */
-                bytes_xmit = save_page_header(rs, rs->f, block, offset |
-                                              RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(rs->f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
-                if (blen > 0) {
-                    ram_counters.transferred += bytes_xmit + blen;
+                bytes_xmit = do_compress_ram_page(rs->f, comp_main,
+                                                  migrate_compress_threads(),
+                                                  block, offset);
+                if (bytes_xmit > 0) {
+                    ram_counters.transferred += bytes_xmit;
                     ram_counters.normal++;
                     pages = 1;
-                } else {
-                    qemu_file_set_error(rs->f, blen);
-                    error_report("compressed data failed!");
                 }
-            }
-            if (pages > 0) {
+            } else {
                 ram_release_pages(block->idstr, offset, pages);
             }
         } else {
@@ -1191,6 +2816,37 @@ static int ram_save_compressed_page(RAMState *rs, PageSearchStatus *pss,
     return pages;
 }
 
+/**
+ * ram_save_multifd_page: send the given page over the multifd channels
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * Zero pages are still sent on the main stream, only the header is
+ * needed for them.  Pages with data are queued and written by the
+ * multifd threads directly from guest memory.
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ */
+static int ram_save_multifd_page(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+    int pages;
+
+    pages = save_zero_page(rs, block, offset, block->host + offset);
+    if (pages > 0) {
+        return pages;
+    }
+
+    if (multifd_queue_page(rs, block, offset) < 0) {
+        return -1;
+    }
+    ram_counters.normal++;
+
+    return 1;
+}
+
 /**
  * find_dirty_block: find the next dirty page and update any state
  * associated with the search process.
@@ -1241,6 +2897,181 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
     }
 }
 
+/*
+ * Write tracking for background snapshots
+ *
+ * A background snapshot saves RAM as it was when the snapshot started,
+ * while the guest keeps running.  Instead of logging dirty pages, RAM is
+ * write protected through a userfault fd before the guest is restarted;
+ * the first write of the guest to a page stops the writer until the
+ * migration thread has saved the page, which then unprotects it.  Every
+ * page is saved once, and the pages the guest waits for go first, like
+ * the pages requested by the destination in postcopy.
+ */
+
+/*
+ * Blocks the guest can not write to are not protected; they are saved
+ * whenever the migration thread gets to them.
+ */
+static bool ram_block_is_write_tracked(RAMBlock *rb)
+{
+    return !rb->mr->readonly && !rb->mr->rom_device &&
+           !memory_region_is_ram_device(rb->mr);
+}
+
+/*
+ * Pages that were never touched, or were discarded, have no page table
+ * entry, and writing to them would not hit the write protection.  Reading
+ * every host page maps them (to the shared zero page for anonymous memory)
+ * before the protection is set up.
+ */
+static void ram_block_populate_read(RAMBlock *rb)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    ram_addr_t offset;
+
+    for (offset = 0; offset < rb->used_length; offset += pagesize) {
+        char tmp = *((char *)rb->host + offset);
+
+        /* Don't let the compiler drop the read */
+        asm volatile("" : "+r" (tmp));
+    }
+}
+
+/**
+ * ram_write_tracking_available: check that the host can write protect RAM
+ *
+ * Returns true if it can, otherwise false with @errp set
+ *
+ * @errp: set *errp on failure
+ */
+bool ram_write_tracking_available(Error **errp)
+{
+    int ufd = ufd_wp_open(errp);
+
+    if (ufd < 0) {
+        return false;
+    }
+    close(ufd);
+    return true;
+}
+
+/**
+ * ram_write_tracking_start: write protect RAM for a background snapshot
+ *
+ * Called with the VM stopped, after ram_save_setup(), so that the pages
+ * that are saved from here on have the contents they had at this point.
+ *
+ * Returns zero on success, otherwise -1 with @errp set
+ *
+ * @errp: set *errp on failure
+ */
+int ram_write_tracking_start(Error **errp)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+    int ufd;
+
+    ufd = ufd_wp_open(errp);
+    if (ufd < 0) {
+        return -1;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        if (!ram_block_is_write_tracked(block)) {
+            continue;
+        }
+        ram_block_populate_read(block);
+        if (ufd_wp_register(ufd, block->host, block->used_length, errp)) {
+            goto fail;
+        }
+        if (ufd_wp_protect(ufd, block->host, block->used_length, true)) {
+            error_setg(errp, "Failed to write protect RAM block %s",
+                       block->idstr);
+            goto fail;
+        }
+        trace_ram_write_tracking_start(block->idstr, block->used_length);
+    }
+    rcu_read_unlock();
+
+    /* A page the balloon discards would lose its protection */
+    qemu_balloon_inhibit(true);
+    rs->wp_fd = ufd;
+    return 0;
+
+fail:
+    rcu_read_unlock();
+    /* Closing the fd drops the registrations along with the protection */
+    close(ufd);
+    return -1;
+}
+
+/**
+ * ram_write_tracking_stop: unprotect RAM at the end of a background snapshot
+ *
+ * Wakes up anything still waiting to write to RAM.  Must not be called
+ * with the iothread lock held, as one of those may hold it.
+ */
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs || rs->wp_fd < 0) {
+        return;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        if (!ram_block_is_write_tracked(block)) {
+            continue;
+        }
+        ufd_wp_protect(rs->wp_fd, block->host, block->used_length, false);
+        ufd_wp_unregister(rs->wp_fd, block->host, block->used_length);
+    }
+    rcu_read_unlock();
+
+    close(rs->wp_fd);
+    rs->wp_fd = -1;
+    qemu_balloon_inhibit(false);
+    trace_ram_write_tracking_stop();
+}
+
+/**
+ * poll_fault_page: get a page the guest is waiting to write to
+ *
+ * Returns the block of the page (or NULL if no one is waiting)
+ *
+ * @rs: current RAM state
+ * @offset: used to return the offset within the RAMBlock of the host page
+ */
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    RAMBlock *block;
+    void *addr;
+
+    if (rs->wp_fd < 0) {
+        return NULL;
+    }
+
+    addr = ufd_wp_read_fault(rs->wp_fd);
+    if (!addr) {
+        return NULL;
+    }
+
+    block = qemu_ram_block_from_host(addr, false, offset);
+    if (!block) {
+        error_report("%s: write fault outside of RAM at %p", __func__, addr);
+        return NULL;
+    }
+
+    /* The protection is removed one host page at a time */
+    *offset = QEMU_ALIGN_DOWN(*offset, qemu_ram_pagesize(block));
+    trace_ram_write_tracking_fault(block->idstr, *offset);
+    return block;
+}
+
 /**
  * unqueue_page: gets a page of the queue
  *
@@ -1294,6 +3125,9 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     do {
         block = unqueue_page(rs, &offset);
+        if (!block) {
+            block = poll_fault_page(rs, &offset);
+        }
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -1307,7 +3141,8 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
             dirty = test_bit(page, block->bmap);
             if (!dirty) {
                 trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
-                       page, test_bit(page, block->unsentmap));
+                       page, block->unsentmap &&
+                             test_bit(page, block->unsentmap));
             } else {
                 trace_get_queued_page(block->idstr, (uint64_t)offset, page);
             }
@@ -1449,9 +3284,14 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
          * round of migration even if compression is enabled. In theory,
          * xbzrle can do better than compression.
          */
-        if (migrate_use_compression() &&
+        if (migrate_mapped_ram()) {
+            res = ram_save_mapped_page(rs, pss);
+        } else if (migrate_use_compression() &&
             (rs->ram_bulk_stage || !migrate_use_xbzrle())) {
             res = ram_save_compressed_page(rs, pss, last_stage);
+        } else if (migrate_use_multifd() && !migrate_use_xbzrle() &&
+                   !migration_in_postcopy()) {
+            res = ram_save_multifd_page(rs, pss);
         } else {
             res = ram_save_page(rs, pss, last_stage);
         }
@@ -1491,6 +3331,7 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
 
     do {
         tmppages = ram_save_target_page(rs, pss, last_stage);
@@ -1503,6 +3344,20 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     } while ((pss->page & (pagesize_bits - 1)) &&
              offset_in_ramblock(pss->block, pss->page << TARGET_PAGE_BITS));
 
+    if (rs->wp_fd >= 0 && ram_block_is_write_tracked(pss->block)) {
+        /* Saved, the guest can write to the host page again */
+        ram_addr_t start = QEMU_ALIGN_DOWN(start_page, pagesize_bits) <<
+                           TARGET_PAGE_BITS;
+        ram_addr_t end = pss->page << TARGET_PAGE_BITS;
+        int ret;
+
+        ret = ufd_wp_protect(rs->wp_fd, pss->block->host + start,
+                             end - start, false);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->page--;
     return pages;
@@ -1551,6 +3406,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         }
 
         if (found) {
+            zero_scan_advance(&pss);
             pages = ram_save_host_page(rs, &pss, last_stage);
         }
     } while (!pages && again);
@@ -1628,17 +3484,37 @@ static void ram_save_cleanup(void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
-    /* caller have hold iothread lock or is in a bh, so there is
-     * no writing race against this migration_bitmap
-     */
-    memory_global_dirty_log_stop();
+    /* Setup failed before anything was allocated */
+    if (!*rsp) {
+        return;
+    }
+
+    if (migrate_background_snapshot()) {
+        /* Normally done without the iothread lock by the migration thread */
+        ram_write_tracking_stop();
+    } else {
+        /* caller have hold iothread lock or is in a bh, so there is
+         * no writing race against this migration_bitmap
+         */
+        memory_global_dirty_log_stop();
+    }
+
+    zero_scan_save_cleanup();
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         g_free(block->bmap);
         block->bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->zscanmap);
+        block->zscanmap = NULL;
+        g_free(block->zeromap);
+        block->zeromap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+        ram_block_dirty_stats_cleanup(block);
     }
+    dirty_rate_finish();
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
@@ -2079,6 +3955,7 @@ static int xbzrle_init(void)
         error_report_err(local_err);
         goto free_zero_page;
     }
+    xbzrle_counters.cache_size = migrate_xbzrle_cache_size();
 
     XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
     if (!XBZRLE.encoded_buf) {
@@ -2122,6 +3999,7 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    (*rsp)->wp_fd = -1;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -2149,6 +4027,11 @@ static void ram_list_init_bitmaps(void)
                 block->unsentmap = bitmap_new(pages);
                 bitmap_set(block->unsentmap, 0, pages);
             }
+            if (migrate_zero_page_threads()) {
+                block->zscanmap = bitmap_new(pages);
+                block->zeromap = bitmap_new(pages);
+            }
+            ram_block_dirty_stats_init(block);
         }
     }
 }
@@ -2161,8 +4044,11 @@ static void ram_init_bitmaps(RAMState *rs)
     rcu_read_lock();
 
     ram_list_init_bitmaps();
-    memory_global_dirty_log_start();
-    migration_bitmap_sync(rs);
+    /* A background snapshot tracks writes with ram_write_tracking_start() */
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync(rs);
+    }
 
     rcu_read_unlock();
     qemu_mutex_unlock_ramlist();
@@ -2171,6 +4057,12 @@ static void ram_init_bitmaps(RAMState *rs)
 
 static int ram_init_all(RAMState **rsp)
 {
+    /* Both would fold the dirty log into the RAMBlock bitmaps */
+    if (ram_dirty_rate_measuring()) {
+        error_report("A dirty page rate measurement is in progress");
+        return -1;
+    }
+
     if (ram_state_init(rsp)) {
         return -1;
     }
@@ -2180,6 +4072,7 @@ static int ram_init_all(RAMState **rsp)
         return -1;
     }
 
+    dirty_rate_start(true);
     ram_init_bitmaps(*rsp);
 
     return 0;
@@ -2204,6 +4097,12 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    Error *local_err = NULL;
+
+    if (migrate_mapped_ram() && !qemu_file_is_seekable(f)) {
+        error_report("mapped-ram needs a migration to a file");
+        return -1;
+    }
 
     /* migration has already setup the bitmap, reuse it. */
     if (!migration_in_colo_state()) {
@@ -2224,14 +4123,26 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         if (migrate_postcopy_ram() && block->page_size != qemu_host_page_size) {
             qemu_put_be64(f, block->page_size);
         }
+        if (migrate_mapped_ram() &&
+            mapped_ram_save_block_header(f, block) < 0) {
+            rcu_read_unlock();
+            return -1;
+        }
     }
 
     rcu_read_unlock();
-    compress_threads_save_setup();
+    if (compress_threads_save_setup(&local_err) < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+    zero_scan_save_setup();
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
+    if (multifd_send_sync_main(*rsp) < 0) {
+        return -1;
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -2291,6 +4202,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+    zero_scan_pause();
     flush_compressed_data(rs);
     rcu_read_unlock();
 
@@ -2300,6 +4212,10 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
      */
     ram_control_after_iterate(f, RAM_CONTROL_ROUND);
 
+    ret = multifd_send_sync_main(rs);
+    if (ret < 0) {
+        return ret;
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     ram_counters.transferred += 8;
 
@@ -2328,7 +4244,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     rcu_read_lock();
 
-    if (!migration_in_postcopy()) {
+    if (!migration_in_postcopy() && !migrate_background_snapshot()) {
         migration_bitmap_sync(rs);
     }
 
@@ -2347,11 +4263,25 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
+    zero_scan_pause();
     flush_compressed_data(rs);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
+    if (migrate_mapped_ram()) {
+        RAMBlock *block;
+
+        RAMBLOCK_FOREACH(block) {
+            if (block->file_bmap) {
+                mapped_ram_save_bitmap(f, block);
+            }
+        }
+    }
+
     rcu_read_unlock();
 
+    if (multifd_send_sync_main(rs) < 0) {
+        return -1;
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -2367,7 +4297,7 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
 
-    if (!migration_in_postcopy() &&
+    if (!migration_in_postcopy() && !migrate_background_snapshot() &&
         remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
@@ -2486,9 +4416,12 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
+    bool stream;
     uint8_t *des;
     int len;
+    ssize_t ret;
+
+    stream = migration_compress_method_is_stream(migrate_compress_method());
 
     qemu_mutex_lock(&param->mutex);
     while (!param->quit) {
@@ -2498,16 +4431,20 @@ static void *do_data_decompress(void *opaque)
             param->des = 0;
             qemu_mutex_unlock(&param->mutex);
 
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
+            /* zlib decompression will fail in some case, especially
              * when the page is dirted when doing the compression, it's
              * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
+             * and zlib won't break the data in other pages.  Streaming
+             * methods copy the page before compressing it, so for them
+             * a failure means that the stream is broken.
              */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+            ret = migration_decompress_buffer(param->comp, param->compbuf,
+                                              len, des, TARGET_PAGE_SIZE);
 
             qemu_mutex_lock(&decomp_done_lock);
+            if (stream && ret != TARGET_PAGE_SIZE) {
+                param->failed = true;
+            }
             param->done = true;
             qemu_cond_signal(&decomp_done_cond);
             qemu_mutex_unlock(&decomp_done_lock);
@@ -2522,12 +4459,12 @@ static void *do_data_decompress(void *opaque)
     return NULL;
 }
 
-static void wait_for_decompress_done(void)
+static int wait_for_decompress_done(void)
 {
-    int idx, thread_count;
+    int idx, thread_count, ret = 0;
 
     if (!migrate_use_compression()) {
-        return;
+        return 0;
     }
 
     thread_count = migrate_decompress_threads();
@@ -2536,18 +4473,29 @@ static void wait_for_decompress_done(void)
         while (!decomp_param[idx].done) {
             qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
         }
+        if (decomp_param[idx].failed) {
+            ret = -EIO;
+        }
     }
     qemu_mutex_unlock(&decomp_done_lock);
+
+    if (ret < 0) {
+        error_report("Failed to decompress page");
+    }
+    return ret;
 }
 
 static void compress_threads_load_setup(void)
 {
     int i, thread_count;
+    size_t compbuf_size;
 
     if (!migrate_use_compression()) {
         return;
     }
     thread_count = migrate_decompress_threads();
+    compbuf_size = migration_compress_bound(migrate_compress_method(),
+                                            TARGET_PAGE_SIZE);
     decompress_threads = g_new0(QemuThread, thread_count);
     decomp_param = g_new0(DecompressParam, thread_count);
     qemu_mutex_init(&decomp_done_lock);
@@ -2555,7 +4503,7 @@ static void compress_threads_load_setup(void)
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].compbuf = g_malloc0(compbuf_size);
         decomp_param[i].done = true;
         decomp_param[i].quit = false;
         qemu_thread_create(decompress_threads + i, "decompress",
@@ -2584,29 +4532,80 @@ static void compress_threads_load_cleanup(void)
         qemu_cond_destroy(&decomp_param[i].cond);
         g_free(decomp_param[i].compbuf);
     }
+    for (i = 0; i < MIGRATION_COMPRESS_MAX_STREAMS; i++) {
+        migration_compress_free(decomp_stream[i]);
+        decomp_stream[i] = NULL;
+    }
     g_free(decompress_threads);
     g_free(decomp_param);
     decompress_threads = NULL;
     decomp_param = NULL;
 }
 
-static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+/* Called with decomp_done_lock held and decomp_param[idx] done */
+static int decompress_start(QEMUFile *f, int idx, int ctx, void *host, int len)
 {
-    int idx, thread_count;
+    DecompressParam *param = &decomp_param[idx];
+    Error *local_err = NULL;
+
+    if (param->failed) {
+        return -EIO;
+    }
+    if (!decomp_stream[ctx]) {
+        decomp_stream[ctx] = migration_compress_new(migrate_compress_method(),
+                                                    0, true, &local_err);
+        if (!decomp_stream[ctx]) {
+            error_report_err(local_err);
+            return -EINVAL;
+        }
+    }
+
+    param->done = false;
+    qemu_mutex_lock(&param->mutex);
+    qemu_get_buffer(f, param->compbuf, len);
+    param->comp = decomp_stream[ctx];
+    param->des = host;
+    param->len = len;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+    return 0;
+}
+
+/**
+ * decompress_data_with_multi_threads: hand a compressed page to a thread
+ *
+ * Returns zero on success, negative on error.
+ *
+ * Pages of a streaming compression method always go to the same thread,
+ * so that they are decompressed in order; zlib pages are independent and
+ * go to whichever thread is idle.
+ *
+ * @f: QEMUFile where the compressed data is read from
+ * @host: destination page
+ * @len: length of the compressed data
+ * @stream: stream id of the page, or -1 for non streaming methods
+ */
+static int decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                              int len, int stream)
+{
+    int idx, thread_count, ret;
 
     thread_count = migrate_decompress_threads();
     qemu_mutex_lock(&decomp_done_lock);
+    if (stream >= 0) {
+        idx = stream % thread_count;
+        while (!decomp_param[idx].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+        ret = decompress_start(f, idx, stream, host, len);
+        qemu_mutex_unlock(&decomp_done_lock);
+        return ret;
+    }
+
     while (true) {
         for (idx = 0; idx < thread_count; idx++) {
             if (decomp_param[idx].done) {
-                decomp_param[idx].done = false;
-                qemu_mutex_lock(&decomp_param[idx].mutex);
-                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                qemu_cond_signal(&decomp_param[idx].cond);
-                qemu_mutex_unlock(&decomp_param[idx].mutex);
+                ret = decompress_start(f, idx, idx, host, len);
                 break;
             }
         }
@@ -2617,6 +4616,7 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
         }
     }
     qemu_mutex_unlock(&decomp_done_lock);
+    return ret;
 }
 
 /**
@@ -2666,6 +4666,150 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
     return postcopy_ram_incoming_init(mis, ram_pages);
 }
 
+typedef struct MappedRamLoad {
+    QemuThread thread;
+    QEMUFile *f;
+    /* Descriptor opened with O_DIRECT, or -1 */
+    int direct_fd;
+    RAMBlock *block;
+    unsigned long *bmap;
+    uint64_t pages_offset;
+    /* Range of pages to load */
+    unsigned long start;
+    unsigned long end;
+    int ret;
+} MappedRamLoad;
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoad *load = opaque;
+    unsigned long page = load->start, next;
+    uint8_t *host;
+    int64_t pos;
+    size_t len;
+    ssize_t ret;
+
+    while (page < load->end) {
+        host = load->block->host + ((ram_addr_t)page << TARGET_PAGE_BITS);
+        if (!test_bit(page, load->bmap)) {
+            /* Zero pages are not in the file */
+            next = find_next_bit(load->bmap, load->end, page);
+            ram_handle_compressed(host, 0,
+                                  (ram_addr_t)(next - page) << TARGET_PAGE_BITS);
+            page = next;
+            continue;
+        }
+
+        next = find_next_zero_bit(load->bmap, load->end, page);
+        next = MIN(next, page + MAPPED_RAM_LOAD_CHUNK);
+        len = (size_t)(next - page) << TARGET_PAGE_BITS;
+        pos = load->pages_offset + ((uint64_t)page << TARGET_PAGE_BITS);
+
+        ret = -1;
+        if (load->direct_fd >= 0) {
+            /* Fails if the file system wants more alignment than pages */
+            ret = pread(load->direct_fd, host, len, pos);
+        }
+        if (ret != len) {
+            ret = qemu_get_buffer_at(load->f, host, len, pos);
+        }
+        if (ret != len) {
+            load->ret = ret < 0 ? ret : -EIO;
+            break;
+        }
+        page = next;
+    }
+
+    return NULL;
+}
+
+/**
+ * mapped_ram_load_block: load a RAMBlock stored by mapped-ram
+ *
+ * Returns 0 for success or -errno in case of error
+ *
+ * Reads the offsets that follow the block in the stream, then the pages
+ * of the block with several threads, and moves the stream past them.
+ *
+ * @f: QEMUFile where to receive the data
+ * @block: RAMBlock to load, already resized to the source's size
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = BITS_TO_LONGS(pages) * sizeof(unsigned long);
+    uint64_t page_size, bitmap_offset, pages_offset;
+    MappedRamLoad *load;
+    unsigned long *le, *bmap;
+    unsigned long per_thread;
+    int i, nthreads, ret = 0;
+    ssize_t len;
+
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    if (!qemu_file_is_seekable(f)) {
+        error_report("mapped-ram needs a migration from a file");
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped-ram page size %s %" PRIu64
+                     " != %d", block->idstr, page_size, TARGET_PAGE_SIZE);
+        return -EINVAL;
+    }
+    trace_mapped_ram_load_block(block->idstr, bitmap_offset, pages_offset);
+
+    le = g_malloc(bitmap_size);
+    bmap = bitmap_new(pages);
+    len = qemu_get_buffer_at(f, (uint8_t *)le, bitmap_size, bitmap_offset);
+    if (len != bitmap_size) {
+        error_report("Failed to read the page bitmap of %s", block->idstr);
+        ret = len < 0 ? len : -EIO;
+        goto out;
+    }
+    bitmap_from_le(bmap, le, pages);
+
+    nthreads = MIN(MAPPED_RAM_LOAD_THREADS,
+                   DIV_ROUND_UP(pages, MAPPED_RAM_LOAD_CHUNK));
+    per_thread = nthreads ? DIV_ROUND_UP(pages, nthreads) : 0;
+    load = g_new0(MappedRamLoad, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        load[i].f = f;
+        load[i].direct_fd = mis->file_direct_ioc ?
+                            QIO_CHANNEL_FILE(mis->file_direct_ioc)->fd : -1;
+        load[i].block = block;
+        load[i].bmap = bmap;
+        load[i].pages_offset = pages_offset;
+        load[i].start = i * per_thread;
+        load[i].end = MIN(pages, (i + 1) * per_thread);
+        qemu_thread_create(&load[i].thread, "mapped-ram-load",
+                           mapped_ram_load_thread, &load[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&load[i].thread);
+        if (load[i].ret && !ret) {
+            error_report("Failed to read the pages of %s: %s",
+                         block->idstr, strerror(-load[i].ret));
+            ret = load[i].ret;
+        }
+    }
+    g_free(load);
+
+    if (!ret) {
+        ret = qemu_set_offset(f, pages_offset + block->used_length);
+    }
+
+out:
+    g_free(bmap);
+    g_free(le);
+    return ret;
+}
+
 /**
  * ram_load_postcopy: load a page in postcopy case
  *
@@ -2682,8 +4826,10 @@ static int ram_load_postcopy(QEMUFile *f)
     bool place_needed = false;
     bool matching_page_sizes = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
+    /* Hand the pages to placement threads rather than placing them here */
+    bool threaded = mis->place_thread_count > 0;
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+    void *postcopy_host_page = threaded ? NULL : postcopy_get_tmp_page(mis);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -2721,11 +4867,12 @@ static int ram_load_postcopy(QEMUFile *f)
              * however the source ensures it always sends all the components
              * of a host page in order.
              */
-            page_buffer = postcopy_host_page +
-                          ((uintptr_t)host & (block->page_size - 1));
             /* If all TP are zero then we can optimise the place */
             if (!((uintptr_t)host & (block->page_size - 1))) {
                 all_zero = true;
+                if (threaded) {
+                    postcopy_host_page = postcopy_place_get_tmp_page(mis);
+                }
             } else {
                 /* not the 1st TP within the HP */
                 if (host != (last_host + TARGET_PAGE_SIZE)) {
@@ -2735,7 +4882,8 @@ static int ram_load_postcopy(QEMUFile *f)
                     break;
                 }
             }
-
+            page_buffer = postcopy_host_page +
+                          ((uintptr_t)host & (block->page_size - 1));
 
             /*
              * If it's the last part of a host page then we place the host
@@ -2758,12 +4906,13 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_PAGE:
             all_zero = false;
-            if (!place_needed || !matching_page_sizes) {
+            if (!place_needed || !matching_page_sizes || threaded) {
                 qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
             } else {
                 /* Avoids the qemu_file copy during postcopy, which is
                  * going to do a copy later; can only do it when we
-                 * do this read in one go (matching page sizes)
+                 * do this read in one go (matching page sizes), and
+                 * place the page before reading on
                  */
                 qemu_get_buffer_in_place(f, (uint8_t **)&place_source,
                                          TARGET_PAGE_SIZE);
@@ -2782,7 +4931,10 @@ static int ram_load_postcopy(QEMUFile *f)
             /* This gets called at the last target page in the host page */
             void *place_dest = host + TARGET_PAGE_SIZE - block->page_size;
 
-            if (all_zero) {
+            if (threaded) {
+                ret = postcopy_place_page_async(mis, place_dest, all_zero,
+                                                block);
+            } else if (all_zero) {
                 ret = postcopy_place_page_zero(mis, place_dest,
                                                block);
             } else {
@@ -2795,6 +4947,15 @@ static int ram_load_postcopy(QEMUFile *f)
         }
     }
 
+    if (threaded) {
+        /* The rest of the stream may depend on these pages being placed */
+        int place_ret = postcopy_place_wait(mis);
+
+        if (!ret) {
+            ret = place_ret;
+        }
+    }
+
     return ret;
 }
 
@@ -2814,7 +4975,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0, invalid_flags = 0;
     static uint64_t seq_iter;
-    int len = 0;
+    int len = 0, stream;
+    MigrationCompressMethod method;
     /*
      * If system is running in postcopy mode, page inserts to host memory must
      * be atomic
@@ -2912,6 +5074,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_block(f, block);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -2934,13 +5099,19 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             break;
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            method = migrate_compress_method();
+            stream = -1;
+            if (migration_compress_method_is_stream(method)) {
+                stream = qemu_get_byte(f);
+            }
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 ||
+                len > migration_compress_bound(method, TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            decompress_data_with_multi_threads(f, host, len);
+            ret = decompress_data_with_multi_threads(f, host, len, stream);
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
@@ -2953,6 +5124,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
+            ret = multifd_recv_sync_main();
             break;
         default:
             if (flags & RAM_SAVE_FLAG_HOOK) {
@@ -2968,7 +5140,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
-    wait_for_decompress_done();
+    if (wait_for_decompress_done() < 0 && !ret) {
+        ret = -EIO;
+    }
     rcu_read_unlock();
     trace_ram_load_complete(ret, seq_iter);
     return ret;
@@ -2995,5 +5169,6 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&dirty_rate.lock);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, &ram_state);
 }
@@ -31,6 +31,7 @@
 
 #include "qemu-common.h"
 #include "exec/cpu-common.h"
+#include "io/channel.h"
 
 extern MigrationStats ram_counters;
 extern XBZRLECacheStats xbzrle_counters;
@@ -41,10 +42,17 @@ uint64_t ram_bytes_total(void);
 
 int multifd_save_setup(void);
 int multifd_save_cleanup(Error **errp);
+MultiFDChannelStatsList *multifd_query_stats(void);
 int multifd_load_setup(void);
 int multifd_load_cleanup(Error **errp);
+bool multifd_recv_all_channels_created(void);
+bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 
 uint64_t ram_pagesize_summary(void);
+bool ram_dirty_rate_measuring(void);
+bool ram_write_tracking_available(Error **errp);
+int ram_write_tracking_start(Error **errp);
+void ram_write_tracking_stop(void);
 int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len);
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected,
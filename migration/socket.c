@@ -27,6 +27,45 @@
 #include "trace.h"
 
 
+static struct SocketOutgoingArgs {
+    SocketAddress *saddr;
+} outgoing_args;
+
+/**
+ * socket_send_channel_create_sync: open an extra outgoing channel
+ *
+ * Connects synchronously to the address used by the main migration
+ * channel.  Used by the multifd send threads, so the caller is never
+ * the main loop.
+ *
+ * Returns the new channel or NULL on error
+ *
+ * @errp: set *errp on error
+ */
+QIOChannel *socket_send_channel_create_sync(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_args.saddr) {
+        error_setg(errp, "Initial socket address not set");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    qio_channel_set_name(QIO_CHANNEL(sioc), "migration-multifd-outgoing");
+    if (qio_channel_socket_connect_sync(sioc, outgoing_args.saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    return QIO_CHANNEL(sioc);
+}
+
+void socket_send_channel_destroy(QIOChannel *send)
+{
+    qio_channel_close(send, NULL);
+    object_unref(OBJECT(send));
+}
+
 static SocketAddress *tcp_build_address(const char *host_port, Error **errp)
 {
     SocketAddress *saddr;
@@ -106,7 +145,9 @@ static void socket_start_outgoing_migration(MigrationState *s,
                                      socket_outgoing_migration,
                                      data,
                                      socket_connect_data_free);
-    qapi_free_SocketAddress(saddr);
+    /* Keep the address around, multifd channels connect to it too */
+    qapi_free_SocketAddress(outgoing_args.saddr);
+    outgoing_args.saddr = saddr;
 }
 
 void tcp_start_outgoing_migration(MigrationState *s,
@@ -18,4 +18,12 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/*
+ * Testing support: switch xbzrle_encode_buffer() to the next, less
+ * preferred, accelerated implementation, as test_buffer_is_zero_next_accel()
+ * does.  Returns false once the plain integer version is in use.
+ */
+bool test_xbzrle_encode_next_accel(void);
+const char *test_xbzrle_encode_accel_name(void);
 #endif
@@ -19,9 +19,17 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "block/block_int.h"
 #include "trace.h"
 #include "nbd-internal.h"
 
+#define NBD_META_ID_BASE_ALLOCATION 0
+#define NBD_META_ID_DIRTY_BITMAP 1
+
+/* Maximum length of a meta context query that we accept; longer queries
+ * cannot match any of our contexts anyway */
+#define NBD_MAX_META_QUERY_SIZE 4096
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -78,10 +86,34 @@ struct NBDExport {
 
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
+
+    /* Exports of the same image in other AioContexts; clients asking for
+     * this export are spread across it and its replicas */
+    GPtrArray *replicas;
+
+    /* Set once the image failed to send data with blk_co_sendfile() */
+    bool sendfile_unsupported;
+
+    /* Dirty bitmap exported as the qemu:dirty-bitmap:<name> meta context,
+     * owned by export_bitmap_bs, which we hold a reference to */
+    BdrvDirtyBitmap *export_bitmap;
+    BlockDriverState *export_bitmap_bs;
+    char *export_bitmap_context;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
 
+/* NBDExportMetaContexts represents a list of contexts to be exported,
+ * as selected by NBD_OPT_SET_META_CONTEXT. Also used for
+ * NBD_OPT_LIST_META_CONTEXT. */
+typedef struct NBDExportMetaContexts {
+    char export_name[NBD_MAX_NAME_SIZE + 1];
+    bool valid; /* means that negotiation of the option finished without
+                   errors */
+    bool base_allocation; /* export base:allocation context (block status) */
+    bool bitmap; /* export qemu:dirty-bitmap:<export bitmap name> */
+} NBDExportMetaContexts;
+
 struct NBDClient {
     int refcount;
     void (*close_fn)(NBDClient *client, bool negotiated);
@@ -102,6 +134,7 @@ struct NBDClient {
     bool closing;
 
     bool structured_reply;
+    NBDExportMetaContexts export_meta;
 };
 
 /* That's all folks */
@@ -269,6 +302,60 @@ static int nbd_negotiate_handle_list(NBDClient *client, Error **errp)
     return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, NBD_OPT_LIST, errp);
 }
 
+/* Return the export among @exp and its replicas that serves the fewest
+ * clients. */
+static NBDExport *nbd_export_pick(NBDExport *exp)
+{
+    NBDExport *best = exp;
+    unsigned int best_clients = UINT_MAX;
+    unsigned int i;
+
+    for (i = 0; i <= (exp->replicas ? exp->replicas->len : 0); i++) {
+        NBDExport *e = i ? g_ptr_array_index(exp->replicas, i - 1) : exp;
+        unsigned int nb_clients = 0;
+        NBDClient *client;
+
+        aio_context_acquire(e->ctx);
+        QTAILQ_FOREACH(client, &e->clients, next) {
+            nb_clients++;
+        }
+        aio_context_release(e->ctx);
+
+        if (nb_clients < best_clients) {
+            best = e;
+            best_clients = nb_clients;
+        }
+    }
+
+    trace_nbd_export_pick(exp->name ? exp->name : "", best, best_clients);
+    return best;
+}
+
+/* Bind @client to @exp, or to one of its replicas.  Called from the main
+ * loop; the replicas may be served by other threads, which only touch the
+ * list of clients and the reference counts with their AioContext held. */
+static void nbd_client_attach_export(NBDClient *client, NBDExport *exp)
+{
+    exp = nbd_export_pick(exp);
+
+    aio_context_acquire(exp->ctx);
+    client->exp = exp;
+    QTAILQ_INSERT_TAIL(&exp->clients, client, next);
+    nbd_export_get(exp);
+    aio_context_release(exp->ctx);
+}
+
+/* Forget the meta contexts selected by NBD_OPT_SET_META_CONTEXT if they
+ * were negotiated for another export than @name, the one the client
+ * picked. */
+static void nbd_check_meta_export(NBDClient *client, const char *name)
+{
+    if (client->export_meta.valid &&
+        strcmp(name, client->export_meta.export_name)) {
+        client->export_meta.valid = false;
+    }
+}
+
 /* Send a reply to NBD_OPT_EXPORT_NAME.
  * Return -errno on error, 0 on success. */
 static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length,
@@ -277,6 +364,7 @@ static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length,
 {
     char name[NBD_MAX_NAME_SIZE + 1];
     char buf[NBD_REPLY_EXPORT_NAME_SIZE] = "";
+    NBDExport *exp;
     size_t len;
     int ret;
 
@@ -300,16 +388,16 @@ static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length,
 
     trace_nbd_negotiate_handle_export_name_request(name);
 
-    client->exp = nbd_export_find(name);
-    if (!client->exp) {
+    exp = nbd_export_find(name);
+    if (!exp) {
         error_setg(errp, "export not found");
         return -EINVAL;
     }
 
-    trace_nbd_negotiate_new_style_size_flags(client->exp->size,
-                                             client->exp->nbdflags | myflags);
-    stq_be_p(buf, client->exp->size);
-    stw_be_p(buf + 8, client->exp->nbdflags | myflags);
+    trace_nbd_negotiate_new_style_size_flags(exp->size,
+                                             exp->nbdflags | myflags);
+    stq_be_p(buf, exp->size);
+    stw_be_p(buf + 8, exp->nbdflags | myflags);
     len = no_zeroes ? 10 : sizeof(buf);
     ret = nbd_write(client->ioc, buf, len, errp);
     if (ret < 0) {
@@ -317,8 +405,8 @@ static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length,
         return ret;
     }
 
-    QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-    nbd_export_get(client->exp);
+    nbd_client_attach_export(client, exp);
+    nbd_check_meta_export(client, name);
 
     return 0;
 }
@@ -508,9 +596,8 @@ static int nbd_negotiate_handle_info(NBDClient *client, uint32_t length,
     }
 
     if (opt == NBD_OPT_GO) {
-        client->exp = exp;
-        QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-        nbd_export_get(client->exp);
+        nbd_client_attach_export(client, exp);
+        nbd_check_meta_export(client, name);
         rc = 1;
     }
     return rc;
@@ -524,6 +611,218 @@ static int nbd_negotiate_handle_info(NBDClient *client, uint32_t length,
 }
 
 
+/* Send a single NBD_REP_META_CONTEXT reply for @context.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_send_meta_context(NBDClient *client, uint32_t opt,
+                                           const char *context,
+                                           uint32_t context_id,
+                                           Error **errp)
+{
+    size_t len = strlen(context);
+    int rc;
+
+    /* The context ID is meaningless for NBD_OPT_LIST_META_CONTEXT */
+    if (opt == NBD_OPT_LIST_META_CONTEXT) {
+        context_id = 0;
+    }
+
+    trace_nbd_negotiate_meta_context(nbd_opt_lookup(opt), context,
+                                     context_id);
+    rc = nbd_negotiate_send_rep_len(client->ioc, NBD_REP_META_CONTEXT, opt,
+                                    sizeof(context_id) + len, errp);
+    if (rc < 0) {
+        return rc;
+    }
+    cpu_to_be32s(&context_id);
+    if (nbd_write(client->ioc, &context_id, sizeof(context_id), errp) < 0) {
+        return -EIO;
+    }
+    if (nbd_write(client->ioc, context, len, errp) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Select the contexts of @exp that match @query in @meta.  Leaf names may
+ * only be omitted for NBD_OPT_LIST_META_CONTEXT, where they select all
+ * contexts of a namespace. */
+static void nbd_meta_query_match(NBDExport *exp, const char *query, bool list,
+                                 NBDExportMetaContexts *meta)
+{
+    if (!strcmp(query, "base:allocation") ||
+        (list && !strcmp(query, "base:"))) {
+        meta->base_allocation = true;
+    }
+
+    if (exp->export_bitmap_context &&
+        (!strcmp(query, exp->export_bitmap_context) ||
+         (list && (!strcmp(query, "qemu:") ||
+                   !strcmp(query, "qemu:dirty-bitmap:"))))) {
+        meta->bitmap = true;
+    }
+
+    trace_nbd_negotiate_meta_query(query, meta->base_allocation,
+                                   meta->bitmap);
+}
+
+/* Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.
+ * Return -errno on error, 0 if ready for next option.  */
+static int nbd_negotiate_meta_queries(NBDClient *client, uint32_t length,
+                                      uint32_t opt, Error **errp)
+{
+    NBDExportMetaContexts meta = { .valid = false };
+    NBDExport *exp;
+    bool list = opt == NBD_OPT_LIST_META_CONTEXT;
+    uint32_t namelen, nb_queries, i;
+    const char *msg;
+    int ret;
+
+    /* Client sends:
+        4 bytes: L, name length (can be 0)
+        L bytes: export name
+        4 bytes: N, number of queries (can be 0)
+        N times:
+            4 bytes: Q, query length
+            Q bytes: query
+    */
+    if (!list) {
+        /* A failed NBD_OPT_SET_META_CONTEXT leaves no contexts selected */
+        client->export_meta.valid = false;
+    }
+
+    if (!client->structured_reply) {
+        if (nbd_drop(client->ioc, length, errp) < 0) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                          opt, errp,
+                                          "structured replies not negotiated");
+    }
+
+    if (length < sizeof(namelen) + sizeof(nb_queries)) {
+        msg = "overall request too short";
+        goto invalid;
+    }
+    if (nbd_read(client->ioc, &namelen, sizeof(namelen), errp) < 0) {
+        return -EIO;
+    }
+    be32_to_cpus(&namelen);
+    length -= sizeof(namelen);
+    if (namelen > length - sizeof(nb_queries)) {
+        msg = "name length is incorrect";
+        goto invalid;
+    }
+    if (namelen >= sizeof(meta.export_name)) {
+        msg = "name too long for qemu";
+        goto invalid;
+    }
+    if (nbd_read(client->ioc, meta.export_name, namelen, errp) < 0) {
+        return -EIO;
+    }
+    meta.export_name[namelen] = '\0';
+    length -= namelen;
+    trace_nbd_negotiate_handle_export_name_request(meta.export_name);
+
+    exp = nbd_export_find(meta.export_name);
+    if (!exp) {
+        if (nbd_drop(client->ioc, length, errp) < 0) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_UNKNOWN,
+                                          opt, errp, "export '%s' not present",
+                                          meta.export_name);
+    }
+
+    if (nbd_read(client->ioc, &nb_queries, sizeof(nb_queries), errp) < 0) {
+        return -EIO;
+    }
+    be32_to_cpus(&nb_queries);
+    length -= sizeof(nb_queries);
+    trace_nbd_negotiate_meta_queries(nbd_opt_lookup(opt), nb_queries);
+
+    if (list && !nb_queries) {
+        /* List all contexts */
+        meta.base_allocation = true;
+        meta.bitmap = !!exp->export_bitmap;
+    }
+
+    for (i = 0; i < nb_queries; i++) {
+        uint32_t querylen;
+        char *query;
+
+        if (length < sizeof(querylen)) {
+            msg = "query length is incorrect";
+            goto invalid;
+        }
+        if (nbd_read(client->ioc, &querylen, sizeof(querylen), errp) < 0) {
+            return -EIO;
+        }
+        be32_to_cpus(&querylen);
+        length -= sizeof(querylen);
+        if (querylen > length) {
+            msg = "query length is incorrect";
+            goto invalid;
+        }
+        if (querylen > NBD_MAX_META_QUERY_SIZE) {
+            /* Cannot match anything, skip it */
+            if (nbd_drop(client->ioc, querylen, errp) < 0) {
+                return -EIO;
+            }
+            length -= querylen;
+            continue;
+        }
+
+        query = g_malloc(querylen + 1);
+        if (nbd_read(client->ioc, query, querylen, errp) < 0) {
+            g_free(query);
+            return -EIO;
+        }
+        query[querylen] = '\0';
+        length -= querylen;
+
+        nbd_meta_query_match(exp, query, list, &meta);
+        g_free(query);
+    }
+
+    if (length) {
+        msg = "unexpected data after the queries";
+        goto invalid;
+    }
+
+    if (meta.base_allocation) {
+        ret = nbd_negotiate_send_meta_context(client, opt, "base:allocation",
+                                              NBD_META_ID_BASE_ALLOCATION,
+                                              errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (meta.bitmap) {
+        ret = nbd_negotiate_send_meta_context(client, opt,
+                                              exp->export_bitmap_context,
+                                              NBD_META_ID_DIRTY_BITMAP,
+                                              errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt, errp);
+    if (ret == 0 && !list) {
+        meta.valid = true;
+        client->export_meta = meta;
+    }
+    return ret;
+
+ invalid:
+    if (nbd_drop(client->ioc, length, errp) < 0) {
+        return -EIO;
+    }
+    return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID, opt,
+                                      errp, "%s", msg);
+}
+
 /* Handle NBD_OPT_STARTTLS. Return NULL to drop connection, or else the
  * new channel for all further (now-encrypted) communication. */
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
@@ -799,6 +1098,11 @@ static int nbd_negotiate_options(NBDClient *client, uint16_t myflags,
                 }
                 break;
 
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_meta_queries(client, length, option, errp);
+                break;
+
             default:
                 if (nbd_drop(client->ioc, length, errp) < 0) {
                     return -EIO;
@@ -845,9 +1149,16 @@ static coroutine_fn int nbd_negotiate(NBDClient *client, Error **errp)
 {
     char buf[NBD_OLDSTYLE_NEGOTIATE_SIZE] = "";
     int ret;
+    /* NBD_FLAG_CAN_MULTI_CONN requires that a flush on any connection
+     * covers the writes completed on all of them.  This holds for writable
+     * exports too: every connection to an export goes through its single
+     * BlockBackend, and blk_co_flush() flushes all writes completed on the
+     * node.  Only read-only exports get replicas with a BlockBackend of
+     * their own. */
     const uint16_t myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
                               NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
-                              NBD_FLAG_SEND_WRITE_ZEROES);
+                              NBD_FLAG_SEND_WRITE_ZEROES |
+                              NBD_FLAG_CAN_MULTI_CONN);
     bool oldStyle;
 
     /* Old style negotiation header, no room for options
@@ -1060,9 +1371,9 @@ static void nbd_eject_notifier(Notifier *n, void *data)
 }
 
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
-                          uint16_t nbdflags, void (*close)(NBDExport *),
-                          bool writethrough, BlockBackend *on_eject_blk,
-                          Error **errp)
+                          const char *bitmap, uint16_t nbdflags,
+                          void (*close)(NBDExport *), bool writethrough,
+                          BlockBackend *on_eject_blk, Error **errp)
 {
     AioContext *ctx;
     BlockBackend *blk;
@@ -1107,6 +1418,41 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
     }
     exp->size -= exp->size % BDRV_SECTOR_SIZE;
 
+    if (bitmap) {
+        BdrvDirtyBitmap *bm = NULL;
+        BlockDriverState *bm_bs = bs;
+
+        while (bm_bs) {
+            bm = bdrv_find_dirty_bitmap(bm_bs, bitmap);
+            if (bm) {
+                break;
+            }
+            bm_bs = backing_bs(bm_bs);
+        }
+
+        if (!bm) {
+            error_setg(errp, "Bitmap '%s' is not found", bitmap);
+            goto fail;
+        }
+
+        if (bdrv_dirty_bitmap_frozen(bm)) {
+            error_setg(errp, "Bitmap '%s' is frozen", bitmap);
+            goto fail;
+        }
+
+        if (bdrv_dirty_bitmap_qmp_locked(bm)) {
+            error_setg(errp, "Bitmap '%s' is locked", bitmap);
+            goto fail;
+        }
+
+        bdrv_dirty_bitmap_set_qmp_locked(bm, true);
+        bdrv_ref(bm_bs);
+        exp->export_bitmap = bm;
+        exp->export_bitmap_bs = bm_bs;
+        exp->export_bitmap_context =
+            g_strdup_printf("qemu:dirty-bitmap:%s", bitmap);
+    }
+
     exp->close = close;
     exp->ctx = blk_get_aio_context(blk);
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
@@ -1167,11 +1513,19 @@ void nbd_export_set_description(NBDExport *exp, const char *description)
 void nbd_export_close(NBDExport *exp)
 {
     NBDClient *client, *next;
+    unsigned int i;
 
     nbd_export_get(exp);
     QTAILQ_FOREACH_SAFE(client, &exp->clients, next, next) {
         client_close(client, true);
     }
+    for (i = 0; exp->replicas && i < exp->replicas->len; i++) {
+        NBDExport *replica = g_ptr_array_index(exp->replicas, i);
+
+        aio_context_acquire(replica->ctx);
+        nbd_export_close(replica);
+        aio_context_release(replica->ctx);
+    }
     nbd_export_set_name(exp, NULL);
     nbd_export_set_description(exp, NULL);
     nbd_export_put(exp);
@@ -1209,10 +1563,53 @@ void nbd_export_put(NBDExport *exp)
             exp->blk = NULL;
         }
 
+        if (exp->export_bitmap) {
+            bdrv_dirty_bitmap_set_qmp_locked(exp->export_bitmap, false);
+            bdrv_unref(exp->export_bitmap_bs);
+            g_free(exp->export_bitmap_context);
+        }
+
+        if (exp->replicas) {
+            unsigned int i;
+
+            for (i = 0; i < exp->replicas->len; i++) {
+                NBDExport *replica = g_ptr_array_index(exp->replicas, i);
+                AioContext *ctx = replica->ctx;
+
+                aio_context_acquire(ctx);
+                nbd_export_put(replica);
+                aio_context_release(ctx);
+            }
+            g_ptr_array_free(exp->replicas, true);
+        }
+
         g_free(exp);
     }
 }
 
+/* Let @replica, an export of the same image (e.g. opened once more in
+ * another AioContext), serve some of the clients that ask for @exp. */
+void nbd_export_add_replica(NBDExport *exp, NBDExport *replica)
+{
+    assert(!replica->replicas);
+    assert(exp->size == replica->size);
+    assert((exp->nbdflags & NBD_FLAG_READ_ONLY) &&
+           (replica->nbdflags & NBD_FLAG_READ_ONLY));
+
+    if (!exp->replicas) {
+        exp->replicas = g_ptr_array_new();
+    }
+    nbd_export_get(replica);
+    g_ptr_array_add(exp->replicas, replica);
+}
+
+/* Whether @exp still has clients, including ones that are disconnecting.
+ * Called with the AioContext of @exp held. */
+bool nbd_export_has_clients(NBDExport *exp)
+{
+    return !QTAILQ_EMPTY(&exp->clients);
+}
+
 BlockBackend *nbd_export_get_blockdev(NBDExport *exp)
 {
     return exp->blk;
@@ -1303,6 +1700,7 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                                                     uint64_t offset,
                                                     void *data,
                                                     size_t size,
+                                                    bool final,
                                                     Error **errp)
 {
     NBDStructuredReadData chunk;
@@ -1313,7 +1711,8 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
 
     assert(size);
     trace_nbd_co_send_structured_read(handle, offset, data, size);
-    set_be_chunk(&chunk.h, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_OFFSET_DATA,
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA,
                  handle, sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
@@ -1344,6 +1743,372 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1 + !!iov[1].iov_len, errp);
 }
 
+static int coroutine_fn nbd_co_send_structured_hole(NBDClient *client,
+                                                    uint64_t handle,
+                                                    uint64_t offset,
+                                                    uint32_t size,
+                                                    bool final,
+                                                    Error **errp)
+{
+    NBDStructuredReadHole chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+
+    trace_nbd_co_send_structured_hole(handle, offset, size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_HOLE,
+                 handle, sizeof(chunk) - sizeof(chunk.h));
+    stq_be_p(&chunk.offset, offset);
+    stl_be_p(&chunk.length, size);
+
+    return nbd_co_send_iov(client, iov, 1, errp);
+}
+
+/* Send an NBD_REPLY_TYPE_OFFSET_DATA chunk whose payload goes from the image
+ * straight to the socket, without passing through a bounce buffer.
+ * Return -ENOTSUP if nothing was sent and the caller should read the data
+ * itself, 0 on success, and -EIO if the connection must be dropped. */
+static int coroutine_fn nbd_co_send_read_zerocopy(NBDClient *client,
+                                                  uint64_t handle,
+                                                  uint64_t offset,
+                                                  uint32_t size,
+                                                  bool final,
+                                                  Error **errp)
+{
+    NBDExport *exp = client->exp;
+    NBDStructuredReadData chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+    void *buf = NULL;
+    uint32_t done = 0;
+    int ret = 0;
+
+    /* TLS needs the data in userspace */
+    if (client->ioc != QIO_CHANNEL(client->sioc) ||
+        atomic_read(&exp->sendfile_unsupported)) {
+        return -ENOTSUP;
+    }
+
+    trace_nbd_co_send_read_zerocopy(handle, offset, size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA,
+                 handle, sizeof(chunk) - sizeof(chunk.h) + size);
+    stq_be_p(&chunk.offset, offset);
+
+    /* The header and the payload must not be separated by other replies */
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    if (qio_channel_writev_all(client->ioc, iov, 1, errp) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    /* sendfile never waits for the socket, so that a client that stops
+     * reading does not pin thread pool workers or block drain; wait for
+     * the socket here, with no request in flight */
+    while (done < size) {
+        ret = blk_co_sendfile(exp->blk, offset + exp->dev_offset + done,
+                              size - done, client->sioc->fd);
+        if (ret == -EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        }
+        if (ret < 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    if (ret == -ENOTSUP) {
+        /* Don't try again for this export.  The header is out already, so
+         * from here on a read error can only be reported by disconnecting */
+        atomic_set(&exp->sendfile_unsupported, true);
+        buf = blk_try_blockalign(exp->blk, size - done);
+        ret = buf ? blk_pread(exp->blk, offset + exp->dev_offset + done, buf,
+                              size - done)
+                  : -ENOMEM;
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "reading from file failed");
+        } else if (qio_channel_write_all(client->ioc, buf, size - done,
+                                         errp) < 0) {
+            ret = -EIO;
+        }
+    } else if (ret < 0) {
+        error_setg_errno(errp, -ret, "sending data from file failed");
+    }
+    ret = ret < 0 ? -EIO : 0;
+
+out:
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+    qemu_vfree(buf);
+    return ret;
+}
+
+/* Reply to a structured read of [offset, offset + size) with a chunk per
+ * extent: NBD_REPLY_TYPE_OFFSET_HOLE for ranges that read as zeroes, and
+ * NBD_REPLY_TYPE_OFFSET_DATA for the rest.  Errors reading the image are
+ * sent to the client.  Return -errno if the connection must be dropped,
+ * 0 otherwise. */
+static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
+                                                NBDRequestData *req,
+                                                uint64_t handle,
+                                                uint64_t offset,
+                                                uint32_t size,
+                                                Error **errp)
+{
+    NBDExport *exp = client->exp;
+    uint32_t progress = 0;
+    int ret = 0;
+
+    while (progress < size) {
+        int64_t pnum;
+        uint64_t chunk_offset = offset + progress;
+        int status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
+                                             chunk_offset + exp->dev_offset,
+                                             size - progress, &pnum, NULL,
+                                             NULL);
+        bool final;
+
+        if (status < 0) {
+            char *msg = g_strdup_printf("unable to check for holes: %s",
+                                        strerror(-status));
+
+            ret = nbd_co_send_structured_error(client, handle, -status, msg,
+                                               errp);
+            g_free(msg);
+            return ret;
+        }
+        assert(pnum && pnum <= size - progress);
+        final = progress + pnum == size;
+
+        if (status & BDRV_BLOCK_ZERO) {
+            ret = nbd_co_send_structured_hole(client, handle, chunk_offset,
+                                              pnum, final, errp);
+        } else {
+            ret = nbd_co_send_read_zerocopy(client, handle, chunk_offset,
+                                            pnum, final, errp);
+            if (ret == -ENOTSUP) {
+                if (!req->data) {
+                    req->data = blk_try_blockalign(exp->blk, size);
+                    if (!req->data) {
+                        return nbd_co_send_structured_error(
+                            client, handle, ENOMEM, "No memory", errp);
+                    }
+                }
+                ret = blk_pread(exp->blk, chunk_offset + exp->dev_offset,
+                                req->data, pnum);
+                if (ret < 0) {
+                    return nbd_co_send_structured_error(
+                        client, handle, -ret, "reading from file failed",
+                        errp);
+                }
+                ret = nbd_co_send_structured_read(client, handle,
+                                                  chunk_offset, req->data,
+                                                  pnum, final, errp);
+            }
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+        progress += pnum;
+    }
+
+    return 0;
+}
+
+/* Append an extent to @extents, merging it into the last one if the flags
+ * match.  Return false if @extents already holds @max extents and the new
+ * one could not be merged. */
+static bool nbd_extent_array_add(GArray *extents, uint32_t length,
+                                 uint32_t flags, unsigned int max)
+{
+    NBDExtent *last;
+    NBDExtent ext = { .length = length, .flags = flags };
+
+    if (extents->len) {
+        last = &g_array_index(extents, NBDExtent, extents->len - 1);
+        if (last->flags == flags &&
+            (uint64_t)last->length + length <= UINT32_MAX) {
+            last->length += length;
+            return true;
+        }
+    }
+
+    if (extents->len >= max) {
+        return false;
+    }
+    g_array_append_val(extents, ext);
+    return true;
+}
+
+/* Fill @extents with the allocation status of [@offset, @offset + @bytes)
+ * for the base:allocation context.  Return -errno on error, 0 on success. */
+static int blockstatus_to_extents(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t bytes, GArray *extents,
+                                  unsigned int max)
+{
+    while (bytes) {
+        uint32_t flags;
+        int64_t num;
+        int ret = bdrv_block_status_above(bs, NULL, offset, bytes, &num,
+                                          NULL, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+        if (num == 0) {
+            break;
+        }
+
+        flags = (ret & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (ret & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        if (!nbd_extent_array_add(extents, num, flags, max)) {
+            break;
+        }
+
+        offset += num;
+        bytes -= num;
+    }
+
+    return 0;
+}
+
+/* Fill @extents with the dirty status of [@offset, @offset + @bytes) in
+ * @bitmap for the qemu:dirty-bitmap context. */
+static void bitmap_to_extents(BdrvDirtyBitmap *bitmap, uint64_t offset,
+                              uint64_t bytes, GArray *extents,
+                              unsigned int max)
+{
+    uint64_t begin = offset, end = offset + bytes;
+
+    bdrv_dirty_bitmap_lock(bitmap);
+
+    while (begin < end) {
+        uint64_t dirty_start = begin, dirty_bytes = end - begin;
+
+        if (!bdrv_dirty_bitmap_next_dirty_area(bitmap, &dirty_start,
+                                               &dirty_bytes)) {
+            nbd_extent_array_add(extents, end - begin, 0, max);
+            break;
+        }
+
+        if (dirty_start > begin &&
+            !nbd_extent_array_add(extents, dirty_start - begin, 0, max)) {
+            break;
+        }
+        if (!nbd_extent_array_add(extents, dirty_bytes, NBD_STATE_DIRTY,
+                                  max)) {
+            break;
+        }
+        begin = dirty_start + dirty_bytes;
+    }
+
+    bdrv_dirty_bitmap_unlock(bitmap);
+}
+
+/* Send the extents of one meta context in a NBD_REPLY_TYPE_BLOCK_STATUS
+ * chunk.  @extents is converted to big endian in place. */
+static int coroutine_fn nbd_co_send_extents(NBDClient *client,
+                                            uint64_t handle,
+                                            GArray *extents,
+                                            uint32_t context_id,
+                                            bool last, Error **errp)
+{
+    NBDStructuredMeta chunk;
+    size_t len = extents->len * sizeof(NBDExtent);
+    unsigned int i;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+        {.iov_base = extents->data, .iov_len = len}
+    };
+
+    trace_nbd_co_send_extents(handle, extents->len, context_id, last);
+    for (i = 0; i < extents->len; i++) {
+        NBDExtent *ext = &g_array_index(extents, NBDExtent, i);
+        cpu_to_be32s(&ext->length);
+        cpu_to_be32s(&ext->flags);
+    }
+
+    set_be_chunk(&chunk.h, last ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_BLOCK_STATUS,
+                 handle, sizeof(chunk) - sizeof(chunk.h) + len);
+    stl_be_p(&chunk.context_id, context_id);
+
+    return nbd_co_send_iov(client, iov, 2, errp);
+}
+
+/* Compute the extents of all selected meta contexts for
+ * [@offset, @offset + @bytes).  Return -errno on error, 0 on success. */
+static int nbd_co_block_status(NBDClient *client, uint64_t offset,
+                               uint32_t bytes, bool req_one,
+                               GArray **ba_extents, GArray **bm_extents,
+                               Error **errp)
+{
+    NBDExport *exp = client->exp;
+    unsigned int max = req_one ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    int ret;
+
+    if (client->export_meta.base_allocation) {
+        *ba_extents = g_array_new(false, false, sizeof(NBDExtent));
+        ret = blockstatus_to_extents(blk_bs(exp->blk),
+                                     offset + exp->dev_offset, bytes,
+                                     *ba_extents, max);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "can't get block status");
+            return ret;
+        }
+    }
+
+    if (client->export_meta.bitmap) {
+        *bm_extents = g_array_new(false, false, sizeof(NBDExtent));
+        bitmap_to_extents(exp->export_bitmap, offset + exp->dev_offset, bytes,
+                          *bm_extents, max);
+    }
+
+    return 0;
+}
+
+/* Send one NBD_REPLY_TYPE_BLOCK_STATUS chunk per selected meta context,
+ * the last one carrying NBD_REPLY_FLAG_DONE. */
+static int coroutine_fn nbd_co_send_block_status(NBDClient *client,
+                                                 uint64_t handle,
+                                                 GArray *ba_extents,
+                                                 GArray *bm_extents,
+                                                 Error **errp)
+{
+    int ret;
+
+    if (ba_extents) {
+        ret = nbd_co_send_extents(client, handle, ba_extents,
+                                  NBD_META_ID_BASE_ALLOCATION, !bm_extents,
+                                  errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (bm_extents) {
+        ret = nbd_co_send_extents(client, handle, bm_extents,
+                                  NBD_META_ID_DIRTY_BITMAP, true, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Whether a read request is answered by nbd_co_send_sparse_read() */
+static bool nbd_read_is_sparse(NBDClient *client, NBDRequest *request)
+{
+    return client->structured_reply && request->len &&
+           !(request->flags & NBD_CMD_FLAG_DF);
+}
+
 /* nbd_co_receive_request
  * Collect a client request. Return 0 if request looks valid, -EIO to drop
  * connection right away, and any other negative value to report an error to
@@ -1383,10 +2148,14 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
             return -EINVAL;
         }
 
-        req->data = blk_try_blockalign(client->exp->blk, request->len);
-        if (req->data == NULL) {
-            error_setg(errp, "No memory");
-            return -ENOMEM;
+        /* Sparse reads allocate a buffer only if they need one */
+        if (request->type == NBD_CMD_WRITE ||
+            !nbd_read_is_sparse(client, request)) {
+            req->data = blk_try_blockalign(client->exp->blk, request->len);
+            if (req->data == NULL) {
+                error_setg(errp, "No memory");
+                return -ENOMEM;
+            }
         }
     }
     if (request->type == NBD_CMD_WRITE) {
@@ -1421,6 +2190,8 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
         valid_flags |= NBD_CMD_FLAG_DF;
     } else if (request->type == NBD_CMD_WRITE_ZEROES) {
         valid_flags |= NBD_CMD_FLAG_NO_HOLE;
+    } else if (request->type == NBD_CMD_BLOCK_STATUS) {
+        valid_flags |= NBD_CMD_FLAG_REQ_ONE;
     }
     if (request->flags & ~valid_flags) {
         error_setg(errp, "unsupported flags for command %s (got 0x%x)",
@@ -1441,6 +2212,7 @@ static coroutine_fn void nbd_trip(void *opaque)
     int ret;
     int flags;
     int reply_data_len = 0;
+    GArray *ba_extents = NULL, *bm_extents = NULL;
     Error *local_err = NULL;
     char *msg = NULL;
 
@@ -1481,6 +2253,17 @@ static coroutine_fn void nbd_trip(void *opaque)
             }
         }
 
+        if (nbd_read_is_sparse(client, &request)) {
+            ret = nbd_co_send_sparse_read(client, req, request.handle,
+                                          request.from, request.len,
+                                          &local_err);
+            if (ret < 0) {
+                error_prepend(&local_err, "Failed to send reply: ");
+                goto disconnect;
+            }
+            goto done;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1537,6 +2320,24 @@ static coroutine_fn void nbd_trip(void *opaque)
         }
 
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        if (!request.len) {
+            error_setg(&local_err, "need non-zero length");
+            ret = -EINVAL;
+            break;
+        }
+        if (!client->export_meta.valid ||
+            !(client->export_meta.base_allocation ||
+              client->export_meta.bitmap)) {
+            error_setg(&local_err, "CMD_BLOCK_STATUS not negotiated");
+            ret = -EINVAL;
+            break;
+        }
+
+        ret = nbd_co_block_status(client, request.from, request.len,
+                                  request.flags & NBD_CMD_FLAG_REQ_ONE,
+                                  &ba_extents, &bm_extents, &local_err);
+        break;
     default:
         error_setg(&local_err, "invalid request type (%" PRIu32 ") received",
                    request.type);
@@ -1554,14 +2355,20 @@ reply:
     }
 
     if (client->structured_reply &&
-        (ret < 0 || request.type == NBD_CMD_READ)) {
+        (ret < 0 || request.type == NBD_CMD_READ ||
+         request.type == NBD_CMD_BLOCK_STATUS)) {
         if (ret < 0) {
             ret = nbd_co_send_structured_error(req->client, request.handle,
                                                -ret, msg, &local_err);
+        } else if (request.type == NBD_CMD_BLOCK_STATUS) {
+            ret = nbd_co_send_block_status(req->client, request.handle,
+                                           ba_extents, bm_extents,
+                                           &local_err);
         } else if (reply_data_len) {
             ret = nbd_co_send_structured_read(req->client, request.handle,
                                               request.from, req->data,
-                                              reply_data_len, &local_err);
+                                              reply_data_len, true,
+                                              &local_err);
         } else {
             ret = nbd_co_send_structured_done(req->client, request.handle,
                                               &local_err);
@@ -1572,6 +2379,12 @@ reply:
                                        req->data, reply_data_len, &local_err);
     }
     g_free(msg);
+    if (ba_extents) {
+        g_array_free(ba_extents, true);
+    }
+    if (bm_extents) {
+        g_array_free(bm_extents, true);
+    }
     if (ret < 0) {
         error_prepend(&local_err, "Failed to send reply: ");
         goto disconnect;
@@ -1612,11 +2425,11 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
 {
     NBDClient *client = opaque;
     NBDExport *exp = client->exp;
+    AioContext *ctx;
     Error *local_err = NULL;
 
     if (exp) {
-        nbd_export_get(exp);
-        QTAILQ_INSERT_TAIL(&exp->clients, client, next);
+        nbd_client_attach_export(client, exp);
     }
     qemu_co_mutex_init(&client->send_lock);
 
@@ -1624,11 +2437,22 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
         if (local_err) {
             error_report_err(local_err);
         }
+        ctx = client->exp ? client->exp->ctx : qemu_get_aio_context();
+        aio_context_acquire(ctx);
         client_close(client, false);
+        aio_context_release(ctx);
         return;
     }
 
+    /* From now on the client is served from the export's AioContext; let
+     * that thread also poll the socket if it is not the main loop */
+    ctx = client->exp->ctx;
+    aio_context_acquire(ctx);
+    if (ctx != qemu_get_aio_context()) {
+        qio_channel_attach_aio_context(client->ioc, ctx);
+    }
     nbd_client_receive_next_request(client);
+    aio_context_release(ctx);
 }
 
 /*
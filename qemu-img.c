@@ -176,8 +176,11 @@ static void QEMU_NORETURN help(void)
            "\n"
            "Parameters to convert subcommand:\n"
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
-           "       process (defaults to 8)\n"
+           "       process; without it, the number starts at 8 and adapts to\n"
+           "       the measured throughput\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '-C' offload the copy to the storage if possible (e.g. copy_file_range\n"
+           "       between files on the same file system); cannot be used with -c or -S\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1527,6 +1530,29 @@ enum ImgConvertBlockStatus {
 
 #define MAX_COROUTINES 16
 
+/* Number of chunks that may wait for the preceding data to be written */
+#define MAX_PARKED_CHUNKS (2 * MAX_COROUTINES)
+
+/* Interval at which the number of parallel requests is adapted */
+#define CONVERT_DEPTH_INTERVAL_NS (200 * SCALE_MS)
+
+/* A range of the source with the same allocation status */
+typedef struct ConvertExtent {
+    int64_t sector_num;
+    int64_t nb_sectors;
+    enum ImgConvertBlockStatus status;
+} ConvertExtent;
+
+/* A chunk that has been read, but cannot be written yet because the data
+ * before it has not been written */
+typedef struct ConvertChunk {
+    int64_t sector_num;
+    int nb_sectors;
+    enum ImgConvertBlockStatus status;
+    uint8_t *buf;
+    QLIST_ENTRY(ConvertChunk) next;
+} ConvertChunk;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1538,11 +1564,16 @@ typedef struct ImgConvertState {
     int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
+    /* Block status of the whole source, collected before copying */
+    GArray *extents;
+    bool extents_complete;
+    unsigned int extent_index;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
     bool wr_in_order;
+    bool copy_range;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
@@ -1552,6 +1583,21 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+
+    /* Reorder buffer for in-order writes */
+    QLIST_HEAD(, ConvertChunk) parked;
+    int nb_parked;
+    GSList *free_bufs;
+
+    /* Only the first @depth coroutines issue requests.  If @adaptive_depth is
+     * true, @depth is adjusted according to the measured throughput. */
+    int depth;
+    bool adaptive_depth;
+    int depth_step;
+    CoQueue depth_queue;
+    int64_t interval_start_ns;
+    int64_t interval_sectors;
+    int64_t last_rate;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1566,6 +1612,50 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+static void convert_add_extent(ImgConvertState *s, int64_t sector_num,
+                               int64_t nb_sectors,
+                               enum ImgConvertBlockStatus status)
+{
+    ConvertExtent *last = NULL;
+    ConvertExtent extent = {
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .status     = status,
+    };
+
+    if (s->extents->len) {
+        last = &g_array_index(s->extents, ConvertExtent, s->extents->len - 1);
+    }
+    if (last && last->status == status &&
+        last->sector_num + last->nb_sectors == sector_num) {
+        last->nb_sectors += nb_sectors;
+    } else {
+        g_array_append_val(s->extents, extent);
+    }
+}
+
+/* Looks up the status of @sector_num in the extents collected before
+ * copying; requests come in increasing order, so the search can start at
+ * the extent used last.  Returns false if @sector_num is not covered. */
+static bool convert_lookup_extent(ImgConvertState *s, int64_t sector_num)
+{
+    ConvertExtent *extent;
+
+    while (s->extent_index < s->extents->len) {
+        extent = &g_array_index(s->extents, ConvertExtent, s->extent_index);
+        if (sector_num < extent->sector_num) {
+            return false;
+        }
+        if (sector_num < extent->sector_num + extent->nb_sectors) {
+            s->status = extent->status;
+            s->sector_next_status = extent->sector_num + extent->nb_sectors;
+            return true;
+        }
+        s->extent_index++;
+    }
+    return false;
+}
+
 static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
     int64_t src_cur_offset;
@@ -1576,7 +1666,8 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
 
-    if (s->sector_next_status <= sector_num) {
+    if (s->sector_next_status <= sector_num &&
+        !(s->extents_complete && convert_lookup_extent(s, sector_num))) {
         int64_t count = n * BDRV_SECTOR_SIZE;
 
         if (s->target_has_backing) {
@@ -1605,6 +1696,9 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         s->sector_next_status = sector_num + n;
+        if (!s->extents_complete) {
+            convert_add_extent(s, sector_num, n, s->status);
+        }
     }
 
     n = MIN(n, s->sector_next_status - sector_num);
@@ -1668,6 +1762,38 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+static int coroutine_fn convert_co_copy_range(ImgConvertState *s,
+                                              int64_t sector_num,
+                                              int nb_sectors)
+{
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        BlockBackend *blk;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
+
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+
+        ret = blk_co_copy_range(
+                blk, (sector_num - src_cur_offset) << BDRV_SECTOR_BITS,
+                s->target, sector_num << BDRV_SECTOR_BITS,
+                n << BDRV_SECTOR_BITS, 0, BDRV_REQ_NO_FALLBACK);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
                                          enum ImgConvertBlockStatus status)
@@ -1736,6 +1862,177 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
     return 0;
 }
 
+static uint8_t *convert_get_buffer(ImgConvertState *s)
+{
+    uint8_t *buf;
+
+    if (s->free_bufs) {
+        buf = s->free_bufs->data;
+        s->free_bufs = g_slist_delete_link(s->free_bufs, s->free_bufs);
+    } else {
+        buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    }
+    return buf;
+}
+
+static void convert_put_buffer(ImgConvertState *s, uint8_t *buf)
+{
+    s->free_bufs = g_slist_prepend(s->free_bufs, buf);
+}
+
+/*
+ * Queues a chunk that has been read, but cannot be written yet because the
+ * data before it has not been written.  The chunk is then written by the
+ * coroutine that writes the data before it, and the caller can go on with
+ * the next chunk instead of waiting.  If the chunk owns *@buf, a new buffer
+ * is returned in *@buf.
+ *
+ * Returns false if the reorder buffer is full.
+ */
+static bool convert_park_chunk(ImgConvertState *s, int64_t sector_num, int n,
+                               enum ImgConvertBlockStatus status,
+                               uint8_t **buf)
+{
+    ConvertChunk *chunk;
+
+    if (s->compressed || s->ret != -EINPROGRESS ||
+        s->nb_parked >= MAX_PARKED_CHUNKS) {
+        return false;
+    }
+
+    chunk = g_new(ConvertChunk, 1);
+    *chunk = (ConvertChunk) {
+        .sector_num = sector_num,
+        .nb_sectors = n,
+        .status     = status,
+    };
+    if (status == BLK_DATA) {
+        chunk->buf = *buf;
+        *buf = convert_get_buffer(s);
+    }
+    QLIST_INSERT_HEAD(&s->parked, chunk, next);
+    s->nb_parked++;
+    return true;
+}
+
+/*
+ * Adapts the number of parallel requests.  The depth keeps changing in the
+ * same direction as long as the throughput grows, turns around when it
+ * drops, and goes down when it stays the same: more requests in flight then
+ * only add latency.
+ */
+static void coroutine_fn convert_account_write(ImgConvertState *s, int n)
+{
+    int64_t now, rate;
+    int depth;
+
+    if (!s->adaptive_depth) {
+        return;
+    }
+
+    s->interval_sectors += n;
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (now - s->interval_start_ns < CONVERT_DEPTH_INTERVAL_NS) {
+        return;
+    }
+
+    rate = s->interval_sectors * NANOSECONDS_PER_SECOND /
+           (now - s->interval_start_ns);
+    if (rate * 20 < s->last_rate * 19) {
+        s->depth_step = -s->depth_step;
+    } else if (rate * 20 <= s->last_rate * 21) {
+        s->depth_step = -1;
+    }
+
+    depth = s->depth + s->depth_step;
+    if (depth < 1 || depth > s->num_coroutines) {
+        s->depth_step = -s->depth_step;
+        depth = s->depth + s->depth_step;
+    }
+
+    s->last_rate = rate;
+    s->interval_start_ns = now;
+    s->interval_sectors = 0;
+
+    if (depth > s->depth) {
+        s->depth = depth;
+        qemu_co_queue_restart_all(&s->depth_queue);
+    } else {
+        s->depth = depth;
+    }
+}
+
+/* Writes the parked chunks that directly follow @sector_num.  Returns the
+ * sector at which the next write starts. */
+static int64_t coroutine_fn convert_co_write_parked(ImgConvertState *s,
+                                                    int64_t sector_num)
+{
+    ConvertChunk *chunk;
+    int ret;
+
+    while (s->ret == -EINPROGRESS) {
+        QLIST_FOREACH(chunk, &s->parked, next) {
+            if (chunk->sector_num == sector_num) {
+                break;
+            }
+        }
+        if (!chunk) {
+            break;
+        }
+        QLIST_REMOVE(chunk, next);
+        s->nb_parked--;
+
+        s->wr_offs = sector_num;
+        ret = convert_co_write(s, chunk->sector_num, chunk->nb_sectors,
+                               chunk->buf, chunk->status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", chunk->sector_num, strerror(-ret));
+            s->ret = ret;
+        } else if (chunk->status == BLK_DATA) {
+            convert_account_write(s, chunk->nb_sectors);
+        }
+
+        sector_num += chunk->nb_sectors;
+        if (chunk->buf) {
+            convert_put_buffer(s, chunk->buf);
+        }
+        g_free(chunk);
+    }
+
+    return sector_num;
+}
+
+/* Lets the coroutine waiting to write at @sector_num go on */
+static void coroutine_fn convert_co_wake_next(ImgConvertState *s,
+                                              int64_t sector_num, bool defer)
+{
+    int i;
+
+    s->wr_offs = sector_num;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1 && !defer &&
+            s->ret != -EINPROGRESS) {
+            /* The data that some coroutines wait for may be in a parked
+             * chunk that is never going to be written; let them all go */
+            qemu_coroutine_enter(s->co[i]);
+        } else if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            if (defer) {
+                /* Runs once the current coroutine yields */
+                aio_co_wake(s->co[i]);
+            } else {
+                /*
+                 * A -> B -> A cannot occur because A has
+                 * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                 * B will never enter A during this time window.
+                 */
+                qemu_coroutine_enter(s->co[i]);
+            }
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1758,6 +2055,13 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int n;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
+        bool copy_range;
+
+        /* Coroutines beyond the current depth stay idle */
+        while (index >= s->depth && s->ret == -EINPROGRESS &&
+               s->sector_num < s->total_sectors) {
+            qemu_co_queue_wait(&s->depth_queue, NULL);
+        }
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1787,7 +2091,9 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
                                         s->allocated_sectors, 0);
         }
 
-        if (status == BLK_DATA) {
+retry:
+        copy_range = s->copy_range && status == BLK_DATA;
+        if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
                 error_report("error while reading sector %" PRId64
@@ -1800,7 +2106,12 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         }
 
         if (s->wr_in_order) {
-            /* keep writes in order */
+            /* keep writes in order, but don't let the read pipeline stall
+             * while the data before this chunk is still being read */
+            if (s->wr_offs != sector_num && !copy_range &&
+                convert_park_chunk(s, sector_num, n, status, &buf)) {
+                continue;
+            }
             while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
                 s->wait_sector_num[index] = sector_num;
                 qemu_coroutine_yield();
@@ -1808,36 +2119,47 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
             s->wait_sector_num[index] = -1;
         }
 
+        if (s->wr_in_order && s->compressed) {
+            /* Compressed clusters are placed in the order in which the
+             * writes are issued, so the next write need not wait for this
+             * one to complete: let it be issued as soon as this coroutine
+             * yields in convert_co_write(), and have both clusters
+             * compressed in parallel */
+            convert_co_wake_next(s, sector_num + n, true);
+        }
+
         if (s->ret == -EINPROGRESS) {
-            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (copy_range) {
+                ret = convert_co_copy_range(s, sector_num, n);
+                if (ret == -ENOTSUP) {
+                    /* Offloading is not possible, copy through the buffer */
+                    s->copy_range = false;
+                    goto retry;
+                }
+            } else {
+                ret = convert_co_write(s, sector_num, n, buf, status);
+            }
             if (ret < 0) {
                 error_report("error while writing sector %" PRId64
                              ": %s", sector_num, strerror(-ret));
                 s->ret = ret;
+            } else if (status == BLK_DATA) {
+                convert_account_write(s, n);
             }
         }
 
-        if (s->wr_in_order) {
-            /* reenter the coroutine that might have waited
-             * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+        if (s->wr_in_order && !s->compressed) {
+            /* write the chunks that were read meanwhile, then reenter the
+             * coroutine that might have waited for this write to complete */
+            convert_co_wake_next(s, convert_co_write_parked(s, sector_num + n),
+                                 false);
         }
     }
 
     qemu_vfree(buf);
     s->co[index] = NULL;
     s->running_coroutines--;
+    qemu_co_queue_restart_all(&s->depth_queue);
     if (!s->running_coroutines && s->ret == -EINPROGRESS) {
         /* the convert job finished successfully */
         s->ret = 0;
@@ -1873,10 +2195,14 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
+    /* Collect the block status of the whole source once, it is used both
+     * for progress reporting and for copying */
+    s->extents = g_array_new(false, false, sizeof(ConvertExtent));
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            return n;
+            ret = n;
+            goto out;
         }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
         {
@@ -1887,9 +2213,14 @@ static int convert_do_copy(ImgConvertState *s)
 
     /* Do the copy */
     s->sector_next_status = 0;
+    s->extents_complete = true;
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->depth_queue);
+    QLIST_INIT(&s->parked);
+    s->depth_step = 1;
+    s->interval_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     for (i = 0; i < s->num_coroutines; i++) {
         s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
         s->wait_sector_num[i] = -1;
@@ -1900,15 +2231,28 @@ static int convert_do_copy(ImgConvertState *s)
         main_loop_wait(false);
     }
 
+    /* Chunks are left over only after errors */
+    while (!QLIST_EMPTY(&s->parked)) {
+        ConvertChunk *chunk = QLIST_FIRST(&s->parked);
+
+        assert(s->ret < 0);
+        QLIST_REMOVE(chunk, next);
+        qemu_vfree(chunk->buf);
+        g_free(chunk);
+    }
+    g_slist_free_full(s->free_bufs, qemu_vfree);
+    s->free_bufs = NULL;
+
+    ret = s->ret;
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, NULL, 0);
-        if (ret < 0) {
-            return ret;
-        }
     }
 
-    return s->ret;
+out:
+    g_array_free(s->extents, true);
+    s->extents = NULL;
+    return ret;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1928,6 +2272,7 @@ static int img_convert(int argc, char **argv)
          skip_create = false, progress = false, tgt_image_opts = false;
     int64_t ret = -EINVAL;
     bool force_share = false;
+    bool explicit_min_sparse = false;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -1935,6 +2280,7 @@ static int img_convert(int argc, char **argv)
         .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
         .wr_in_order        = true,
         .num_coroutines     = 8,
+        .adaptive_depth     = true,
     };
 
     for(;;) {
@@ -1946,7 +2292,7 @@ static int img_convert(int argc, char **argv)
             {"target-image-opts", no_argument, 0, OPTION_TARGET_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:O:B:co:s:l:S:pt:T:qnm:WU",
+        c = getopt_long(argc, argv, ":hf:O:B:Cco:s:l:S:pt:T:qnm:WU",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1970,6 +2316,9 @@ static int img_convert(int argc, char **argv)
         case 'B':
             out_baseimg = optarg;
             break;
+        case 'C':
+            s.copy_range = true;
+            break;
         case 'c':
             s.compressed = true;
             break;
@@ -2013,6 +2362,7 @@ static int img_convert(int argc, char **argv)
             }
 
             s.min_sparse = sval / BDRV_SECTOR_SIZE;
+            explicit_min_sparse = true;
             break;
         }
         case 'p':
@@ -2037,6 +2387,7 @@ static int img_convert(int argc, char **argv)
                              " coroutines is between 1 and %d", MAX_COROUTINES);
                 goto fail_getopt;
             }
+            s.adaptive_depth = false;
             break;
         case 'W':
             s.wr_in_order = false;
@@ -2077,6 +2428,22 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    /* Without -m, start with the default depth and let it adapt */
+    s.depth = s.num_coroutines;
+    if (s.adaptive_depth) {
+        s.num_coroutines = MAX_COROUTINES;
+    }
+
+    if (s.copy_range && s.compressed) {
+        error_report("Cannot enable copy offloading when -c is used");
+        goto fail_getopt;
+    }
+
+    if (s.copy_range && explicit_min_sparse) {
+        error_report("Cannot enable copy offloading when -S is used");
+        goto fail_getopt;
+    }
+
     if (tgt_image_opts && !skip_create) {
         error_report("--target-image-opts requires use of -n flag");
         goto fail_getopt;
@@ -3873,7 +4240,8 @@ static int img_bench(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hc:d:f:no:qs:S:t:wU", long_options, NULL);
+        c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
+                        NULL);
         if (c == -1) {
             break;
         }
@@ -3916,6 +4284,12 @@ static int img_bench(int argc, char **argv)
         case 'n':
             flags |= BDRV_O_NATIVE_AIO;
             break;
+        case 'i':
+            if (bdrv_parse_aio(optarg, &flags) < 0) {
+                error_report("Invalid aio option: %s", optarg);
+                return 1;
+            }
+            break;
         case 'o':
         {
             offset = cvtnum(optarg);
@@ -50,6 +50,7 @@
 #define QEMU_NBD_OPT_TLSCREDS      261
 #define QEMU_NBD_OPT_IMAGE_OPTS    262
 #define QEMU_NBD_OPT_FORK          263
+#define QEMU_NBD_OPT_THREADS       264
 
 #define MBR_SIZE 512
 
@@ -66,6 +67,18 @@ static QIOChannelSocket *server_ioc;
 static int server_watch = -1;
 static QCryptoTLSCreds *tlscreds;
 
+/* A thread serving one replica of the export from its own AioContext */
+typedef struct NBDIOThread {
+    QemuThread thread;
+    AioContext *ctx;
+    BlockBackend *blk;
+    NBDExport *exp;
+    bool stopping;
+} NBDIOThread;
+
+static NBDIOThread *io_threads;
+static int nb_io_threads;
+
 static void usage(const char *name)
 {
     (printf) (
@@ -81,10 +94,13 @@ static void usage(const char *name)
 "  -k, --socket=PATH         path to the unix socket\n"
 "                            (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
+"  --threads=NUM             with -r, serve clients from NUM threads (default '1')\n"
 "  -t, --persistent          don't exit on the last connection\n"
 "  -v, --verbose             display extra debugging information\n"
 "  -x, --export-name=NAME    expose export by name\n"
 "  -D, --description=TEXT    with -x, also export a human-readable description\n"
+"  -B, --bitmap=NAME         with -x, also export dirty bitmap NAME as a\n"
+"                            block status metadata context\n"
 "\n"
 "Exposing part of the image:\n"
 "  -o, --offset=OFFSET       offset into the image\n"
@@ -117,7 +133,7 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-"      --aio=MODE            set AIO mode (native or threads)\n"
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, unmap)\n"
 "      --image-opts          treat FILE as a full set of image options\n"
@@ -334,16 +350,92 @@ static void nbd_export_closed(NBDExport *exp)
 
 static void nbd_update_server_watch(void);
 
-static void nbd_client_closed(NBDClient *client, bool negotiated)
+static void nbd_client_closed_bh(void *opaque)
 {
+    bool negotiated = GPOINTER_TO_INT(opaque);
+
     nb_fds--;
     if (negotiated && nb_fds == 0 && !persistent && state == RUNNING) {
         state = TERMINATE;
     }
     nbd_update_server_watch();
+}
+
+static void nbd_client_closed(NBDClient *client, bool negotiated)
+{
+    /* Clients of replicas are closed in their I/O thread, but the listening
+     * socket is only handled by the main loop */
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), nbd_client_closed_bh,
+                            GINT_TO_POINTER(negotiated));
     nbd_client_put(client);
 }
 
+static void *nbd_io_thread_run(void *opaque)
+{
+    NBDIOThread *t = opaque;
+
+    while (!atomic_read(&t->stopping)) {
+        aio_poll(t->ctx, true);
+    }
+    return NULL;
+}
+
+/* Open the image once more in a new AioContext, export it as a replica of
+ * @exp and start a thread to serve it. */
+static void nbd_io_thread_start(NBDIOThread *t, const char *filename,
+                                QDict *options, int flags, off_t dev_offset,
+                                off_t fd_size, const char *bitmap,
+                                uint16_t nbdflags, bool writethrough,
+                                Error **errp)
+{
+    Error *local_err = NULL;
+
+    t->ctx = aio_context_new(&local_err);
+    if (!t->ctx) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    t->blk = blk_new_open(filename, NULL,
+                          options ? qdict_clone_shallow(options) : NULL,
+                          flags, &local_err);
+    if (!t->blk) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    blk_set_enable_write_cache(t->blk, !writethrough);
+    blk_set_aio_context(t->blk, t->ctx);
+
+    t->exp = nbd_export_new(blk_bs(t->blk), dev_offset, fd_size, bitmap,
+                            nbdflags, NULL, writethrough, NULL, &local_err);
+    if (!t->exp) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    nbd_export_add_replica(exp, t->exp);
+
+    qemu_thread_create(&t->thread, "nbd-io", nbd_io_thread_run, t,
+                       QEMU_THREAD_JOINABLE);
+}
+
+/* Stop the thread of @t, wait in the main loop until the clients of its
+ * replica are gone, and drop the replica. */
+static void nbd_io_thread_stop(NBDIOThread *t)
+{
+    atomic_set(&t->stopping, true);
+    aio_notify(t->ctx);
+    qemu_thread_join(&t->thread);
+
+    aio_context_acquire(t->ctx);
+    while (nbd_export_has_clients(t->exp)) {
+        aio_poll(t->ctx, true);
+    }
+    nbd_export_put(t->exp);
+    blk_unref(t->blk);
+    aio_context_release(t->ctx);
+    aio_context_unref(t->ctx);
+}
+
 static gboolean nbd_accept(QIOChannel *ioc, GIOCondition cond, gpointer opaque)
 {
     QIOChannelSocket *cioc;
@@ -514,7 +606,7 @@ int main(int argc, char **argv)
     off_t fd_size;
     QemuOpts *sn_opts = NULL;
     const char *sn_id_or_name = NULL;
-    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:f:tl:x:T:D:";
+    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:f:tl:x:T:D:B:";
     struct option lopt[] = {
         { "help", no_argument, NULL, 'h' },
         { "version", no_argument, NULL, 'V' },
@@ -541,13 +633,16 @@ int main(int argc, char **argv)
         { "object", required_argument, NULL, QEMU_NBD_OPT_OBJECT },
         { "export-name", required_argument, NULL, 'x' },
         { "description", required_argument, NULL, 'D' },
+        { "bitmap", required_argument, NULL, 'B' },
         { "tls-creds", required_argument, NULL, QEMU_NBD_OPT_TLSCREDS },
         { "image-opts", no_argument, NULL, QEMU_NBD_OPT_IMAGE_OPTS },
         { "trace", required_argument, NULL, 'T' },
         { "fork", no_argument, NULL, QEMU_NBD_OPT_FORK },
+        { "threads", required_argument, NULL, QEMU_NBD_OPT_THREADS },
         { NULL, 0, NULL, 0 }
     };
     int ch;
+    int i;
     int opt_ind = 0;
     char *end;
     int flags = BDRV_O_RDWR;
@@ -563,11 +658,14 @@ int main(int argc, char **argv)
     QDict *options = NULL;
     const char *export_name = NULL;
     const char *export_description = NULL;
+    const char *bitmap = NULL;
     const char *tlscredsid = NULL;
     bool imageOpts = false;
     bool writethrough = true;
     char *trace_file = NULL;
     bool fork_process = false;
+    int threads = 1;
+    QDict *replica_options = NULL;
     int old_stderr = -1;
     unsigned socket_activation;
 
@@ -616,13 +714,9 @@ int main(int argc, char **argv)
                 exit(EXIT_FAILURE);
             }
             seen_aio = true;
-            if (!strcmp(optarg, "native")) {
-                flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(optarg, "threads")) {
-                /* this is the default */
-            } else {
-               error_report("invalid aio mode `%s'", optarg);
-               exit(EXIT_FAILURE);
+            if (bdrv_parse_aio(optarg, &flags) < 0) {
+                error_report("invalid aio mode `%s'", optarg);
+                exit(EXIT_FAILURE);
             }
             break;
         case QEMU_NBD_OPT_DISCARD:
@@ -735,6 +829,9 @@ int main(int argc, char **argv)
         case 'D':
             export_description = optarg;
             break;
+        case 'B':
+            bitmap = optarg;
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -770,6 +867,18 @@ int main(int argc, char **argv)
         case QEMU_NBD_OPT_FORK:
             fork_process = true;
             break;
+        case QEMU_NBD_OPT_THREADS:
+        {
+            long val;
+
+            if (qemu_strtol(optarg, NULL, 0, &val) < 0 ||
+                val < 1 || val > INT_MAX) {
+                error_report("Invalid number of threads '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            threads = val;
+            break;
+        }
         }
     }
 
@@ -779,6 +888,17 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if (threads > 1) {
+        /* Every thread opens the image on its own, so they can only agree on
+         * its contents if nobody writes to it */
+        if ((flags & (BDRV_O_RDWR | BDRV_O_SNAPSHOT)) ||
+            sn_opts || sn_id_or_name) {
+            error_report("--threads requires a read-only export (-r) and "
+                         "cannot be used with -s or -l");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if (qemu_opts_foreach(&qemu_object_opts,
                           user_creatable_add_opts_foreach,
                           NULL, NULL)) {
@@ -956,12 +1076,18 @@ int main(int argc, char **argv)
         }
         options = qemu_opts_to_qdict(opts, NULL);
         qemu_opts_reset(&file_opts);
+        if (threads > 1) {
+            replica_options = qdict_clone_shallow(options);
+        }
         blk = blk_new_open(NULL, NULL, options, flags, &local_err);
     } else {
         if (fmt) {
             options = qdict_new();
             qdict_put_str(options, "driver", fmt);
         }
+        if (threads > 1 && options) {
+            replica_options = qdict_clone_shallow(options);
+        }
         blk = blk_new_open(srcpath, NULL, options, flags, &local_err);
     }
 
@@ -1013,8 +1139,8 @@ int main(int argc, char **argv)
         }
     }
 
-    exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed,
-                         writethrough, NULL, &local_err);
+    exp = nbd_export_new(bs, dev_offset, fd_size, bitmap, nbdflags,
+                         nbd_export_closed, writethrough, NULL, &local_err);
     if (!exp) {
         error_report_err(local_err);
         exit(EXIT_FAILURE);
@@ -1026,8 +1152,24 @@ int main(int argc, char **argv)
     } else if (export_description) {
         error_report("Export description requires an export name");
         exit(EXIT_FAILURE);
+    } else if (bitmap) {
+        error_report("Bitmap export requires an export name");
+        exit(EXIT_FAILURE);
     }
 
+    nb_io_threads = threads - 1;
+    io_threads = g_new0(NBDIOThread, nb_io_threads);
+    for (i = 0; i < nb_io_threads; i++) {
+        nbd_io_thread_start(&io_threads[i], imageOpts ? NULL : srcpath,
+                            replica_options, flags, dev_offset, fd_size,
+                            bitmap, nbdflags, writethrough, &local_err);
+        if (local_err) {
+            error_reportf_err(local_err, "Failed to start I/O thread: ");
+            exit(EXIT_FAILURE);
+        }
+    }
+    QDECREF(replica_options);
+
     if (device) {
         int ret;
 
@@ -1067,6 +1209,11 @@ int main(int argc, char **argv)
         }
     } while (state != TERMINATED);
 
+    for (i = 0; i < nb_io_threads; i++) {
+        nbd_io_thread_stop(&io_threads[i]);
+    }
+    g_free(io_threads);
+
     blk_unref(blk);
     if (sockpath) {
         unlink(sockpath);
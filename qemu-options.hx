@@ -750,6 +750,11 @@ The maximum total size of the L2 table and refcount block caches in bytes
 The maximum size of the L2 table cache in bytes
 (default: 4/5 of the total cache size)
 
+@item l2-cache-entry-size
+The size of each entry in the L2 table cache in bytes, a power of two between
+512 and the cluster size (default: 4096 bytes or the cluster size, whichever is
+smaller)
+
 @item refcount-cache-size
 The maximum size of the refcount block cache in bytes
 (default: 1/5 of the total cache size)
@@ -758,6 +763,10 @@ The maximum size of the refcount block cache in bytes
 Clean unused entries in the L2 and refcount caches. The interval is in seconds.
 The default value is 0 and it disables this feature.
 
+@item compressed-cache-size
+The maximum size of the cache for decompressed clusters in bytes; at least one
+cluster is cached (default: 1048576 bytes)
+
 @item pass-discard-request
 Whether discard requests to the qcow2 device should be forwarded to the data
 source (on/off; default: on if discard=unmap is specified, off otherwise)
@@ -799,7 +808,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -871,7 +880,7 @@ unsafe       │ on                off            on
 The default mode is @option{cache=writeback}.
 
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike "native", "io_uring" does not require @option{cache.direct=on}.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specify format=raw to avoid interpreting
@@ -2891,6 +2900,12 @@ Example for Unix Domain Sockets
 qemu-system-i386 --drive file=nbd:unix:/tmp/nbd-socket
 @end example
 
+If the server supports multiple connections to the same export, the
+@option{connections} option spreads the requests over several connections:
+@example
+qemu-system-i386 --drive file=nbd:unix:/tmp/nbd-socket,file.connections=4
+@end example
+
 @item SSH
 QEMU supports SSH (Secure Shell) access to remote disks.
 
@@ -2903,6 +2918,21 @@ qemu-system-i386 -drive file.driver=ssh,file.user=user,file.host=host,file.port=
 Currently authentication must be done using ssh-agent.  Other
 authentication methods may be supported in future.
 
+@item NVMe
+On Linux hosts, QEMU can drive an NVMe controller directly from userspace
+with VFIO, bypassing the host kernel block layer.  The controller must be
+bound to the @code{vfio-pci} driver and is then used exclusively by one
+QEMU block node; guest RAM is mapped into the IOMMU of the device.
+
+Syntax for specifying an NVMe namespace is
+``nvme://<pci-address>/<namespace>''
+
+Examples:
+@example
+qemu-system-x86_64 -drive file=nvme://0000:44:00.0/1,if=none,id=drive0
+qemu-system-x86_64 -drive file.driver=nvme,file.device=0000:44:00.0,file.namespace=1,if=none,id=drive0
+@end example
+
 @item Sheepdog
 Sheepdog is a distributed storage system for QEMU.
 QEMU supports using either local sheepdog devices or remote networked
@@ -3920,6 +3950,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                restore a migration saved to the given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3938,6 +3970,9 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{filename}
+Restore a migration that was saved with @code{migrate file:@var{filename}}.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
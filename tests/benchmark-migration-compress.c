@@ -0,0 +1,197 @@
+/*
+ * Migration page compression speed benchmark
+ *
+ * Reports compression and decompression throughput together with the
+ * compression ratio of every compression method built into QEMU.
+ *
+ * The pages come from a raw guest memory dump (for example one saved with
+ * the "pmemsave" monitor command) named by the QEMU_MIGRATION_CORPUS
+ * environment variable.  Zero pages are skipped, because migration sends
+ * them without compressing them.  When no corpus is given, a synthetic
+ * one that mixes text, page-table-like and random pages is used.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qapi/error.h"
+#include "../migration/compress.h"
+
+#define PAGE_SIZE 4096
+#define SYNTHETIC_PAGES 4096
+#define COMPRESS_LEVEL 1
+
+static uint8_t *corpus;
+static size_t corpus_pages;
+
+static void fill_text_page(uint8_t *page)
+{
+    static const char *const words[] = {
+        "qemu", "guest", "kernel", "memory", "page", "the", "of", "and",
+        "migration", "device", "error", "return", "static", "int", "void",
+    };
+    size_t i = 0;
+
+    while (i < PAGE_SIZE) {
+        const char *w = words[g_test_rand_int_range(0, ARRAY_SIZE(words))];
+        size_t len = MIN(strlen(w), PAGE_SIZE - i);
+
+        memcpy(page + i, w, len);
+        i += len;
+        if (i < PAGE_SIZE) {
+            page[i++] = g_test_rand_int_range(0, 8) ? ' ' : '\n';
+        }
+    }
+}
+
+static void fill_table_page(uint8_t *page)
+{
+    uint64_t *entry = (uint64_t *)page;
+    uint64_t addr = (uint64_t)g_test_rand_int() << 12;
+    size_t i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(*entry); i++) {
+        entry[i] = g_test_rand_int_range(0, 4) ? (addr + (i << 12)) | 0x67 : 0;
+    }
+}
+
+static void fill_random_page(uint8_t *page)
+{
+    uint32_t *word = (uint32_t *)page;
+    size_t i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(*word); i++) {
+        word[i] = g_test_rand_int();
+    }
+}
+
+static void corpus_synthesize(void)
+{
+    size_t i;
+
+    corpus = g_malloc(SYNTHETIC_PAGES * PAGE_SIZE);
+    for (i = 0; i < SYNTHETIC_PAGES; i++) {
+        uint8_t *page = corpus + i * PAGE_SIZE;
+
+        switch (g_test_rand_int_range(0, 8)) {
+        case 0:
+            fill_random_page(page);
+            break;
+        case 1:
+        case 2:
+        case 3:
+            fill_table_page(page);
+            break;
+        default:
+            fill_text_page(page);
+            break;
+        }
+    }
+    corpus_pages = SYNTHETIC_PAGES;
+}
+
+static void corpus_load(const char *filename)
+{
+    GError *err = NULL;
+    gchar *data;
+    gsize len, i;
+
+    if (!g_file_get_contents(filename, &data, &len, &err)) {
+        g_printerr("cannot read corpus: %s\n", err->message);
+        g_error_free(err);
+        exit(1);
+    }
+
+    corpus = g_malloc(len);
+    for (i = 0; i + PAGE_SIZE <= len; i += PAGE_SIZE) {
+        if (!buffer_is_zero(data + i, PAGE_SIZE)) {
+            memcpy(corpus + corpus_pages * PAGE_SIZE, data + i, PAGE_SIZE);
+            corpus_pages++;
+        }
+    }
+    g_free(data);
+
+    if (!corpus_pages) {
+        g_printerr("corpus %s has no non-zero pages\n", filename);
+        exit(1);
+    }
+}
+
+static void test_compress_speed(const void *opaque)
+{
+    MigrationCompressMethod method = (uintptr_t)opaque;
+    size_t bound = migration_compress_bound(method, PAGE_SIZE);
+    MigrationCompress *comp, *decomp;
+    uint8_t *out, *page;
+    size_t *out_len;
+    double in_mb = 0.0, out_bytes = 0.0, comp_secs, decomp_secs;
+    size_t i;
+    ssize_t ret;
+
+    comp = migration_compress_new(method, COMPRESS_LEVEL, false,
+                                  &error_abort);
+    decomp = migration_compress_new(method, 0, true, &error_abort);
+    out = g_malloc(corpus_pages * bound);
+    out_len = g_new(size_t, corpus_pages);
+    page = g_malloc(PAGE_SIZE);
+
+    /* One context per direction, as each migration thread uses */
+    g_test_timer_start();
+    for (i = 0; i < corpus_pages; i++) {
+        ret = migration_compress_buffer(comp, corpus + i * PAGE_SIZE,
+                                        PAGE_SIZE, out + i * bound, bound);
+        g_assert(ret > 0);
+        out_len[i] = ret;
+        out_bytes += ret;
+    }
+    comp_secs = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < corpus_pages; i++) {
+        ret = migration_decompress_buffer(decomp, out + i * bound, out_len[i],
+                                          page, PAGE_SIZE);
+        g_assert(ret == PAGE_SIZE);
+        g_assert(memcmp(page, corpus + i * PAGE_SIZE, PAGE_SIZE) == 0);
+    }
+    decomp_secs = g_test_timer_elapsed();
+
+    in_mb = (double)corpus_pages * PAGE_SIZE / (1024 * 1024);
+    g_print("%s: ", MigrationCompressMethod_str(method));
+    g_print("%zu pages, ratio %.2f, ", corpus_pages,
+            corpus_pages * PAGE_SIZE / out_bytes);
+    g_print("compress %.2f MB/sec, ", in_mb / comp_secs);
+    g_print("decompress %.2f MB/sec\n", in_mb / decomp_secs);
+
+    g_free(page);
+    g_free(out_len);
+    g_free(out);
+    migration_compress_free(decomp);
+    migration_compress_free(comp);
+}
+
+int main(int argc, char **argv)
+{
+    const char *filename = getenv("QEMU_MIGRATION_CORPUS");
+    char name[64];
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (filename) {
+        corpus_load(filename);
+    } else {
+        corpus_synthesize();
+    }
+
+    for (i = 0; i < MIGRATION_COMPRESS_METHOD__MAX; i++) {
+        if (!migration_compress_method_supported(i)) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "/migration/compress/speed-%s",
+                 MigrationCompressMethod_str(i));
+        g_test_add_data_func(name, (void *)(uintptr_t)i, test_compress_speed);
+    }
+
+    return g_test_run();
+}
@@ -187,6 +187,165 @@ class FilePath(object):
         return False
 
 
+class NBDClient(object):
+    '''A minimal NBD client speaking the protocol directly
+
+    qemu's own NBD client does not use every feature of the server (for
+    example metadata contexts and NBD_CMD_BLOCK_STATUS), and it hides how
+    a reply was split into chunks.  This client negotiates structured
+    replies and exposes the raw chunks.
+    '''
+    OPT_GO = 7
+    OPT_STRUCTURED_REPLY = 8
+    OPT_LIST_META_CONTEXT = 9
+    OPT_SET_META_CONTEXT = 10
+
+    REP_ACK = 1
+    REP_INFO = 3
+    REP_META_CONTEXT = 4
+    REP_FLAG_ERROR = 1 << 31
+
+    CMD_READ = 0
+    CMD_DISC = 2
+    CMD_BLOCK_STATUS = 7
+    CMD_FLAG_DF = 1 << 2
+    CMD_FLAG_REQ_ONE = 1 << 3
+
+    REPLY_FLAG_DONE = 1
+    REPLY_TYPE_NONE = 0
+    REPLY_TYPE_OFFSET_DATA = 1
+    REPLY_TYPE_OFFSET_HOLE = 2
+    REPLY_TYPE_BLOCK_STATUS = 5
+    REPLY_TYPE_ERROR_BIT = 1 << 15
+
+    def __init__(self, path):
+        import socket
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.handle = 0
+
+        magic, optmagic, flags = struct.unpack('>8s8sH', self._recv(18))
+        assert magic == b'NBDMAGIC' and optmagic == b'IHAVEOPT'
+        # NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES
+        self.sock.sendall(struct.pack('>I', 3))
+
+    def _recv(self, length):
+        data = b''
+        while len(data) < length:
+            chunk = self.sock.recv(length - len(data))
+            if not chunk:
+                raise Exception('NBD server closed the connection')
+            data += chunk
+        return data
+
+    def option(self, opt, data=b''):
+        '''Send an option and return the list of (reply type, data) up to
+        the final reply'''
+        self.sock.sendall(struct.pack('>8sII', b'IHAVEOPT', opt, len(data)) +
+                          data)
+        replies = []
+        while True:
+            magic, ropt, rtype, length = struct.unpack('>QIII',
+                                                       self._recv(20))
+            assert magic == 0x3e889045565a9 and ropt == opt
+            replies.append((rtype, self._recv(length)))
+            if rtype == self.REP_ACK or rtype & self.REP_FLAG_ERROR:
+                return replies
+
+    def structured_reply(self):
+        return self.option(self.OPT_STRUCTURED_REPLY)[-1][0] == self.REP_ACK
+
+    def meta_context(self, opt, export, queries):
+        '''Send NBD_OPT_LIST_META_CONTEXT or NBD_OPT_SET_META_CONTEXT and
+        return a dict of context names to ids, or the error reply type'''
+        export = export.encode()
+        data = struct.pack('>I', len(export)) + export
+        data += struct.pack('>I', len(queries))
+        for q in queries:
+            data += struct.pack('>I', len(q)) + q.encode()
+
+        contexts = {}
+        for rtype, rdata in self.option(opt, data):
+            if rtype & self.REP_FLAG_ERROR:
+                return rtype
+            if rtype == self.REP_META_CONTEXT:
+                contexts[rdata[4:].decode()] = \
+                    struct.unpack('>I', rdata[:4])[0]
+        return contexts
+
+    def go(self, export):
+        '''Select @export with NBD_OPT_GO and return its size'''
+        export = export.encode()
+        size = None
+        for rtype, rdata in self.option(self.OPT_GO,
+                                        struct.pack('>I', len(export)) +
+                                        export + struct.pack('>H', 0)):
+            if rtype & self.REP_FLAG_ERROR:
+                raise Exception('NBD_OPT_GO failed: %#x' % rtype)
+            # NBD_INFO_EXPORT
+            if rtype == self.REP_INFO and \
+               struct.unpack('>H', rdata[:2])[0] == 0:
+                size = struct.unpack('>Q', rdata[2:10])[0]
+        return size
+
+    def request(self, cmd, offset, length, flags=0):
+        '''Send a command and return the list of structured reply chunks
+        as (flags, type, payload)'''
+        self.handle += 1
+        self.sock.sendall(struct.pack('>IHHQQI', 0x25609513, flags, cmd,
+                                      self.handle, offset, length))
+        chunks = []
+        while True:
+            magic, = struct.unpack('>I', self._recv(4))
+            assert magic == 0x668e33ef
+            cflags, ctype, handle, length = struct.unpack('>HHQI',
+                                                          self._recv(16))
+            assert handle == self.handle
+            chunks.append((cflags, ctype, self._recv(length)))
+            if cflags & self.REPLY_FLAG_DONE:
+                return chunks
+
+    def read(self, offset, length, flags=0):
+        '''Read with NBD_CMD_READ and return the data and the list of
+        chunks as (type, offset, length)'''
+        data = bytearray(length)
+        chunks = []
+        for cflags, ctype, payload in self.request(self.CMD_READ, offset,
+                                                   length, flags):
+            if ctype == self.REPLY_TYPE_OFFSET_DATA:
+                coffset, = struct.unpack('>Q', payload[:8])
+                clen = len(payload) - 8
+                data[coffset - offset:coffset - offset + clen] = payload[8:]
+            elif ctype == self.REPLY_TYPE_OFFSET_HOLE:
+                coffset, clen = struct.unpack('>QI', payload)
+            elif ctype == self.REPLY_TYPE_NONE:
+                continue
+            else:
+                raise Exception('unexpected reply chunk type %d' % ctype)
+            chunks.append((ctype, coffset, clen))
+        return bytes(data), chunks
+
+    def block_status(self, offset, length, flags=0):
+        '''Query NBD_CMD_BLOCK_STATUS and return a dict of context ids to
+        lists of (length, flags) extents'''
+        result = {}
+        for cflags, ctype, payload in self.request(self.CMD_BLOCK_STATUS,
+                                                   offset, length, flags):
+            if ctype & self.REPLY_TYPE_ERROR_BIT:
+                raise Exception('NBD_CMD_BLOCK_STATUS failed: %d' %
+                                struct.unpack('>I', payload[:4])[0])
+            assert ctype == self.REPLY_TYPE_BLOCK_STATUS
+            context, = struct.unpack('>I', payload[:4])
+            result[context] = [struct.unpack('>II', payload[i:i + 8])
+                               for i in range(4, len(payload), 8)]
+        return result
+
+    def close(self):
+        self.sock.sendall(struct.pack('>IHHQQI', 0x25609513, 0,
+                                      self.CMD_DISC, 0, 0, 0))
+        self.sock.close()
+
+
 class VM(qtest.QEMUQtestMachine):
     '''A QEMU VM'''
 
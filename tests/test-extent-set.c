@@ -0,0 +1,161 @@
+/*
+ * ExtentSet unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/extent-set.h"
+
+#define MODEL_SIZE 1024
+
+static void test_add(void)
+{
+    ExtentSet *set = extent_set_new();
+    uint64_t start;
+
+    g_assert(!extent_set_find(set, 1, &start));
+
+    extent_set_add(set, 10, 5);
+    extent_set_add(set, 30, 5);
+    g_assert_cmpint(extent_set_nb_extents(set), ==, 2);
+
+    /* Touching ranges are merged */
+    extent_set_add(set, 15, 5);
+    g_assert_cmpint(extent_set_nb_extents(set), ==, 2);
+    g_assert_cmpint(extent_set_count(set, 10, 100), ==, 10);
+
+    /* So are overlapping ones, across several extents */
+    extent_set_add(set, 50, 5);
+    extent_set_add(set, 12, 40);
+    g_assert_cmpint(extent_set_nb_extents(set), ==, 1);
+    g_assert_cmpint(extent_set_count(set, 10, 100), ==, 45);
+    g_assert_cmpint(extent_set_count(set, 54, 100), ==, 1);
+    g_assert_cmpint(extent_set_count(set, 55, 100), ==, 0);
+    g_assert_cmpint(extent_set_count(set, 9, 100), ==, 0);
+
+    /* Adding what is already there changes nothing */
+    extent_set_add(set, 20, 10);
+    g_assert_cmpint(extent_set_nb_extents(set), ==, 1);
+    g_assert_cmpint(extent_set_count(set, 10, 100), ==, 45);
+
+    extent_set_free(set);
+}
+
+static void test_remove(void)
+{
+    ExtentSet *set = extent_set_new();
+
+    extent_set_add(set, 0, 100);
+
+    /* Punch a hole */
+    extent_set_remove(set, 40, 10);
+    g_assert_cmpint(extent_set_nb_extents(set), ==, 2);
+    g_assert_cmpint(extent_set_count(set, 0, 1000), ==, 40);
+    g_assert_cmpint(extent_set_count(set, 45, 1000), ==, 0);
+    g_assert_cmpint(extent_set_count(set, 50, 1000), ==, 50);
+
+    /* Trim both ends of an extent and the whole of another */
+    extent_set_remove(set, 30, 30);
+    g_assert_cmpint(extent_set_nb_extents(set), ==, 2);
+    g_assert_cmpint(extent_set_count(set, 0, 1000), ==, 30);
+    g_assert_cmpint(extent_set_count(set, 60, 1000), ==, 40);
+
+    /* Removing what is not there changes nothing */
+    extent_set_remove(set, 200, 10);
+    g_assert_cmpint(extent_set_nb_extents(set), ==, 2);
+
+    extent_set_clear(set);
+    g_assert_cmpint(extent_set_nb_extents(set), ==, 0);
+    g_assert_cmpint(extent_set_count(set, 0, 1000), ==, 0);
+
+    extent_set_free(set);
+}
+
+static void test_find(void)
+{
+    ExtentSet *set = extent_set_new();
+    uint64_t start;
+
+    extent_set_add(set, 100, 2);
+    extent_set_add(set, 200, 8);
+    extent_set_add(set, 300, 4);
+    extent_set_add(set, 400, 16);
+
+    /* The lowest extent that is long enough wins */
+    g_assert(extent_set_find(set, 1, &start));
+    g_assert_cmpint(start, ==, 100);
+    g_assert(extent_set_find(set, 3, &start));
+    g_assert_cmpint(start, ==, 200);
+    g_assert(extent_set_find(set, 9, &start));
+    g_assert_cmpint(start, ==, 400);
+    g_assert(!extent_set_find(set, 17, &start));
+
+    extent_set_remove(set, 200, 8);
+    g_assert(extent_set_find(set, 3, &start));
+    g_assert_cmpint(start, ==, 300);
+
+    extent_set_free(set);
+}
+
+/* Compare against a bitmap after random updates */
+static void test_random(void)
+{
+    ExtentSet *set = extent_set_new();
+    bool *model = g_new0(bool, MODEL_SIZE + 1);
+    uint64_t i, j, start, expected;
+    int n;
+
+    for (n = 0; n < 5000; n++) {
+        uint64_t s = g_test_rand_int_range(0, MODEL_SIZE - 64);
+        uint64_t len = g_test_rand_int_range(0, 64);
+        bool add = g_test_rand_bit();
+
+        if (add) {
+            extent_set_add(set, s, len);
+        } else {
+            extent_set_remove(set, s, len);
+        }
+        for (i = s; i < s + len; i++) {
+            model[i] = add;
+        }
+    }
+
+    for (i = 0; i < MODEL_SIZE; i++) {
+        for (j = i; model[j]; j++) {
+            /* nothing */
+        }
+        g_assert_cmpint(extent_set_count(set, i, UINT32_MAX), ==, j - i);
+    }
+
+    for (n = 1; n < 32; n++) {
+        expected = UINT64_MAX;
+        for (i = 0; i < MODEL_SIZE && expected == UINT64_MAX; i = j + 1) {
+            for (j = i; model[j]; j++) {
+                /* nothing */
+            }
+            if (j - i >= n) {
+                expected = i;
+            }
+        }
+        if (expected == UINT64_MAX) {
+            g_assert(!extent_set_find(set, n, &start));
+        } else {
+            g_assert(extent_set_find(set, n, &start));
+            g_assert_cmpint(start, ==, expected);
+        }
+    }
+
+    g_free(model);
+    extent_set_free(set);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/extent-set/add", test_add);
+    g_test_add_func("/extent-set/remove", test_remove);
+    g_test_add_func("/extent-set/find", test_find);
+    g_test_add_func("/extent-set/random", test_random);
+    return g_test_run();
+}
@@ -902,6 +902,133 @@ static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
     }
 }
 
+static void hbitmap_test_next_zero_check(TestHBitmapData *data,
+                                         uint64_t start, uint64_t count)
+{
+    uint64_t end = MIN(start + count, data->size);
+    int64_t expected = -1;
+    uint64_t i;
+
+    for (i = start; i < end; i++) {
+        if (!hbitmap_get(data->hb, i)) {
+            expected = i;
+            break;
+        }
+    }
+    g_assert_cmpint(hbitmap_next_zero(data->hb, start, count), ==, expected);
+}
+
+static void hbitmap_test_next_dirty_area_check(TestHBitmapData *data,
+                                               uint64_t start, uint64_t count)
+{
+    uint64_t end = MIN(start + count, data->size);
+    uint64_t area_start = start, area_count = count;
+    uint64_t first, last;
+    bool found;
+
+    for (first = start; first < end && !hbitmap_get(data->hb, first);
+         first++) {
+        /* skip clean bits */
+    }
+    for (last = first; last < end && hbitmap_get(data->hb, last); last++) {
+        /* skip dirty bits */
+    }
+
+    found = hbitmap_next_dirty_area(data->hb, &area_start, &area_count);
+    if (first == end) {
+        g_assert(!found);
+        g_assert_cmpint(area_start, ==, start);
+        g_assert_cmpint(area_count, ==, count);
+    } else {
+        g_assert(found);
+        g_assert_cmpint(area_start, ==, first);
+        g_assert_cmpint(area_count, ==, last - first);
+    }
+}
+
+static void hbitmap_test_iter_area_check(TestHBitmapData *data,
+                                         uint64_t max_offset)
+{
+    HBitmapIter hbi;
+    uint64_t end = MIN(max_offset, data->size);
+    uint64_t offset, count, pos = 0;
+
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    while (hbitmap_iter_next_area(&hbi, max_offset, &offset, &count)) {
+        g_assert_cmpint(offset, >=, pos);
+        g_assert_cmpint(count, >, 0);
+        g_assert_cmpint(offset + count, <=, end);
+        for (; pos < offset; pos++) {
+            g_assert(!hbitmap_get(data->hb, pos));
+        }
+        for (; pos < offset + count; pos++) {
+            g_assert(hbitmap_get(data->hb, pos));
+        }
+        /* Areas are maximal */
+        g_assert(pos == end || !hbitmap_get(data->hb, pos));
+    }
+    for (; pos < end; pos++) {
+        g_assert(!hbitmap_get(data->hb, pos));
+    }
+}
+
+static void hbitmap_test_next_area_checks(TestHBitmapData *data)
+{
+    const uint64_t starts[] = {
+        0, 1, L1 - 1, L1, L1 + 1, L2 - 1, L2, L2 + 1, L3 / 2, L3 - 1,
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(starts); i++) {
+        uint64_t start = starts[i];
+
+        hbitmap_test_next_zero_check(data, start, data->size - start);
+        hbitmap_test_next_zero_check(data, start, L1);
+        hbitmap_test_next_zero_check(data, start, 1);
+        hbitmap_test_next_dirty_area_check(data, start, data->size - start);
+        hbitmap_test_next_dirty_area_check(data, start, L1);
+        hbitmap_test_next_dirty_area_check(data, start, 1);
+    }
+
+    hbitmap_test_iter_area_check(data, data->size);
+    hbitmap_test_iter_area_check(data, L2 + 3);
+}
+
+static void hbitmap_test_next_area_do(TestHBitmapData *data, int granularity)
+{
+    hbitmap_test_init(data, L3, granularity);
+    hbitmap_test_next_area_checks(data);
+
+    hbitmap_test_set(data, L2, 1);
+    hbitmap_test_next_area_checks(data);
+
+    hbitmap_test_set(data, L1 - 3, 7);
+    hbitmap_test_set(data, L2 + L1 + 5, L1 * 3);
+    hbitmap_test_next_area_checks(data);
+
+    hbitmap_test_set(data, L3 - L1 - 1, L1 + 1);
+    hbitmap_test_next_area_checks(data);
+
+    hbitmap_test_set(data, 0, L3);
+    hbitmap_test_next_area_checks(data);
+
+    hbitmap_test_reset(data, L2 + 1, L1);
+    hbitmap_test_reset(data, L3 - 1, 1);
+    hbitmap_test_next_area_checks(data);
+}
+
+static void test_hbitmap_next_area_0(TestHBitmapData *data,
+                                     const void *unused)
+{
+    hbitmap_test_next_area_do(data, 0);
+}
+
+static void test_hbitmap_next_area_4(TestHBitmapData *data,
+                                     const void *unused)
+{
+    hbitmap_test_next_area_do(data, 4);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -985,6 +1112,9 @@ int main(int argc, char **argv)
 
     hbitmap_test_add("/hbitmap/iter/iter_and_reset",
                      test_hbitmap_iter_and_reset);
+
+    hbitmap_test_add("/hbitmap/next_area/0", test_hbitmap_next_area_0);
+    hbitmap_test_add("/hbitmap/next_area/4", test_hbitmap_next_area_4);
     g_test_run();
 
     return 0;
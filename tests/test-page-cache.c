@@ -0,0 +1,174 @@
+/*
+ * XBZRLE page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define CACHE_PAGES 64
+/* Must match CACHE_WAYS in migration/page_cache.c */
+#define CACHE_WAYS 8
+#define CACHE_SETS (CACHE_PAGES / CACHE_WAYS)
+
+static uint8_t page[PAGE_SIZE];
+
+/* Address of the @n-th page that maps to set 0 */
+static uint64_t set0_addr(unsigned n)
+{
+    return (uint64_t)n * CACHE_SETS * PAGE_SIZE;
+}
+
+static void fill_page(unsigned n)
+{
+    memset(page, n, PAGE_SIZE);
+}
+
+static bool page_matches(PageCache *cache, uint64_t addr, unsigned n)
+{
+    uint8_t *data = get_cached_data(cache, addr);
+
+    fill_page(n);
+    return data && memcmp(data, page, PAGE_SIZE) == 0;
+}
+
+static void test_init(void)
+{
+    Error *err = NULL;
+    PageCache *cache;
+
+    cache = cache_init(PAGE_SIZE - 1, PAGE_SIZE, &err);
+    error_free_or_abort(&err);
+    g_assert(!cache);
+
+    cache = cache_init(3 * PAGE_SIZE, PAGE_SIZE, &err);
+    error_free_or_abort(&err);
+    g_assert(!cache);
+
+    cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    g_assert_cmpint(cache_get_size(cache), ==, CACHE_PAGES * PAGE_SIZE);
+    g_assert(!cache_is_cached(cache, 0, 1));
+    g_assert(!get_cached_data(cache, 0));
+    cache_fini(cache);
+}
+
+/* Pages that share a set must not evict each other while there is room */
+static void test_associativity(void)
+{
+    PageCache *cache;
+    unsigned i;
+
+    cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE, &error_abort);
+
+    for (i = 0; i < CACHE_WAYS; i++) {
+        fill_page(i);
+        g_assert_cmpint(cache_insert(cache, set0_addr(i), page, 1), ==, 0);
+    }
+    for (i = 0; i < CACHE_WAYS; i++) {
+        g_assert(cache_is_cached(cache, set0_addr(i), 1));
+        g_assert(page_matches(cache, set0_addr(i), i));
+    }
+
+    /* Updating a cached page does not take another way */
+    fill_page(0x55);
+    g_assert_cmpint(cache_insert(cache, set0_addr(3), page, 1), ==, 0);
+    g_assert(page_matches(cache, set0_addr(3), 0x55));
+
+    cache_fini(cache);
+}
+
+static void test_replacement(void)
+{
+    PageCache *cache;
+    unsigned i;
+
+    cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE, &error_abort);
+
+    for (i = 0; i < CACHE_WAYS; i++) {
+        fill_page(i);
+        g_assert_cmpint(cache_insert(cache, set0_addr(i), page, 1), ==, 0);
+    }
+
+    /* A full set of fresh pages refuses new ones */
+    fill_page(0xaa);
+    g_assert_cmpint(cache_insert(cache, set0_addr(CACHE_WAYS), page, 2),
+                    ==, -1);
+    g_assert(!get_cached_data(cache, set0_addr(CACHE_WAYS)));
+
+    /* Touch every page but 5, which becomes the least recently used */
+    for (i = 0; i < CACHE_WAYS; i++) {
+        if (i != 5) {
+            g_assert(cache_is_cached(cache, set0_addr(i), 3));
+        }
+    }
+    g_assert(cache_is_cached(cache, set0_addr(5), 1));
+    g_assert_cmpint(cache_insert(cache, set0_addr(CACHE_WAYS), page, 4),
+                    ==, 1);
+    g_assert(!get_cached_data(cache, set0_addr(5)));
+    g_assert(page_matches(cache, set0_addr(CACHE_WAYS), 0xaa));
+    for (i = 0; i < CACHE_WAYS; i++) {
+        if (i != 5) {
+            g_assert(page_matches(cache, set0_addr(i), i));
+        }
+    }
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    Error *err = NULL;
+    PageCache *cache;
+    uint64_t addr;
+    unsigned i, found;
+
+    cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE, &error_abort);
+
+    for (i = 0; i < CACHE_PAGES; i++) {
+        fill_page(i);
+        g_assert_cmpint(cache_insert(cache, (uint64_t)i * PAGE_SIZE, page, i),
+                        ==, 0);
+    }
+
+    g_assert_cmpint(cache_resize(cache, 3 * PAGE_SIZE, &err), ==, -1);
+    error_free_or_abort(&err);
+    g_assert_cmpint(cache_get_size(cache), ==, CACHE_PAGES * PAGE_SIZE);
+
+    /* Growing keeps every page */
+    g_assert_cmpint(cache_resize(cache, 2 * CACHE_PAGES * PAGE_SIZE,
+                                 &error_abort), ==, 0);
+    g_assert_cmpint(cache_get_size(cache), ==, 2 * CACHE_PAGES * PAGE_SIZE);
+    for (i = 0; i < CACHE_PAGES; i++) {
+        g_assert(page_matches(cache, (uint64_t)i * PAGE_SIZE, i));
+    }
+
+    /* Shrinking keeps the most recently used pages */
+    g_assert_cmpint(cache_resize(cache, CACHE_PAGES / 4 * PAGE_SIZE,
+                                 &error_abort), ==, 0);
+    found = 0;
+    for (i = 0; i < CACHE_PAGES; i++) {
+        addr = (uint64_t)i * PAGE_SIZE;
+        if (get_cached_data(cache, addr)) {
+            g_assert(page_matches(cache, addr, i));
+            g_assert_cmpint(i, >=, CACHE_PAGES - CACHE_PAGES / 4);
+            found++;
+        }
+    }
+    g_assert_cmpint(found, ==, CACHE_PAGES / 4);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/init", test_init);
+    g_test_add_func("/page_cache/associativity", test_associativity);
+    g_test_add_func("/page_cache/replacement", test_replacement);
+    g_test_add_func("/page_cache/resize", test_resize);
+    return g_test_run();
+}
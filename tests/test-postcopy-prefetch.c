@@ -0,0 +1,142 @@
+/*
+ * Postcopy fault stream prediction unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "migration/postcopy-prefetch.h"
+
+#define PAGES 4096
+#define DEPTH 64
+
+static const char block0[] = "block0";
+static const char block1[] = "block1";
+
+/*
+ * Drive a stream of faults with @stride from @start, where all prefetched
+ * pages arrive in time: the guest only faults right after each window.
+ * The window must double on every fault up to DEPTH.
+ */
+static void check_stream(int64_t start, int64_t stride)
+{
+    PostcopyPrefetchStats stats = { 0 };
+    PostcopyPrefetch *pf = postcopy_prefetch_new(DEPTH, &stats);
+    int64_t page, next, n, window, used = 0, requested = 0;
+    int64_t next_stride;
+    int i;
+
+    g_assert_cmpint(postcopy_prefetch_fault(pf, block0, start, PAGES,
+                                            &next, &next_stride), ==, 0);
+
+    page = start + stride;
+    window = 2;
+    for (i = 0; i < 12; i++) {
+        n = postcopy_prefetch_fault(pf, block0, page, PAGES,
+                                    &next, &next_stride);
+        g_assert_cmpint(n, ==, window);
+        g_assert_cmpint(next, ==, page + stride);
+        g_assert_cmpint(next_stride, ==, stride);
+        requested += n;
+
+        /* The whole window was used when the next fault comes */
+        g_assert_cmpint(stats.used, ==, used);
+        used += n;
+        page = next + n * stride;
+        window = MIN(window * 2, DEPTH);
+    }
+
+    g_assert_cmpint(stats.requested, ==, requested);
+    g_assert_cmpint(stats.wasted, ==, 0);
+
+    /* The last window was never reached */
+    postcopy_prefetch_free(pf);
+    g_assert_cmpint(stats.used, ==, used - DEPTH);
+    g_assert_cmpint(stats.wasted, ==, DEPTH);
+}
+
+static void test_sequential(void)
+{
+    check_stream(0, 1);
+}
+
+static void test_strided(void)
+{
+    check_stream(100, 3);
+    check_stream(PAGES - 1, -2);
+}
+
+/* A fault on a page that is still on its way keeps the stream */
+static void test_late_page(void)
+{
+    PostcopyPrefetchStats stats = { 0 };
+    PostcopyPrefetch *pf = postcopy_prefetch_new(DEPTH, &stats);
+    int64_t next, stride;
+
+    postcopy_prefetch_fault(pf, block0, 10, PAGES, &next, &stride);
+    g_assert_cmpint(postcopy_prefetch_fault(pf, block0, 11, PAGES,
+                                            &next, &stride), ==, 2);
+
+    /* Page 12 was requested, but the guest got there first */
+    g_assert_cmpint(postcopy_prefetch_fault(pf, block0, 12, PAGES,
+                                            &next, &stride), ==, 3);
+    g_assert_cmpint(next, ==, 14);
+    g_assert_cmpint(stats.used, ==, 1);
+    g_assert_cmpint(stats.requested, ==, 5);
+
+    postcopy_prefetch_free(pf);
+    g_assert_cmpint(stats.wasted, ==, 4);
+}
+
+/* Faults in other blocks or far away do not disturb a stream */
+static void test_interleaved(void)
+{
+    PostcopyPrefetchStats stats = { 0 };
+    PostcopyPrefetch *pf = postcopy_prefetch_new(DEPTH, &stats);
+    int64_t next, stride;
+
+    postcopy_prefetch_fault(pf, block0, 0, PAGES, &next, &stride);
+    postcopy_prefetch_fault(pf, block1, 1, PAGES, &next, &stride);
+    postcopy_prefetch_fault(pf, block0, 2000, PAGES, &next, &stride);
+    g_assert_cmpint(postcopy_prefetch_fault(pf, block0, 1, PAGES,
+                                            &next, &stride), ==, 2);
+    postcopy_prefetch_fault(pf, block1, 3000, PAGES, &next, &stride);
+    g_assert_cmpint(postcopy_prefetch_fault(pf, block0, 4, PAGES,
+                                            &next, &stride), ==, 4);
+    g_assert_cmpint(next, ==, 5);
+    g_assert_cmpint(stats.used, ==, 2);
+
+    postcopy_prefetch_free(pf);
+    g_assert_cmpint(stats.wasted, ==, 4);
+}
+
+/* No pages are requested past the end of the block */
+static void test_block_end(void)
+{
+    PostcopyPrefetchStats stats = { 0 };
+    PostcopyPrefetch *pf = postcopy_prefetch_new(DEPTH, &stats);
+    int64_t next, stride;
+
+    postcopy_prefetch_fault(pf, block0, PAGES - 3, PAGES, &next, &stride);
+    g_assert_cmpint(postcopy_prefetch_fault(pf, block0, PAGES - 2, PAGES,
+                                            &next, &stride), ==, 1);
+    g_assert_cmpint(next, ==, PAGES - 1);
+    g_assert_cmpint(postcopy_prefetch_fault(pf, block0, PAGES - 1, PAGES,
+                                            &next, &stride), ==, 0);
+
+    postcopy_prefetch_free(pf);
+    g_assert_cmpint(stats.used, ==, 1);
+    g_assert_cmpint(stats.wasted, ==, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/postcopy_prefetch/sequential", test_sequential);
+    g_test_add_func("/postcopy_prefetch/strided", test_strided);
+    g_test_add_func("/postcopy_prefetch/late_page", test_late_page);
+    g_test_add_func("/postcopy_prefetch/interleaved", test_interleaved);
+    g_test_add_func("/postcopy_prefetch/block_end", test_block_end);
+    return g_test_run();
+}
@@ -16,6 +16,8 @@
 #include "../migration/xbzrle.h"
 
 #define PAGE_SIZE 4096
+#define ACCEL_PAGES 1024
+#define MAX_ACCELS 8
 
 static void test_uleb(void)
 {
@@ -174,6 +176,101 @@ static void test_encode_decode(void)
     }
 }
 
+/* Dirty a page the way guests do: a few short writes, some of them no-ops */
+static void dirty_page(uint8_t *page, int writes, int max_len)
+{
+    int i, j, pos, len;
+
+    for (i = 0; i < writes; i++) {
+        pos = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_len + 1);
+        for (j = pos; j < pos + len && j < PAGE_SIZE; j++) {
+            if (g_test_rand_int_range(0, 4)) {
+                page[j] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+}
+
+/*
+ * Run every encoder variant on the same pages, check that they produce
+ * exactly the same output, and report their speed when run with -m perf.
+ * This switches xbzrle_encode_buffer() down to the integer version, so
+ * it must be the last test.
+ */
+static void test_encode_accel(void)
+{
+    uint8_t *old_buf = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *out[MAX_ACCELS];
+    int *out_len[MAX_ACCELS];
+    uint8_t *test = g_malloc(PAGE_SIZE);
+    int n, i, rounds, accels = 0;
+    double total;
+
+    for (i = 0; i < ACCEL_PAGES * PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, ACCEL_PAGES * PAGE_SIZE);
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        dirty_page(new_buf + i * PAGE_SIZE, g_test_rand_int_range(0, 200),
+                   1 << (i % 8));
+    }
+
+    do {
+        g_assert(accels < MAX_ACCELS);
+        out[accels] = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+        out_len[accels] = g_new(int, ACCEL_PAGES);
+
+        rounds = g_test_perf() ? 100 : 1;
+        g_test_timer_start();
+        for (n = 0; n < rounds; n++) {
+            for (i = 0; i < ACCEL_PAGES; i++) {
+                out_len[accels][i] =
+                    xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                         new_buf + i * PAGE_SIZE, PAGE_SIZE,
+                                         out[accels] + i * PAGE_SIZE,
+                                         PAGE_SIZE);
+            }
+        }
+        total = (double)rounds * ACCEL_PAGES * PAGE_SIZE / (1024 * 1024);
+        g_test_timer_elapsed();
+        if (g_test_perf()) {
+            g_test_minimized_result(g_test_timer_last(),
+                                    "%s: %.2f MB/sec",
+                                    test_xbzrle_encode_accel_name(),
+                                    total / g_test_timer_last());
+        }
+        accels++;
+    } while (test_xbzrle_encode_next_accel());
+
+    /* The last variant is the integer version, check everything against it */
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        int ref = out_len[accels - 1][i];
+        uint8_t *ref_buf = out[accels - 1] + i * PAGE_SIZE;
+
+        for (n = 0; n < accels - 1; n++) {
+            g_assert_cmpint(out_len[n][i], ==, ref);
+            if (ref > 0) {
+                g_assert(memcmp(out[n] + i * PAGE_SIZE, ref_buf, ref) == 0);
+            }
+        }
+        if (ref >= 0) {
+            memcpy(test, old_buf + i * PAGE_SIZE, PAGE_SIZE);
+            g_assert(xbzrle_decode_buffer(ref_buf, ref, test, PAGE_SIZE) >= 0);
+            g_assert(memcmp(test, new_buf + i * PAGE_SIZE, PAGE_SIZE) == 0);
+        }
+    }
+
+    for (n = 0; n < accels; n++) {
+        g_free(out[n]);
+        g_free(out_len[n]);
+    }
+    g_free(test);
+    g_free(new_buf);
+    g_free(old_buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +283,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
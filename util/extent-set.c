@@ -0,0 +1,278 @@
+/*
+ * Sets of disjoint 64-bit extents
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/extent-set.h"
+
+/*
+ * The extents are the nodes of a treap ordered by start.  Each node caches
+ * the length of the longest extent in its subtree, which lets
+ * extent_set_find() skip the subtrees that cannot satisfy a request.
+ * All updates are done with the usual split and merge primitives.
+ */
+typedef struct ExtentNode ExtentNode;
+
+struct ExtentNode {
+    uint64_t start;
+    uint64_t len;
+    uint64_t max_len;
+    uint32_t prio;
+    ExtentNode *left;
+    ExtentNode *right;
+};
+
+struct ExtentSet {
+    ExtentNode *root;
+    uint64_t nb_extents;
+    uint32_t seed;
+};
+
+static inline uint64_t extent_end(const ExtentNode *n)
+{
+    return n->start + n->len;
+}
+
+static inline void extent_node_update(ExtentNode *n)
+{
+    n->max_len = n->len;
+    if (n->left && n->left->max_len > n->max_len) {
+        n->max_len = n->left->max_len;
+    }
+    if (n->right && n->right->max_len > n->max_len) {
+        n->max_len = n->right->max_len;
+    }
+}
+
+static ExtentNode *extent_node_new(ExtentSet *set, uint64_t start,
+                                   uint64_t len)
+{
+    ExtentNode *n = g_new0(ExtentNode, 1);
+
+    /* xorshift32 */
+    set->seed ^= set->seed << 13;
+    set->seed ^= set->seed >> 17;
+    set->seed ^= set->seed << 5;
+
+    n->start = start;
+    n->len = len;
+    n->max_len = len;
+    n->prio = set->seed;
+    set->nb_extents++;
+    return n;
+}
+
+static void extent_node_free(ExtentSet *set, ExtentNode *n)
+{
+    if (n) {
+        extent_node_free(set, n->left);
+        extent_node_free(set, n->right);
+        set->nb_extents--;
+        g_free(n);
+    }
+}
+
+/* Split @t into the nodes that start before @key and the others */
+static void extent_split(ExtentNode *t, uint64_t key,
+                         ExtentNode **l, ExtentNode **r)
+{
+    if (!t) {
+        *l = *r = NULL;
+    } else if (t->start < key) {
+        extent_split(t->right, key, &t->right, r);
+        extent_node_update(t);
+        *l = t;
+    } else {
+        extent_split(t->left, key, l, &t->left);
+        extent_node_update(t);
+        *r = t;
+    }
+}
+
+/* Merge two treaps; all the nodes of @l must come before those of @r */
+static ExtentNode *extent_merge(ExtentNode *l, ExtentNode *r)
+{
+    if (!l) {
+        return r;
+    }
+    if (!r) {
+        return l;
+    }
+    if (l->prio > r->prio) {
+        l->right = extent_merge(l->right, r);
+        extent_node_update(l);
+        return l;
+    } else {
+        r->left = extent_merge(l, r->left);
+        extent_node_update(r);
+        return r;
+    }
+}
+
+/* Detach the last node of @t and return it */
+static ExtentNode *extent_pop_last(ExtentNode **t)
+{
+    ExtentNode *n = *t;
+
+    if (n->right) {
+        ExtentNode *last = extent_pop_last(&n->right);
+        extent_node_update(n);
+        return last;
+    }
+    *t = n->left;
+    n->left = NULL;
+    extent_node_update(n);
+    return n;
+}
+
+static ExtentNode *extent_last(ExtentNode *t)
+{
+    while (t && t->right) {
+        t = t->right;
+    }
+    return t;
+}
+
+ExtentSet *extent_set_new(void)
+{
+    ExtentSet *set = g_new0(ExtentSet, 1);
+
+    set->seed = 0x9e3779b9;
+    return set;
+}
+
+void extent_set_clear(ExtentSet *set)
+{
+    extent_node_free(set, set->root);
+    set->root = NULL;
+    assert(set->nb_extents == 0);
+}
+
+void extent_set_free(ExtentSet *set)
+{
+    if (set) {
+        extent_set_clear(set);
+        g_free(set);
+    }
+}
+
+void extent_set_add(ExtentSet *set, uint64_t start, uint64_t len)
+{
+    uint64_t end = start + len;
+    ExtentNode *l, *m, *r, *last;
+
+    assert(end >= start && end < UINT64_MAX);
+    if (!len) {
+        return;
+    }
+
+    /* Absorb the extent that ends at or after @start, if any */
+    extent_split(set->root, start, &l, &r);
+    last = extent_last(l);
+    if (last && extent_end(last) >= start) {
+        last = extent_pop_last(&l);
+        start = last->start;
+        end = MAX(end, extent_end(last));
+        extent_node_free(set, last);
+    }
+
+    /* And all the extents that start within the new range or right after */
+    extent_split(r, end + 1, &m, &r);
+    last = extent_last(m);
+    if (last) {
+        end = MAX(end, extent_end(last));
+    }
+    extent_node_free(set, m);
+
+    set->root = extent_merge(extent_merge(l, extent_node_new(set, start,
+                                                             end - start)),
+                             r);
+}
+
+void extent_set_remove(ExtentSet *set, uint64_t start, uint64_t len)
+{
+    uint64_t end = start + len;
+    ExtentNode *l, *m, *r, *last, *tail = NULL;
+
+    assert(end >= start && end < UINT64_MAX);
+    if (!len) {
+        return;
+    }
+
+    /* Cut the extent that starts before @start and ends after it */
+    extent_split(set->root, start, &l, &r);
+    last = extent_last(l);
+    if (last && extent_end(last) > start) {
+        uint64_t last_end = extent_end(last);
+
+        last = extent_pop_last(&l);
+        last->len = start - last->start;
+        extent_node_update(last);
+        l = extent_merge(l, last);
+        if (last_end > end) {
+            tail = extent_node_new(set, end, last_end - end);
+        }
+    }
+
+    /* Drop the extents that start within the range, keeping what is left
+     * of the last one */
+    extent_split(r, end, &m, &r);
+    last = extent_last(m);
+    if (last && extent_end(last) > end) {
+        assert(!tail);
+        tail = extent_node_new(set, end, extent_end(last) - end);
+    }
+    extent_node_free(set, m);
+
+    set->root = extent_merge(l, extent_merge(tail, r));
+}
+
+bool extent_set_find(ExtentSet *set, uint64_t min_len, uint64_t *start)
+{
+    ExtentNode *n = set->root;
+
+    assert(min_len > 0);
+    if (!n || n->max_len < min_len) {
+        return false;
+    }
+
+    for (;;) {
+        if (n->left && n->left->max_len >= min_len) {
+            n = n->left;
+        } else if (n->len >= min_len) {
+            *start = n->start;
+            return true;
+        } else {
+            n = n->right;
+            assert(n && n->max_len >= min_len);
+        }
+    }
+}
+
+uint64_t extent_set_count(ExtentSet *set, uint64_t start, uint64_t max)
+{
+    ExtentNode *n = set->root, *found = NULL;
+
+    /* Find the last extent that starts at or before @start */
+    while (n) {
+        if (n->start <= start) {
+            found = n;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
+    }
+
+    if (!found || extent_end(found) <= start) {
+        return 0;
+    }
+    return MIN(extent_end(found) - start, max);
+}
+
+uint64_t extent_set_nb_extents(ExtentSet *set)
+{
+    return set->nb_extents;
+}
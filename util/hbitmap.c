@@ -188,6 +188,125 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     }
 }
 
+/* Number of items covered by @hb, i.e. the size passed to hbitmap_alloc
+ * rounded up to the granularity.  */
+static uint64_t hb_items(const HBitmap *hb)
+{
+    return hb->size << hb->granularity;
+}
+
+/* Make @hbi return -1 from now on.  The level 0 sentinel stops
+ * hbitmap_iter_skip_words once the bits of the last word are gone.  */
+static void hbitmap_iter_finish(HBitmapIter *hbi)
+{
+    hbitmap_iter_init(hbi, hbi->hb, (hbi->hb->size - 1) << hbi->granularity);
+    hbi->cur[HBITMAP_LEVELS - 1] = 0;
+}
+
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
+{
+    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t first_bit, end_bit;
+    size_t pos, end_pos;
+    unsigned long cur;
+    int64_t res;
+
+    if (start >= hb_items(hb) || count == 0) {
+        return -1;
+    }
+
+    first_bit = start >> hb->granularity;
+    if (count > hb_items(hb) - start) {
+        end_bit = hb->size;
+    } else {
+        end_bit = ((start + count - 1) >> hb->granularity) + 1;
+    }
+
+    /* Bits before @start may be zero; we are not interested in them, so
+     * pretend they are set.  Then skip whole words that are all ones.  */
+    pos = first_bit >> BITS_PER_LEVEL;
+    end_pos = (end_bit + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    cur = last_lev[pos] | ((1UL << (first_bit & (BITS_PER_LONG - 1))) - 1);
+    while (cur == ~0UL) {
+        if (++pos >= end_pos) {
+            return -1;
+        }
+        cur = last_lev[pos];
+    }
+
+    res = ((uint64_t)pos << BITS_PER_LEVEL) + ctzl(~cur);
+    if (res >= end_bit) {
+        return -1;
+    }
+
+    /* The group containing @start may begin before it */
+    return MAX(res << hb->granularity, start);
+}
+
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count)
+{
+    HBitmapIter hbi;
+    uint64_t end;
+    int64_t first_dirty, area_end;
+
+    if (*start >= hb_items(hb) || *count == 0) {
+        return false;
+    }
+    end = MIN(hb_items(hb) - *start, *count) + *start;
+
+    /* The upper levels of the tree let the iterator skip clean areas */
+    hbitmap_iter_init(&hbi, hb, *start);
+    first_dirty = hbitmap_iter_next(&hbi);
+    if (first_dirty < 0 || first_dirty >= end) {
+        return false;
+    }
+    first_dirty = MAX(first_dirty, *start);
+
+    area_end = hbitmap_next_zero(hb, first_dirty, end - first_dirty);
+    if (area_end < 0) {
+        area_end = end;
+    }
+
+    *start = first_dirty;
+    *count = area_end - first_dirty;
+    return true;
+}
+
+bool hbitmap_iter_next_area(HBitmapIter *hbi, uint64_t max_offset,
+                            uint64_t *offset, uint64_t *count)
+{
+    const HBitmap *hb = hbi->hb;
+    int64_t first_dirty, area_end;
+    uint64_t next;
+
+    max_offset = MIN(max_offset, hb_items(hb));
+
+    first_dirty = hbitmap_iter_next(hbi);
+    if (first_dirty < 0 || first_dirty >= max_offset) {
+        return false;
+    }
+
+    area_end = hbitmap_next_zero(hb, first_dirty, max_offset - first_dirty);
+    if (area_end < 0) {
+        area_end = max_offset;
+    }
+
+    /* Continue behind the area instead of visiting each of its bits.  The
+     * area only ends inside a group if it was clipped to @max_offset, and
+     * the rest of that group is not interesting then.  */
+    next = ROUND_UP(area_end, UINT64_C(1) << hb->granularity);
+    if (next < hb_items(hb)) {
+        hbitmap_iter_init(hbi, hb, next);
+    } else {
+        hbitmap_iter_finish(hbi);
+    }
+
+    *offset = first_dirty;
+    *count = area_end - first_dirty;
+    return true;
+}
+
 bool hbitmap_empty(const HBitmap *hb)
 {
     return hb->count == 0;